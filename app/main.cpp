@@ -3,6 +3,7 @@
 #include "RpcHost.h"
 #include "RpcClient.h"
 #include <thread>
+#include <iostream>
 
 using Rapscallion::RpcHost;
 using Rapscallion::RpcClient;
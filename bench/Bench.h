@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+namespace Rapscallion {
+namespace bench {
+
+// Runs f, which performs `operations` operations, a few times and returns the best time per operation
+// in nanoseconds.
+template <typename F>
+double nsPerOp(size_t operations, F f) {
+  double best = 1e300;
+  for (int run = 0; run < 5; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / operations);
+  }
+  return best;
+}
+
+// Keeps the optimizer from discarding a result.
+template <typename T>
+void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+inline void section(const char* title) {
+  printf("\n%s\n", title);
+}
+
+inline void row(const std::string& name, const std::string& values) {
+  printf("  %-44s %s\n", name.c_str(), values.c_str());
+}
+
+inline std::string format(const char* fmt, double a, double b = 0, double c = 0, double d = 0) {
+  char text[256];
+  snprintf(text, sizeof(text), fmt, a, b, c, d);
+  return text;
+}
+
+void serializers();
+void deserializer();
+void loopback();
+
+}
+}
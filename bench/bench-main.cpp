@@ -0,0 +1,17 @@
+#include "Bench.h"
+#include <cstring>
+
+// Usage: RaPsCallion.Bench [serializer|deserializer|loopback]...
+int main(int argc, char** argv) {
+  using namespace Rapscallion::bench;
+  auto wanted = [argc, argv](const char* name) {
+    if (argc < 2) return true;
+    for (int n = 1; n < argc; ++n) {
+      if (strcmp(argv[n], name) == 0) return true;
+    }
+    return false;
+  };
+  if (wanted("serializer")) serializers();
+  if (wanted("deserializer")) deserializer();
+  if (wanted("loopback")) loopback();
+}
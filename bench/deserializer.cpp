@@ -0,0 +1,57 @@
+#include "Bench.h"
+#include <Serializer.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace Rapscallion {
+namespace bench {
+namespace {
+
+// A stream of frames of the given payload sizes, as it would arrive on a socket.
+std::vector<uint8_t> frames(const std::vector<size_t>& sizes) {
+  std::vector<uint8_t> stream;
+  for (size_t size : sizes) {
+    Serializer s(size);
+    s.addBytes(std::string(size, 'x').data(), size);
+    stream.insert(stream.end(), s.data(), s.data() + s.size());
+  }
+  return stream;
+}
+
+// Feeds the stream in reads of readSize bytes and splits it into frames again.
+void measure(const std::string& name, const std::vector<size_t>& sizes, size_t readSize) {
+  const std::vector<uint8_t> stream = frames(sizes);
+  double ns = nsPerOp(sizes.size(), [&]{
+    Deserializer d;
+    size_t count = 0;
+    for (size_t offset = 0; offset < stream.size(); offset += readSize) {
+      d.AddBytes(stream.data() + offset, std::min(readSize, stream.size() - offset));
+      while (d.HasFullPacket()) {
+        ++count;
+        d.RemovePacket();
+      }
+    }
+    keep(count);
+  });
+  const double bytesPerFrame = double(stream.size()) / sizes.size();
+  row(name, format("%8.1f ns/frame   %8.1f Mframes/s   %8.1f MB/s", ns, 1e3 / ns, bytesPerFrame * 1e3 / ns));
+}
+
+}
+
+void deserializer() {
+  section("Deserializer::HasFullPacket and RemovePacket (frames split from 64 KiB reads)");
+  std::mt19937_64 random(2);
+  std::vector<size_t> small(1 << 16), mixed(1 << 14), large(64);
+  for (auto& size : small) size = 8 + random() % 56;
+  for (auto& size : mixed) size = random() % 4 == 0 ? 1024 + random() % 16384 : 8 + random() % 120;
+  for (auto& size : large) size = 1 << 20;
+  measure("8 to 64 byte frames", small, 65536);
+  measure("mixed frames (mostly small)", mixed, 65536);
+  measure("1 MiB frames", large, 65536);
+}
+
+}
+}
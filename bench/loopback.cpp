@@ -0,0 +1,223 @@
+#include "Bench.h"
+#include <Dispatcher.h>
+#include <Proxy.h>
+#include <RpcClient.h>
+#include <RpcHost.h>
+#include <SharedMemory.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace Rapscallion {
+namespace bench {
+
+struct CalcDispatcher;
+struct CalcProxy;
+
+struct Calc {
+  typedef CalcDispatcher Dispatcher;
+  typedef CalcProxy Proxy;
+  virtual future<int> add(int a, int b) = 0;
+  virtual future<std::string> echo(std::string text) = 0;
+};
+
+struct CalcDispatcher : public DispatcherBase<Calc> {
+  CalcDispatcher(Calc* inst)
+  : DispatcherBase<Calc>(inst)
+  {
+    DISPATCH_FUNC(add);
+    DISPATCH_FUNC(echo);
+  }
+};
+
+struct CalcProxy : public ProxyBase<Calc> {
+  CalcProxy(RpcClient& conn)
+  : ProxyBase<Calc>(conn)
+  {}
+  future<int> add(int a, int b) override {
+    return call(PROXY_METHOD(add), a, b);
+  }
+  future<std::string> echo(std::string text) override {
+    return call(PROXY_METHOD(echo), text);
+  }
+};
+
+struct CalcImpl : Calc {
+  future<int> add(int a, int b) override {
+    return boost::make_ready_future(a + b);
+  }
+  future<std::string> echo(std::string text) override {
+    return boost::make_ready_future<std::string>(text);
+  }
+};
+
+namespace {
+
+// An RpcHost on an ephemeral loopback port, run by ioThreads threads.
+struct Host {
+  Host(size_t ioThreads)
+  : host(io_service, 0)
+  {
+    host.Register(&impl);
+    host.run(ioThreads);
+  }
+  ~Host() {
+    io_service.stop();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    if (!path.empty()) ::unlink(path.c_str());
+#endif
+#if defined(__linux__)
+    if (!sharedPath.empty()) ::unlink(sharedPath.c_str());
+#endif
+  }
+  std::vector<std::unique_ptr<Transport>> connectAll(size_t connections) {
+    return Rapscallion::connectAll(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), host.port()), connections);
+  }
+  boost::asio::ip::tcp::socket connect() {
+    boost::asio::ip::tcp::socket socket(io_service);
+    socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), host.port()));
+    return socket;
+  }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  boost::asio::local::stream_protocol::socket connectLocal() {
+    if (path.empty()) {
+      path = "/tmp/rapscallion-bench-" + std::to_string(::getpid()) + ".sock";
+      ::unlink(path.c_str());
+      host.listen(boost::asio::local::stream_protocol::endpoint(path));
+    }
+    boost::asio::local::stream_protocol::socket socket(io_service);
+    socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+    return socket;
+  }
+  std::string path;
+#endif
+#if defined(__linux__)
+  // Both sides poll for the given time before they sleep.
+  std::unique_ptr<Transport> connectShared(std::chrono::microseconds poll) {
+    SharedMemoryOptions options;
+    options.poll = poll;
+    sharedPath = "/tmp/rapscallion-bench-shm-" + std::to_string(::getpid()) + ".sock";
+    ::unlink(sharedPath.c_str());
+    host.listenShared(sharedPath, options);
+    return Rapscallion::connectShared(io_service, sharedPath, options);
+  }
+  std::string sharedPath;
+#endif
+  boost::asio::io_service io_service;
+  CalcImpl impl;
+  RpcHost host;
+};
+
+double percentile(std::vector<double>& sorted, double fraction) {
+  return sorted[std::min(sorted.size() - 1, size_t(fraction * sorted.size()))];
+}
+
+void latency(const std::string& name, Calc* calc) {
+  const size_t calls = 20000;
+  std::vector<double> samples;
+  samples.reserve(calls);
+  for (size_t n = 0; n < calls + 1000; ++n) {
+    auto start = std::chrono::steady_clock::now();
+    calc->add(int(n), 1).get();
+    auto end = std::chrono::steady_clock::now();
+    if (n >= 1000) samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  std::sort(samples.begin(), samples.end());
+  row(name, format("p50 %6.1f us   p90 %6.1f us   p99 %6.1f us   p99.9 %6.1f us",
+    percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), percentile(samples, 0.999)));
+}
+
+// Keeps up to window calls in flight from each of `threads` clients and returns the total calls/s.
+// Each client spreads its calls over the given number of connections.
+template <typename F>
+double throughput(Host& host, size_t threads, size_t window, size_t callsPerThread, F makeCall, size_t connections = 1) {
+  std::vector<std::thread> clients;
+  std::atomic<size_t> ready(0);
+  std::atomic<bool> go(false);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    clients.emplace_back([&]{
+      RpcClient client(host.connectAll(connections));
+      Calc* calc = client.Get<Calc>();
+      calc->add(0, 0).get();
+      ++ready;
+      while (!go) std::this_thread::yield();
+      std::deque<decltype(makeCall(calc))> inFlight;
+      for (size_t n = 0; n < callsPerThread; ++n) {
+        if (inFlight.size() == window) {
+          keep(inFlight.front().get());
+          inFlight.pop_front();
+        }
+        inFlight.push_back(makeCall(calc));
+      }
+      for (auto& f : inFlight) keep(f.get());
+    });
+  }
+  while (ready != threads) std::this_thread::yield();
+  start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& client : clients) client.join();
+  auto end = std::chrono::steady_clock::now();
+  return threads * callsPerThread / std::chrono::duration<double>(end - start).count();
+}
+
+}
+
+void loopback() {
+  section("Proxy to dispatcher over loopback TCP, a Unix domain socket and shared memory");
+  {
+    Host host(1);
+    RpcClient client(host.connect());
+    latency("add(int, int), one at a time", client.Get<Calc>());
+  }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  {
+    Host host(1);
+    RpcClient client(host.connectLocal());
+    latency("add(int, int), one at a time, Unix socket", client.Get<Calc>());
+  }
+#endif
+#if defined(__linux__)
+  for (long poll : { 0, 100 }) {
+    Host host(1);
+    RpcClient client(host.connectShared(std::chrono::microseconds(poll)));
+    latency(poll ? "add(int, int), one at a time, polled shm" : "add(int, int), one at a time, shared memory", client.Get<Calc>());
+  }
+#endif
+  {
+    Host host(1);
+    RpcClient client(host.connect());
+    client.setShortCircuit(true);
+    Calc* calc = client.Get<Calc>();
+    double ns = nsPerOp(1 << 20, [calc]{
+      for (int n = 0; n < (1 << 20); ++n) keep(calc->add(n, 1).get());
+    });
+    row("add(int, int), short-circuited in process", format("%8.1f ns/call", ns));
+  }
+  for (size_t threads : { 1, 4 }) {
+    Host host(threads);
+    auto add = [](Calc* calc){ return calc->add(1, 2); };
+    double rate = throughput(host, threads, 256, 200000 / threads, add);
+    row(format("add(int, int), %.0f client(s), 256 in flight", double(threads)), format("%10.0f calls/s", rate));
+  }
+  {
+    Host host(1);
+    const std::string text(4096, 'x');
+    auto echo = [&text](Calc* calc){ return calc->echo(text); };
+    double rate = throughput(host, 1, 64, 50000, echo);
+    row("echo(4 KiB string), 64 in flight", format("%10.0f calls/s   %8.1f MB/s each way", rate, rate * text.size() / 1e6));
+  }
+  for (size_t connections : { 1, 4 }) {
+    Host host(4);
+    const std::string text(256 * 1024, 'x');
+    auto echo = [&text](Calc* calc){ return calc->echo(text); };
+    double rate = throughput(host, 1, 16, 4000, echo, connections);
+    row(format("echo(256 KiB string), 16 in flight, %.0f connection(s)", double(connections)), format("%10.0f calls/s   %8.1f MB/s each way", rate, rate * text.size() / 1e6));
+  }
+}
+
+}
+}
@@ -0,0 +1,109 @@
+#include "Bench.h"
+#include <Borrowed.h>
+#include <FloatReference.h>
+#include <Serializer.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace Rapscallion {
+namespace bench {
+namespace {
+
+std::mt19937_64 rng(1);
+
+// Reports the cost of writing and reading each of the samples with writeOne and readOne, and their
+// average encoded size.
+template <typename T, typename Write, typename Read>
+void measure(const std::string& name, const std::vector<T>& samples, Write writeOne, Read readOne) {
+  size_t bound = 0;
+  for (const T& value : samples) bound += serialized_size<T>::of(value);
+  Serializer written(bound);
+  double write = nsPerOp(samples.size(), [&]{
+    Serializer s(bound);
+    for (const T& value : samples) writeOne(s, value);
+    keep(s.size());
+    std::swap(s, written);
+  });
+  Deserializer d(written);
+  const size_t payload = d.size - d.offs;
+  const size_t start = d.offs;
+  double read = nsPerOp(samples.size(), [&]{
+    d.offs = start;
+    for (size_t n = 0; n < samples.size(); ++n) keep(readOne(d));
+  });
+  row(name, format("write %8.1f ns/op   read %8.1f ns/op   %9.1f bytes/op", write, read, double(payload) / samples.size()));
+}
+
+template <typename T>
+void measure(const std::string& name, const std::vector<T>& samples) {
+  measure(name, samples, [](Serializer& s, const T& value) { serializer<T>::write(s, value); }, [](Deserializer& d) { return serializer<T>::read(d); });
+}
+
+// Measures the samples with serializer<T> and with the frexp/ldexp encoding it replaced, after checking
+// that both produce the same bytes.
+template <typename T>
+void compareWithReference(const std::string& name, const std::vector<T>& samples, void (*writeOne)(Serializer&, T), T (*readOne)(Deserializer&)) {
+  Serializer actual, expected;
+  for (const T& value : samples) {
+    serializer<T>::write(actual, value);
+    writeOne(expected, value);
+  }
+  if (actual.size() != expected.size() || memcmp(actual.data(), expected.data(), actual.size()) != 0) {
+    row(name, "encoded differently from the frexp/ldexp reference");
+    return;
+  }
+  measure(name, samples);
+  measure(name + ", frexp/ldexp", samples, writeOne, readOne);
+}
+
+template <typename T, typename F>
+std::vector<T> generate(size_t count, F next) {
+  std::vector<T> samples;
+  samples.reserve(count);
+  for (size_t n = 0; n < count; ++n) samples.push_back(next());
+  return samples;
+}
+
+// Lengths spread evenly over orders of magnitude up to maxLength.
+size_t logUniformLength(size_t maxLength) {
+  std::uniform_real_distribution<double> exponent(0, std::log2(double(maxLength)));
+  return size_t(std::exp2(exponent(rng)));
+}
+
+std::string text(size_t length) {
+  std::string s(length, ' ');
+  for (auto& c : s) c = static_cast<char>('a' + rng() % 26);
+  return s;
+}
+
+}
+
+void serializers() {
+  section("serializer<T> (ns per value written or read, encoded bytes per value)");
+  std::normal_distribution<double> normal(0, 1000);
+  measure("uint64_t (1 to 64 bits)", generate<std::uint_least64_t>(1 << 16, []{ return rng() >> (rng() % 64); }));
+  measure("long (1 to 63 bits, both signs)", generate<long>(1 << 16, []{ long v = long(rng() >> (1 + rng() % 63)); return rng() % 2 ? v : -v; }));
+  measure("int (normal, sd 1000)", generate<int>(1 << 16, [&]{ return int(normal(rng)); }));
+  measure("bool", generate<bool>(1 << 16, []{ return rng() % 2 == 0; }));
+  compareWithReference("double (normal, sd 1000)", generate<double>(1 << 16, [&]{ return normal(rng); }), reference::writeDouble, reference::readDouble);
+  compareWithReference("double (small integers)", generate<double>(1 << 16, []{ return double(rng() % 100000); }), reference::writeDouble, reference::readDouble);
+  compareWithReference("float (normal, sd 1000)", generate<float>(1 << 16, [&]{ return float(normal(rng)); }), reference::writeFloat, reference::readFloat);
+  measure("string (16 bytes)", generate<std::string>(1 << 14, []{ return text(16); }));
+  measure("string (1 B to 4 KiB, log-uniform)", generate<std::string>(1 << 12, []{ return text(logUniformLength(4096)); }));
+  measure("string (1 MiB)", generate<std::string>(4, []{ return text(1 << 20); }));
+  const auto keys = generate<std::string>(1 << 10, []{ return text(4096); });
+  measure("string (4 KiB)", keys);
+  measure("string_view (4 KiB, borrowed from the frame)", std::vector<boost::string_view>(keys.begin(), keys.end()));
+  measure("vector<double> (256 values)", generate<std::vector<double>>(256, [&]{ return generate<double>(256, [&]{ return normal(rng); }); }));
+  const auto blobs = generate<std::vector<uint8_t>>(256, []{ return generate<uint8_t>(4096, []{ return uint8_t(rng()); }); });
+  measure("vector<uint8_t> (4 KiB)", blobs);
+  measure("byte_span (4 KiB, borrowed from the frame)", std::vector<byte_span>(blobs.begin(), blobs.end()));
+  measure("vector<string> (16 x 16 bytes)", generate<std::vector<std::string>>(1024, []{ return generate<std::string>(16, []{ return text(16); }); }));
+}
+
+}
+}
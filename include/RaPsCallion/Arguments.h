@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include "Connection.h"
+#include "future.h"
+#include "Protocol.h"
+#include "RpcHandle.h"
+#include "Serializer.h"
+
+namespace Rapscallion {
+namespace detail {
+
+static constexpr size_t maxVarintSize = 10;
+
+// How a call parameter of type T travels: the proxy writes it, the dispatcher reads it into a
+// stored_type, waits until it is ready and then takes it to pass to the handler.
+template <typename T>
+struct Argument {
+  typedef T stored_type;
+  static size_t size(const T& value) {
+    return serialized_size<T>::of(value);
+  }
+  static void write(Serializer& s, const OutgoingCall&, const T& value) {
+    serializer<T>::write(s, value);
+  }
+  // The connection the call must go out on for this argument, or CallOrigin::noLane if any will do.
+  static size_t lane(const T&, const CallOrigin&) { return CallOrigin::noLane; }
+  static T read(Deserializer& s, RpcHandle&) {
+    return serializer<T>::read(s);
+  }
+  static bool ready(const T&) { return true; }
+  template <typename F>
+  static void whenReady(T&, std::atomic<size_t>&, const F&) {}
+  static T& take(T& value) { return value; }
+};
+
+inline std::string messageOf(boost::exception_ptr error) {
+  try {
+    boost::rethrow_exception(error);
+  } catch (std::exception& e) {
+    return e.what();
+  } catch (std::exception_ptr& nested) {
+    // What a boost promise holds when it is given a std::exception_ptr.
+    try {
+      std::rethrow_exception(nested);
+    } catch (std::exception& e) {
+      return e.what();
+    } catch (...) {
+    }
+  } catch (...) {
+  }
+  return "Unknown exception";
+}
+
+template <typename T>
+struct FutureResult {
+  static void write(Serializer& s, future<T>& f) { serializer<T>::write(s, f.get()); }
+  static boost::shared_future<T> read(Deserializer& s) {
+    T value = serializer<T>::read(s);
+    return boost::make_ready_future<T>(value).share();
+  }
+  static future<T> take(boost::shared_future<T>& f) { return boost::make_ready_future<T>(f.get()); }
+};
+
+template <>
+struct FutureResult<void> {
+  static void write(Serializer&, future<void>& f) { f.get(); }
+  static boost::shared_future<void> read(Deserializer&) { return boost::make_ready_future().share(); }
+  static future<void> take(boost::shared_future<void>&) { return boost::make_ready_future(); }
+};
+
+// A future argument that is still waiting for the result of an earlier call through the same client
+// is sent as a reference to that call, so the two calls go out back-to-back on the same connection.
+// The remote side holds the dependent call until the referenced result is ready. Any other future is
+// waited for and sent by value, except on an IO thread, e.g. in a continuation of a reply: waiting
+// there could keep the future from ever completing, so the argument is sent as failed instead. A
+// failed argument reaches the handler as a std::runtime_error with the message of the original
+// exception; its type is not kept. The argument future is consumed either way.
+template <typename T>
+struct Argument<future<T>> {
+  typedef boost::shared_future<T> stored_type;
+  // Enough for a reference; a value that has to be sent instead grows the frame.
+  static size_t size(const future<T>&) {
+    return 3 * maxVarintSize;
+  }
+  static size_t lane(const future<T>& value, const CallOrigin& caller) {
+    const CallOrigin* origin = value.origin();
+    if (!origin || origin->channel() != caller.channel()) return CallOrigin::noLane;
+    return origin->lane(value.requestId());
+  }
+  static void write(Serializer& s, const OutgoingCall& call, const future<T>& arg) {
+    future<T>& value = const_cast<future<T>&>(arg);
+    const CallOrigin* origin = value.origin();
+    size_t interfaceId = origin ? origin->remoteInterfaceId() : size_t(-1);
+    if (origin && !value.is_ready() && interfaceId != size_t(-1) && lane(value, call.origin) == call.lane) {
+      serializer<size_t>::write(s, FutureReference);
+      serializer<size_t>::write(s, interfaceId);
+      serializer<size_t>::write(s, value.requestId());
+      value.keep();
+      return;
+    }
+    if (!value.is_ready() && Connection::inHandler()) {
+      serializer<size_t>::write(s, FutureError);
+      serializer<std::string>::write(s, "Future argument not ready on an IO thread");
+      return;
+    }
+    value.wait();
+    if (value.has_exception()) {
+      serializer<size_t>::write(s, FutureError);
+      serializer<std::string>::write(s, messageOf(value.get_exception_ptr()));
+      return;
+    }
+    serializer<size_t>::write(s, FutureValue);
+    FutureResult<T>::write(s, value);
+  }
+  static stored_type read(Deserializer& s, RpcHandle& handle) {
+    switch (serializer<size_t>::read(s)) {
+    case FutureValue:
+      return FutureResult<T>::read(s);
+    case FutureReference: {
+      size_t interfaceId = serializer<size_t>::read(s);
+      size_t requestId = serializer<size_t>::read(s);
+      return handle.Pipelined<T>(interfaceId, requestId);
+    }
+    default:
+      return boost::make_exceptional_future<T>(std::runtime_error(serializer<std::string>::read(s))).share();
+    }
+  }
+  static bool ready(const stored_type& f) { return f.is_ready(); }
+  template <typename F>
+  static void whenReady(stored_type& f, std::atomic<size_t>& pending, const F& onReady) {
+    if (f.is_ready()) return;
+    ++pending;
+    f.then(boost::launch::sync, [onReady](boost::shared_future<T>){ onReady(); });
+  }
+  static future<T> take(stored_type& f) {
+    if (f.has_exception()) return boost::make_exceptional_future<T>(f.get_exception_ptr());
+    return FutureResult<T>::take(f);
+  }
+};
+
+}
+}
+
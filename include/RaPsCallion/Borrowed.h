@@ -0,0 +1,77 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "Serializer.h"
+
+namespace Rapscallion {
+
+// A read-only run of bytes owned by someone else, like boost::string_view for binary data.
+class byte_span {
+public:
+  byte_span() = default;
+  byte_span(const uint8_t* data, size_t size)
+  : data_(data)
+  , size_(size)
+  {}
+  byte_span(const std::vector<uint8_t>& bytes)
+  : data_(bytes.data())
+  , size_(bytes.size())
+  {}
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const uint8_t* begin() const { return data_; }
+  const uint8_t* end() const { return data_ + size_; }
+  uint8_t operator[](size_t index) const { return data_[index]; }
+private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Borrowed types are encoded like std::string and std::vector<uint8_t>, so either end may use the
+// owning type instead. Read from a frame, they point straight into it: a handler that takes them sees
+// the received bytes without a copy, and DispatcherBase keeps the frame alive until the call's result
+// is ready. They cannot be results, as nothing would keep the reply's frame alive.
+template <typename T>
+struct is_borrowed : std::false_type {};
+template <> struct is_borrowed<boost::string_view> : std::true_type {};
+template <> struct is_borrowed<byte_span> : std::true_type {};
+
+template <>
+struct serializer<boost::string_view> {
+  static void write(Serializer& s, boost::string_view value) {
+    serializer<std::uint_least64_t>::write(s, value.size());
+    s.addBytes(value.data(), value.size());
+  }
+  static boost::string_view read(Deserializer& s) {
+    const auto length = serializer<std::uint_least64_t>::read(s);
+    return boost::string_view(reinterpret_cast<const char*>(s.getByteRange(length)), length);
+  }
+};
+template <>
+struct serializer<byte_span> {
+  static void write(Serializer& s, byte_span value) {
+    serializer<std::uint_least64_t>::write(s, value.size());
+    s.addBytes(value.data(), value.size());
+  }
+  static byte_span read(Deserializer& s) {
+    const auto length = serializer<std::uint_least64_t>::read(s);
+    return byte_span(s.getByteRange(length), length);
+  }
+};
+
+template <>
+struct serialized_size<boost::string_view> {
+  static size_t of(boost::string_view value) { return varintSize(value.size()) + value.size(); }
+};
+template <>
+struct serialized_size<byte_span> {
+  static size_t of(byte_span value) { return varintSize(value.size()) + value.size(); }
+};
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "Serializer.h"
+#include "future.h"
+
+namespace Rapscallion {
+
+// Bounds the calls an RpcClient has outstanding: sent and neither answered nor failed yet. Zero means
+// no limit. One call is always let through while none are outstanding, however large it is.
+struct CallLimits {
+  enum Overflow {
+    // The caller blocks until there is room. Calls made on an IO thread, e.g. from a continuation of
+    // a reply, are let through instead, as waiting there would keep the replies from arriving.
+    Wait,
+    // The caller gets its future at once, and the call is queued and sent once there is room. Later
+    // calls queue behind it. It is sent even if its future is dropped unused, unless the client is
+    // in lazy mode.
+    Defer,
+    // The call fails with "Too many calls in flight" without being sent.
+    FailFast,
+  };
+  size_t maxCalls = 0;
+  // The request frames of the outstanding calls, as serialized.
+  size_t maxBytes = 0;
+  Overflow overflow = Wait;
+};
+
+// Counts a client's outstanding calls against its CallLimits. The request tables of the client's
+// proxies release a call once it completes in any way, so the limiter is shared with them.
+class CallLimiter {
+public:
+  struct QueuedCall {
+    CallOrigin* origin;
+    size_t requestId;
+    size_t lane;
+    Frame frame;
+  };
+  enum Admission { Send, Queued, Rejected };
+  // send writes deferred calls that have room now, in order.
+  explicit CallLimiter(std::function<void(std::vector<QueuedCall>)> send)
+  : send_(std::move(send))
+  {}
+
+  void setLimits(const CallLimits& limits) {
+    std::vector<QueuedCall> ready;
+    {
+      std::lock_guard<std::mutex> l(m);
+      limits_ = limits;
+      ready = takeReady();
+    }
+    space.notify_all();
+    if (!ready.empty()) send_(std::move(ready));
+  }
+  bool active() const {
+    return enabled.load(std::memory_order_relaxed);
+  }
+  // Decides what happens to a serialized call. A call that is sent right away is charged to its
+  // request slot, which releases it again; a queued call keeps its frame here until it is sent. A
+  // call with stream arguments must not be queued, as its chunks follow right away; it waits
+  // instead. beforeWait runs before the caller blocks, to send what it may be waiting for.
+  template <typename F>
+  Admission admit(Frame& frame, CallOrigin* origin, size_t requestId, size_t lane, bool mayWait, bool mayQueue, const F& beforeWait) {
+    std::unique_lock<std::mutex> l(m);
+    if (closed || (queue.empty() && hasRoom(frame.size()))) {
+      charge(origin, requestId, frame.size());
+      return Send;
+    }
+    switch (limits_.overflow) {
+    case CallLimits::Defer:
+      if (!mayQueue) break;
+      queue.push_back(QueuedCall{origin, requestId, lane, std::move(frame)});
+      queued = queue.size();
+      return Queued;
+    case CallLimits::FailFast:
+      return Rejected;
+    case CallLimits::Wait:
+      break;
+    }
+    if (mayWait) {
+      l.unlock();
+      beforeWait();
+      l.lock();
+      space.wait(l, [&]{ return closed || (queue.empty() && hasRoom(frame.size())); });
+    }
+    charge(origin, requestId, frame.size());
+    return Send;
+  }
+  // A charged call completed; sends what now fits of the queued calls.
+  void release(size_t bytes) {
+    std::vector<QueuedCall> ready;
+    {
+      std::lock_guard<std::mutex> l(m);
+      --calls;
+      outstandingBytes -= bytes;
+      ready = takeReady();
+    }
+    space.notify_all();
+    if (!ready.empty()) send_(std::move(ready));
+  }
+  // Removes a call that is still queued. Returns false if it is not queued (any more).
+  bool drop(const CallOrigin* origin, size_t requestId) {
+    if (queued == 0) return false;
+    std::lock_guard<std::mutex> l(m);
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      if (it->origin == origin && it->requestId == requestId) {
+        queue.erase(it);
+        queued = queue.size();
+        return true;
+      }
+    }
+    return false;
+  }
+  // Forgets the queued calls for a connection that has closed.
+  void dropLane(size_t lane) {
+    if (queued == 0) return;
+    std::lock_guard<std::mutex> l(m);
+    queue.erase(std::remove_if(queue.begin(), queue.end(), [lane](const QueuedCall& call){ return call.lane == lane; }), queue.end());
+    queued = queue.size();
+  }
+  // Lets every waiting and later call through, and forgets the queued ones; the connection is going away.
+  void close() {
+    {
+      std::lock_guard<std::mutex> l(m);
+      closed = true;
+      queue.clear();
+      queued = 0;
+    }
+    space.notify_all();
+  }
+  size_t outstanding() {
+    std::lock_guard<std::mutex> l(m);
+    return calls;
+  }
+
+private:
+  bool hasRoom(size_t bytes) const {
+    if (calls == 0) return true;
+    return (limits_.maxCalls == 0 || calls < limits_.maxCalls) &&
+           (limits_.maxBytes == 0 || outstandingBytes + bytes <= limits_.maxBytes);
+  }
+  // The slot is charged under m, so a drop() that finds the call gone also sees it charged.
+  void charge(CallOrigin* origin, size_t requestId, size_t bytes) {
+    ++calls;
+    outstandingBytes += bytes;
+    origin->charge(requestId, bytes);
+  }
+  std::vector<QueuedCall> takeReady() {
+    std::vector<QueuedCall> ready;
+    while (!queue.empty() && (closed || hasRoom(queue.front().frame.size()))) {
+      QueuedCall& call = queue.front();
+      charge(call.origin, call.requestId, call.frame.size());
+      ready.push_back(std::move(call));
+      queue.pop_front();
+    }
+    queued = queue.size();
+    enabled = limits_.maxCalls != 0 || limits_.maxBytes != 0 || !queue.empty();
+    return ready;
+  }
+
+  const std::function<void(std::vector<QueuedCall>)> send_;
+  std::mutex m;
+  std::condition_variable space;
+  CallLimits limits_;
+  std::atomic<bool> enabled{false};
+  bool closed = false;
+  size_t calls = 0;
+  size_t outstandingBytes = 0;
+  std::deque<QueuedCall> queue;
+  // Mirrors queue.size(), so drop() can skip m.
+  std::atomic<size_t> queued{0};
+};
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Serializer.h"
+
+namespace Rapscallion {
+
+// A connection compresses what it writes once the peer has said it can decompress it, and the
+// write is at least threshold bytes. A write that does not get smaller is sent as it is.
+struct CompressionOptions {
+  bool enabled = false;
+  size_t threshold = 4096;
+};
+
+// Reads the rest of a Compressed frame, after its opcode, and adds the frames it holds to inner.
+// Throws FrameError if they add up to more than maxFrameSize, which also limits each of them.
+void readCompressed(Deserializer& des, Deserializer& inner, size_t maxFrameSize);
+
+namespace lz {
+
+// A byte-oriented LZ77 format in the style of LZ4. Each sequence is a token byte, whose high nibble is
+// the literal count and low nibble the match length minus minMatch, then the literals, then the match
+// offset as two little-endian bytes. A nibble of 15 continues in the following bytes, each adding up
+// to 255. The last sequence has literals only.
+static constexpr size_t minMatch = 4;
+static constexpr size_t maxOffset = 65535;
+
+// The most a compressed block can expand to, for rejecting implausible sizes before decompressing.
+inline size_t maxExpansion(size_t compressedSize) {
+  return compressedSize * 255 + 16;
+}
+
+// Appends the compressed form of the input to out.
+void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+// Decompresses exactly outSize bytes into out. Throws if the input is malformed or of another size.
+void decompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize);
+
+}
+}
+
@@ -1,93 +1,319 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <functional>
+#include <vector>
+#include "Compression.h"
+#include "FramePool.h"
+#include "Protocol.h"
+#include "Serializer.h"
+#include "Transport.h"
 
 namespace Rapscallion {
 
 struct Connection
   : public std::enable_shared_from_this<Connection>
-{ 
-  static constexpr size_t buffersize = 16384;
-  Connection(boost::asio::ip::tcp::socket socket, std::function<void(const char*, size_t)> onRead)
-    : socket_(std::move(socket))
+{
+  static constexpr size_t defaultMaxQueuedBytes = 4 * 1024 * 1024;
+  // Received bytes are read straight into des; onRead is called after each read to consume whole frames.
+  // onClose, if given, is called once when the connection closes before detach(), like onRead; frames
+  // written after that are dropped. All transport operations and their handlers run on the
+  // connection's strand.
+  Connection(std::unique_ptr<Transport> transport, Deserializer& des, std::function<void()> onRead, std::function<void()> onClose = nullptr)
+    : transport_(std::move(transport))
+    , strand_(transport_->executor())
+    , des_(des)
     , onRead_(onRead)
+    , onClose_(onClose)
   {
   }
 
-  boost::asio::ip::tcp::socket& getSocket() {
-    return socket_;
+  boost::asio::any_io_executor executor() {
+    return transport_->executor();
+  }
+
+  // Buffers of written frames go back here.
+  FramePool& framePool() {
+    return pool_;
   }
 
   void start() {
-    socket_.async_read_some(boost::asio::buffer(buffer, buffersize), [this](const boost::system::error_code& error, size_t transferred) {
+    des_.setMaxFrameSize(maxFrameSize);
+    auto self = shared_from_this();
+    uint8_t* space = des_.prepare();
+    transport_->readSome(boost::asio::buffer(space, des_.capacity()), strand_, [this, self](const boost::system::error_code& error, size_t transferred) {
       handle_read(error, transferred);
     });
   }
 
-  void write(const char* data, size_t size) {
-    // We cannot send packets larger than the buffer size, as we cannot guarantee no interleaving happens.
-    if (size > buffersize) throw std::runtime_error("Packet too large for connection");
+  // Writers block once more than this many bytes are queued or in flight. A single frame larger than
+  // the budget is still accepted when the queue is empty, so the budget does not limit frame size.
+  void setMaxQueuedBytes(size_t bytes) {
     std::lock_guard<std::mutex> l(writeMutex);
+    maxQueuedBytes = bytes;
+    writeSpace.notify_all();
+  }
+
+  // A frame announcing a longer payload closes the connection instead of being received.
+  void setMaxFrameSize(size_t bytes) {
+    maxFrameSize = bytes;
+  }
+  size_t frameSizeLimit() const {
+    return maxFrameSize;
+  }
 
-    // TODO: wait on cond var for connection to have enough space for this as a single write in the buffer
+  // Writes of at least options.threshold bytes are compressed once the peer accepts compression.
+  void setCompression(const CompressionOptions& options) {
+    compressionThreshold = options.threshold;
+    compressWrites = options.enabled;
+  }
+  // Tells the peer that this side can decompress; the first thing either side writes.
+  void acceptCompression() {
+    Serializer s(pool_.acquire(), 0);
+    serializer<size_t>::write(s, controlChannel);
+    serializer<size_t>::write(s, AcceptCompression);
+    serializer<size_t>::write(s, LzCodec);
+    write(s.release());
+  }
+  // The peer announced a codec it can decompress.
+  void peerAccepts(size_t codec) {
+    if (codec == LzCodec) peerDecompresses = true;
+  }
+  // The number of writes that went out compressed.
+  size_t compressedWrites() const {
+    return compressed;
+  }
 
+  void write(Frame frame) {
+    frame = compress(std::move(frame));
+    std::unique_lock<std::mutex> l(writeMutex);
+    if (!waitForSpace(l)) return;
 
-    memcpy(currentWrite + writeoff, data, size);
-    writeoff += size;
-    if (!writeActive) {
-      queueWrite(l);
+    queuedBytes += frame.size();
+    pending.push_back(std::move(frame));
+    startWrite(l);
+  }
+
+  // Queues the frames in order, so they go out together in the next write. Frames that are worth
+  // compressing together are compressed as one.
+  void write(std::vector<Frame> frames) {
+    size_t total = 0;
+    for (auto& frame : frames) total += frame.size();
+    if (frames.size() > 1 && compressWrites && peerDecompresses && total >= compressionThreshold) {
+      Frame joined;
+      joined.buffer = pool_.acquire();
+      joined.buffer.clear();
+      for (auto& frame : frames) {
+        joined.buffer.insert(joined.buffer.end(), frame.data(), frame.data() + frame.size());
+        pool_.release(std::move(frame.buffer));
+      }
+      frames.clear();
+      frames.push_back(std::move(joined));
+    }
+    for (auto& frame : frames) {
+      frame = compress(std::move(frame));
+    }
+    std::unique_lock<std::mutex> l(writeMutex);
+    if (!waitForSpace(l)) return;
+
+    for (auto& frame : frames) {
+      queuedBytes += frame.size();
+      pending.push_back(std::move(frame));
     }
+    if (!pending.empty()) startWrite(l);
+  }
+
+  // Stops reading and closes the transport, so the owner can be destroyed. Waits for onRead to return if
+  // it is running, so it must not be called from onRead itself.
+  void detach() {
+    {
+      std::lock_guard<std::mutex> l(readMutex);
+      onRead_ = nullptr;
+    }
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [this, self]{
+      transport_->close();
+    });
+  }
+
+  // Marks code running on the IO thread, which must never wait for queue space.
+  struct HandlerScope {
+    HandlerScope() { insideHandler() = true; }
+    ~HandlerScope() { insideHandler() = false; }
+  };
+  static bool inHandler() {
+    return insideHandler();
   }
 
 private:
-  void handle_read(const boost::system::error_code& error, size_t bytes_transferred) {
-    if (!error) {
-      onRead_(buffer, bytes_transferred);
-      auto self = shared_from_this();
-      socket_.async_read_some(boost::asio::buffer(buffer, buffersize), 
-        [this, self](const boost::system::error_code& err, size_t transferred){ 
-          handle_read(err, transferred);
-        }
-      );
+  // Wraps the bytes of one write, which may be several frames, in a Compressed frame if that is
+  // allowed and makes them smaller.
+  Frame compress(Frame frame) {
+    if (!compressWrites || !peerDecompresses || frame.size() < compressionThreshold) return frame;
+    static thread_local std::vector<uint8_t> packed;
+    packed.clear();
+    lz::compress(frame.data(), frame.size(), packed);
+    Serializer s(pool_.acquire(), 3 * 10 + packed.size());
+    serializer<size_t>::write(s, controlChannel);
+    serializer<size_t>::write(s, Compressed);
+    serializer<size_t>::write(s, LzCodec);
+    serializer<size_t>::write(s, frame.size());
+    s.addBytes(packed.data(), packed.size());
+    Frame wrapped = s.release();
+    if (wrapped.size() >= frame.size()) {
+      pool_.release(std::move(wrapped.buffer));
+      return frame;
     }
+    pool_.release(std::move(frame.buffer));
+    ++compressed;
+    return wrapped;
   }
 
-  void queueWrite(const std::lock_guard<std::mutex>&) {
+  static bool& insideHandler() {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  // Returns false if the connection is closed.
+  bool waitForSpace(std::unique_lock<std::mutex>& l) {
+    // Waiting on the IO thread would deadlock, as that thread is the one that drains the queue.
+    if (!insideHandler()) {
+      writeSpace.wait(l, [this]{ return closed || queuedBytes < maxQueuedBytes; });
+    }
+    return !closed;
+  }
+
+  void handle_read(const boost::system::error_code& error, size_t bytes_transferred) {
+    if (!error && receive(bytes_transferred)) return;
+    abort();
+  }
+
+  // Hands the received bytes to onRead and reads on. Returns false if the stream cannot go on.
+  bool receive(size_t bytes_transferred) {
+    std::lock_guard<std::mutex> l(readMutex);
+    // des_ belongs to the owner, which may be gone after detach().
+    if (!onRead_) return true;
+    des_.commit(bytes_transferred);
+    des_.setMaxFrameSize(maxFrameSize);
+    try {
+      HandlerScope scope;
+      onRead_();
+    } catch (const std::exception&) {
+      // A frame that does not decode, e.g. a corrupt Compressed frame, leaves the rest of the stream
+      // unparseable. Only this connection goes; the IO thread keeps serving the others.
+      return false;
+    }
     auto self = shared_from_this();
-    boost::asio::async_write(socket_, boost::asio::buffer(currentWrite, writeoff), 
-      [this, self](const boost::system::error_code& err, size_t ) { 
-        handle_write(err); 
+    uint8_t* space = des_.prepare();
+    transport_->readSome(boost::asio::buffer(space, des_.capacity()), strand_,
+      [this, self](const boost::system::error_code& err, size_t transferred){
+        handle_read(err, transferred);
       }
     );
-    currentWrite = (currentWrite == writebuffer1) ? writebuffer2 : writebuffer1;
-    writeoff = 0;
-    writeActive = true;
-    // signal condvar all
+    return true;
   }
 
-  void handle_write(const boost::system::error_code& error) {
-    if (!error) {
+  // The peer went away, or sent bytes that cannot be decoded, so the rest of the stream cannot be
+  // trusted either. Stops reading and writing; writers waiting for queue space return, and the owner
+  // hears of it unless it has detached.
+  void abort() {
+    {
       std::lock_guard<std::mutex> l(writeMutex);
-      if (writeoff > 0) {
-        queueWrite(l);
-      } else {
-        writeActive = false;
+      closed = true;
+      for (auto& frame : pending) queuedBytes -= frame.size();
+      pending.clear();
+    }
+    writeSpace.notify_all();
+    transport_->close();
+    std::lock_guard<std::mutex> l(readMutex);
+    if (!onRead_ || !onClose_) return;
+    std::function<void()> onClose;
+    onClose.swap(onClose_);
+    HandlerScope scope;
+    onClose();
+  }
+
+  // Starts a write on the strand unless one is already active. Runs inline when called on the strand.
+  void startWrite(std::unique_lock<std::mutex>& l) {
+    if (writeActive) return;
+    writeActive = true;
+    l.unlock();
+    auto self = shared_from_this();
+    boost::asio::dispatch(strand_, [this, self]{
+      std::unique_lock<std::mutex> lock(writeMutex);
+      queueWrite(lock);
+    });
+  }
+
+  void queueWrite(const std::unique_lock<std::mutex>&) {
+    // Hand every queued frame to a single gathered write; the frames stay alive in inFlight until it completes.
+    inFlight.clear();
+    writeBuffers.clear();
+    for (auto& frame : pending) {
+      writeBuffers.push_back(boost::asio::buffer(frame.data(), frame.size()));
+      inFlightBytes += frame.size();
+      inFlight.push_back(std::move(frame));
+    }
+    pending.clear();
+    auto self = shared_from_this();
+    transport_->write(writeBuffers, strand_,
+      [this, self](const boost::system::error_code& err, size_t ) {
+        HandlerScope scope;
+        handle_write(err);
       }
+    );
+  }
+
+  void handle_write(const boost::system::error_code& error) {
+    std::unique_lock<std::mutex> l(writeMutex);
+    queuedBytes -= inFlightBytes;
+    inFlightBytes = 0;
+    for (auto& frame : inFlight) {
+      pool_.release(std::move(frame.buffer));
+    }
+    inFlight.clear();
+    if (error) {
+      // Nothing queued after a failed write can be delivered any more.
+      writeActive = false;
+      l.unlock();
+      abort();
+      return;
+    } else if (!pending.empty()) {
+      queueWrite(l);
+    } else {
+      writeActive = false;
     }
+    writeSpace.notify_all();
   }
 
 private:
-  boost::asio::ip::tcp::socket socket_;
-  char buffer[buffersize];
-  char writebuffer1[buffersize];
-  char writebuffer2[buffersize];
-  size_t writeoff = 0;
-  char* currentWrite = writebuffer1;
+  std::unique_ptr<Transport> transport_;
+  Transport::Strand strand_;
+  Deserializer& des_;
+  FramePool pool_;
+  std::mutex readMutex;
   std::mutex writeMutex;
+  std::condition_variable writeSpace;
+  std::deque<Frame> pending;
+  std::vector<Frame> inFlight;
+  std::vector<boost::asio::const_buffer> writeBuffers;
+  size_t queuedBytes = 0;
+  size_t inFlightBytes = 0;
+  size_t maxQueuedBytes = defaultMaxQueuedBytes;
   bool writeActive = false;
-  std::function<void(const char*, size_t)> onRead_;
+  bool closed = false;
+  std::atomic<size_t> maxFrameSize{Deserializer::defaultMaxFrameSize};
+  std::atomic<bool> compressWrites{false};
+  std::atomic<size_t> compressionThreshold{CompressionOptions().threshold};
+  std::atomic<bool> peerDecompresses{false};
+  std::atomic<size_t> compressed{0};
+  std::function<void()> onRead_;
+  std::function<void()> onClose_;
 };
 
 }
@@ -1,17 +1,86 @@
 #pragma once
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <string>
+#include <vector>
 #include <memory>
+#include <stdexcept>
 #include <functional>
+#include <tuple>
+#include <type_traits>
 #include <typeinfo>
+#include "future.h"
+#include "Arguments.h"
+#include "Borrowed.h"
 #include "InterfaceDispatcher.h"
 #include "Serializer.h"
 #include "RpcHandle.h"
+#include "StreamTable.h"
 
 namespace Rapscallion {
 
 class RpcHandle;
 
+namespace detail {
+
+template <size_t... N>
+struct indices {};
+template <size_t Count, size_t... N>
+struct make_indices : make_indices<Count - 1, Count - 1, N...> {};
+template <size_t... N>
+struct make_indices<0, N...> {
+  typedef indices<N...> type;
+};
+
+template <typename R>
+struct ReplyValue {
+  static size_t size(boost::shared_future<R>& v) { return serialized_size<R>::of(v.get()); }
+  static void write(Serializer& s, boost::shared_future<R>& v, RpcHandle&) { serializer<R>::write(s, v.get()); }
+};
+template <>
+struct ReplyValue<void> {
+  static size_t size(boost::shared_future<void>&) { return 0; }
+  static void write(Serializer&, boost::shared_future<void>& v, RpcHandle&) { v.get(); }
+};
+template <typename T>
+struct ReplyValue<stream<T>> {
+  static size_t size(boost::shared_future<stream<T>>& v) { v.get(); return maxVarintSize; }
+  static void write(Serializer& s, boost::shared_future<stream<T>>& v, RpcHandle& handle) {
+    serializer<size_t>::write(s, handle.streams->send(v.get()));
+  }
+};
+
+template <typename... Ts>
+struct any_borrowed : std::false_type {};
+template <typename T, typename... Ts>
+struct any_borrowed<T, Ts...> : std::integral_constant<bool, is_borrowed<T>::value || any_borrowed<Ts...>::value> {};
+
+// Completes p with the outcome of f, once f is ready.
+template <typename R>
+void fulfil(std::shared_ptr<promise<R>> p, future<R> f) {
+  f.then(boost::launch::sync, [p](boost::future<R> v){
+    try {
+      p->set_value(v.get());
+    } catch (...) {
+      p->set_exception(boost::current_exception());
+    }
+  });
+}
+template <>
+inline void fulfil(std::shared_ptr<promise<void>> p, future<void> f) {
+  f.then(boost::launch::sync, [p](boost::future<void> v){
+    try {
+      v.get();
+      p->set_value();
+    } catch (...) {
+      p->set_exception(boost::current_exception());
+    }
+  });
+}
+
+}
+
 template <typename T>
 class DispatcherBase : public InterfaceDispatcher {
 protected:
@@ -25,147 +94,165 @@ protected:
     return str;
   }
   std::string interfaceName = interfaceNameOf();
-  const std::string &getInterfaceName() { 
+  const std::string &getInterfaceName() override {
     return interfaceName;
   }
-  void Handle(Deserializer& des, RpcHandle& handle) override {
-    std::string name = serializer<std::string>::read(des);
-    auto it = funcs.find(name);
-    if (it == funcs.end())
-      printf("No function %s found on interface %s\n", name.c_str(), getInterfaceName().c_str());
-    else
-      it->second(des, handle);
+  const std::vector<std::string>& getMethodNames() override {
+    return names;
+  }
+  size_t getMethodId(const std::string& name) override {
+    for (size_t n = 0; n < names.size(); ++n) {
+      if (names[n] == name) return n;
+    }
+    return npos;
+  }
+  void Handle(size_t methodId, Deserializer& des, RpcHandle& handle) override {
+    if (methodId >= funcs.size()) {
+      handle.SendFailure(interfaceId, serializer<size_t>::read(des), "No such method");
+      return;
+    }
+    funcs[methodId](des, handle);
+  }
+  void collectMetrics(MetricsSnapshot& snapshot) override {
+    metrics_.collect(interfaceName, snapshot);
+  }
+  void* implementation(const std::type_info& type) override {
+    return type == typeid(T) ? cb_ : nullptr;
+  }
+  // Registers a handler for an interface method; method ids are assigned in registration order. The
+  // arguments are deserialized into a tuple and then moved (or bound by reference) into the call. A
+  // call with pipelined future arguments is held until the calls they refer to have completed. With an
+  // executor, the call is handed to it once all arguments are ready. A held call that the client
+  // cancels before it starts is not run, and fails with "Cancelled". Borrowed arguments (see Borrowed.h) point into the received
+  // frame, which is pinned if the call is held or its result is not ready when the handler returns.
+  template <typename R, typename... Args>
+  void addMethod(const char* name, future<R> (T::*method)(Args...)) {
+    static_assert(!is_borrowed<R>::value, "A borrowed type cannot be a result");
+    typedef std::tuple<typename detail::Argument<typename std::decay<Args>::type>::stored_type...> Stored;
+    typedef typename detail::make_indices<sizeof...(Args)>::type Indices;
+    const bool borrows = detail::any_borrowed<typename std::decay<Args>::type...>::value;
+    MethodStats* stats = metrics_.get(names.size(), name);
+    addHandler(name, [this, method, stats, borrows](Deserializer& s, RpcHandle& c){
+      uint64_t startedAt = 0;
+      if (stats) {
+        startedAt = MethodStats::now();
+        stats->started(s.packetSize());
+      }
+      size_t reqId = serializer<size_t>::read(s);
+      // Braced initialization guarantees the arguments are read in order.
+      Stored args{ detail::Argument<typename std::decay<Args>::type>::read(s, c)... };
+      if (!executor && allReady(method, args, Indices())) {
+        future<R> result = invoke(method, args, Indices());
+        std::shared_ptr<const void> pinned;
+        if (borrows && !result.is_ready()) pinned = s.pin();
+        reply(c, reqId, std::move(result), stats, startedAt, std::move(pinned));
+        return;
+      }
+      struct Deferred {
+        Deferred(Stored&& a) : args(std::move(a)) {}
+        Stored args;
+        std::shared_ptr<promise<R>> result = std::make_shared<promise<R>>();
+        std::atomic<size_t> pending{1};
+      };
+      auto deferred = std::make_shared<Deferred>(std::move(args));
+      reply(c, reqId, future<R>(deferred->result->get_future()), stats, startedAt, borrows ? s.pin() : nullptr);
+      RpcHandle* handle = &c;
+      handle->Waiting(interfaceId, reqId);
+      auto onReady = [this, method, deferred, handle, reqId]{
+        if (--deferred->pending != 0) return;
+        run([this, method, deferred, handle, reqId]{
+          if (!handle->Start(interfaceId, reqId)) {
+            deferred->result->set_exception(std::runtime_error("Cancelled"));
+            return;
+          }
+          detail::fulfil(deferred->result, invoke(method, deferred->args, Indices()));
+        });
+      };
+      whenReady(method, deferred->args, deferred->pending, onReady, Indices());
+      onReady();
+    });
+  }
+  template <typename F>
+  void run(F&& f) {
+    if (executor) {
+      executor->submit(std::forward<F>(f));
+    } else {
+      f();
+    }
   }
-  std::map<std::string, std::function<void(Deserializer&, RpcHandle&)>> funcs;
+  void addHandler(const char* name, std::function<void(Deserializer&, RpcHandle&)> func) {
+    names.push_back(name);
+    funcs.push_back(std::move(func));
+  }
+  template <typename R, typename... Args, typename Tuple, size_t... N>
+  static bool allReady(future<R> (T::*)(Args...), const Tuple& args, detail::indices<N...>) {
+    bool ready[] = { true, detail::Argument<typename std::decay<Args>::type>::ready(std::get<N>(args))... };
+    return std::all_of(std::begin(ready), std::end(ready), [](bool b){ return b; });
+  }
+  template <typename R, typename... Args, typename Tuple, typename F, size_t... N>
+  static void whenReady(future<R> (T::*)(Args...), Tuple& args, std::atomic<size_t>& pending, const F& onReady, detail::indices<N...>) {
+    int expand[] = { 0, (detail::Argument<typename std::decay<Args>::type>::whenReady(std::get<N>(args), pending, onReady), 0)... };
+    (void)expand;
+  }
+  // A handler that throws fails its call as if it had returned the exception in its result.
+  template <typename R, typename... Args, typename Tuple, size_t... N>
+  future<R> invoke(future<R> (T::*method)(Args...), Tuple& args, detail::indices<N...>) {
+    try {
+      return (cb_->*method)(static_cast<Args&&>(detail::Argument<typename std::decay<Args>::type>::take(std::get<N>(args)))...);
+    } catch (...) {
+      return boost::make_exceptional_future<R>(boost::current_exception());
+    }
+  }
+  // pinned holds the frame of the call until its result is ready, if it is needed.
+  template <typename R>
+  void reply(RpcHandle& c, size_t reqId, future<R> val, MethodStats* stats, uint64_t startedAt, std::shared_ptr<const void> pinned = nullptr) {
+    RpcHandle* handle = &c;
+    boost::shared_future<R> result = val.share();
+    handle->Retain(interfaceId, reqId, result);
+    // Sending the reply is cheap, so it happens on whichever thread completes the result.
+    result.then(boost::launch::sync, [handle, this, reqId, stats, startedAt, pinned](boost::shared_future<R> v) mutable {
+      pinned.reset();
+      if (v.has_exception()) {
+        if (stats) stats->failed();
+        handle->SendFailure(interfaceId, reqId, detail::messageOf(v.get_exception_ptr()));
+        return;
+      }
+      Serializer s(handle->framePool().acquire(), 2 * detail::maxVarintSize + detail::ReplyValue<R>::size(v));
+      serializer<size_t>::write(s, interfaceId + 1);
+      serializer<size_t>::write(s, reqId);
+      detail::ReplyValue<R>::write(s, v, *handle);
+      if (stats) stats->finished(s.size(), startedAt);
+      handle->Send(std::move(s));
+      StreamTable::startPending();
+    });
+  }
+  typedef T Interface;
+  std::vector<std::string> names;
+  std::vector<std::function<void(Deserializer&, RpcHandle&)>> funcs;
+  MethodStatsTable metrics_;
   T *cb_;
 };
 
-#define DISPATCH_PROLOG(name)  \
-  funcs[#name] = [this](Rapscallion::Deserializer&s, Rapscallion::RpcHandle& c){ \
-  size_t reqId = Rapscallion::serializer<size_t>::read(s); 
-#define DISPATCH_EPILOG(rv)  \
-  Rapscallion::RpcHandle* handle = &c;  \
-  val.then([handle, this, reqId](future<rv> v){ \
-    Rapscallion::Serializer s2; \
-    Rapscallion::serializer<std::string>::write(s2, getInterfaceName()); \
-    Rapscallion::serializer<size_t>::write(s2, reqId); \
-    Rapscallion::serializer<rv>::write(s2, v.get()); \
-    handle->Send(s2); \
-  }); \
-  }
-#define DISPATCH_EPILOGv(rv)  \
-  Rapscallion::RpcHandle* handle = &c;  \
-  val.then([handle, this, reqId](future<rv> ){ \
-    Rapscallion::Serializer s2; \
-    Rapscallion::serializer<std::string>::write(s2, getInterfaceName()); \
-    Rapscallion::serializer<size_t>::write(s2, reqId); \
-    handle->Send(s2); \
-  }); \
-  }
-#define DISPATCH_FUNC0(name, rv) DISPATCH_PROLOG(name) \
-  future<rv> val = this->cb_->name(); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC0v(name, rv) DISPATCH_PROLOG(name) \
-  future<rv> val = this->cb_->name(); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC1(name, rv, A1) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  future<rv> val = this->cb_->name(a1); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC1v(name, rv, A1) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  future<rv> val = this->cb_->name(a1); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC2(name, rv, A1, A2) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC2v(name, rv, A1, A2) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC3(name, rv, A1, A2, A3) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC3v(name, rv, A1, A2, A3) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC4(name, rv, A1, A2, A3, A4) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC4v(name, rv, A1, A2, A3, A4) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC5(name, rv, A1, A2, A3, A4, A5) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC5v(name, rv, A1, A2, A3, A4, A5) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC6(name, rv, A1, A2, A3, A4, A5, A6) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  A6 a6 = Rapscallion::serializer<A6>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5, a6); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC6v(name, rv, A1, A2, A3, A4, A5, A6) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  A6 a6 = Rapscallion::serializer<A6>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5, a6); \
-  DISPATCH_EPILOGv(rv)
-#define DISPATCH_FUNC7(name, rv, A1, A2, A3, A4, A5, A6, A7) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  A6 a6 = Rapscallion::serializer<A6>::read(s); \
-  A7 a7 = Rapscallion::serializer<A7>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5, a6, a7); \
-  DISPATCH_EPILOG(rv)
-#define DISPATCH_FUNC7v(name, rv, A1, A2, A3, A4, A5, A6, A7) DISPATCH_PROLOG(name) \
-  A1 a1 = Rapscallion::serializer<A1>::read(s); \
-  A2 a2 = Rapscallion::serializer<A2>::read(s); \
-  A3 a3 = Rapscallion::serializer<A3>::read(s); \
-  A4 a4 = Rapscallion::serializer<A4>::read(s); \
-  A5 a5 = Rapscallion::serializer<A5>::read(s); \
-  A6 a6 = Rapscallion::serializer<A6>::read(s); \
-  A7 a7 = Rapscallion::serializer<A7>::read(s); \
-  future<rv> val = this->cb_->name(a1, a2, a3, a4, a5, a6, a7); \
-  DISPATCH_EPILOGv(rv)
+// Registers the interface method `name`, with any number of arguments. Use the numbered forms below
+// when the method is overloaded.
+#define DISPATCH_FUNC(name) addMethod(#name, &Interface::name)
+
+#define DISPATCH_FUNC0(name, rv) addMethod(#name, static_cast<future<rv> (Interface::*)()>(&Interface::name))
+#define DISPATCH_FUNC0v(name, rv) DISPATCH_FUNC0(name, rv)
+#define DISPATCH_FUNC1(name, rv, A1) addMethod(#name, static_cast<future<rv> (Interface::*)(A1)>(&Interface::name))
+#define DISPATCH_FUNC1v(name, rv, A1) DISPATCH_FUNC1(name, rv, A1)
+#define DISPATCH_FUNC2(name, rv, A1, A2) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2)>(&Interface::name))
+#define DISPATCH_FUNC2v(name, rv, A1, A2) DISPATCH_FUNC2(name, rv, A1, A2)
+#define DISPATCH_FUNC3(name, rv, A1, A2, A3) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2, A3)>(&Interface::name))
+#define DISPATCH_FUNC3v(name, rv, A1, A2, A3) DISPATCH_FUNC3(name, rv, A1, A2, A3)
+#define DISPATCH_FUNC4(name, rv, A1, A2, A3, A4) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2, A3, A4)>(&Interface::name))
+#define DISPATCH_FUNC4v(name, rv, A1, A2, A3, A4) DISPATCH_FUNC4(name, rv, A1, A2, A3, A4)
+#define DISPATCH_FUNC5(name, rv, A1, A2, A3, A4, A5) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2, A3, A4, A5)>(&Interface::name))
+#define DISPATCH_FUNC5v(name, rv, A1, A2, A3, A4, A5) DISPATCH_FUNC5(name, rv, A1, A2, A3, A4, A5)
+#define DISPATCH_FUNC6(name, rv, A1, A2, A3, A4, A5, A6) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2, A3, A4, A5, A6)>(&Interface::name))
+#define DISPATCH_FUNC6v(name, rv, A1, A2, A3, A4, A5, A6) DISPATCH_FUNC6(name, rv, A1, A2, A3, A4, A5, A6)
+#define DISPATCH_FUNC7(name, rv, A1, A2, A3, A4, A5, A6, A7) addMethod(#name, static_cast<future<rv> (Interface::*)(A1, A2, A3, A4, A5, A6, A7)>(&Interface::name))
+#define DISPATCH_FUNC7v(name, rv, A1, A2, A3, A4, A5, A6, A7) DISPATCH_FUNC7(name, rv, A1, A2, A3, A4, A5, A6, A7)
 
 #define REGISTERDISPATCHER(Name) template <> void DispatchBase<Name>::Provide(Name *n) { \
                          static Name##Dispatch __inst(n); \
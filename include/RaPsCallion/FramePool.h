@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Rapscallion {
+
+// Recycles the frame buffers of one connection: a Serializer takes its buffer from the pool, and the
+// connection hands it back once the frame has been written. At most maxBuffers buffers are kept, and
+// none larger than maxBufferSize, so a burst of large frames does not stay allocated.
+class FramePool {
+public:
+  static constexpr size_t maxBuffers = 64;
+  static constexpr size_t maxBufferSize = 256 * 1024;
+  std::vector<uint8_t> acquire() {
+    std::lock_guard<std::mutex> l(m);
+    if (buffers.empty()) return std::vector<uint8_t>();
+    std::vector<uint8_t> buffer = std::move(buffers.back());
+    buffers.pop_back();
+    return buffer;
+  }
+  void release(std::vector<uint8_t> buffer) {
+    if (buffer.capacity() > maxBufferSize) return;
+    std::lock_guard<std::mutex> l(m);
+    if (buffers.size() < maxBuffers) buffers.push_back(std::move(buffer));
+  }
+private:
+  std::mutex m;
+  std::vector<std::vector<uint8_t>> buffers;
+};
+
+}
@@ -1,5 +1,10 @@
 #pragma once
 #include <boost/asio.hpp>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include "future.h"
+#include "Metrics.h"
 
 namespace Rapscallion {
 
@@ -7,11 +12,22 @@ class Deserializer;
 class RpcHandle;
 
 struct InterfaceDispatcher {
+  static constexpr size_t npos = size_t(-1);
   virtual ~InterfaceDispatcher() = default;
   virtual const std::string& getInterfaceName () = 0;
-  virtual void Handle(Deserializer& des, RpcHandle& handle) = 0;
+  virtual const std::vector<std::string>& getMethodNames() = 0;
+  virtual size_t getMethodId(const std::string& name) = 0;
+  virtual void Handle(size_t methodId, Deserializer& des, RpcHandle& handle) = 0;
+  // Adds the statistics of each of its methods.
+  virtual void collectMetrics(MetricsSnapshot& snapshot) = 0;
+  // The registered implementation if it implements the interface type, otherwise null.
+  virtual void* implementation(const std::type_info& type) = 0;
+  // Assigned by the RpcHost on registration; used as the channel for replies.
+  size_t interfaceId = 0;
+  // Assigned by the RpcHost on registration. Handlers are run on it, or inline on the connection's
+  // strand when it is null.
+  Executor* executor = nullptr;
 };
 
 }
 
-
@@ -1,16 +1,58 @@
 #pragma once
 #include <boost/asio.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "future.h"
+#include "Metrics.h"
 
 namespace Rapscallion {
 
+class Deserializer;
+
+// An interface as announced by the host: its numeric id and the names of its methods, indexed by method id.
+struct RemoteInterface {
+  static constexpr size_t npos = size_t(-1);
+  RemoteInterface(std::string name_, size_t id_, std::vector<std::string> methods_)
+  : name(std::move(name_))
+  , id(id_)
+  , serial(nextSerial()++)
+  , methods(std::move(methods_))
+  {}
+  size_t methodId(const char* method) const {
+    for (size_t n = 0; n < methods.size(); ++n) {
+      if (methods[n] == method) return n;
+    }
+    return npos;
+  }
+  std::string name;
+  size_t id;
+  // Process-unique, so cached method ids can tell which announcement they were resolved against.
+  uint64_t serial;
+  std::vector<std::string> methods;
+private:
+  static std::atomic<uint64_t>& nextSerial() {
+    static std::atomic<uint64_t> serial(1);
+    return serial;
+  }
+};
+
 struct InterfaceProxy {
   virtual ~InterfaceProxy() = default;
   virtual const std::string& getInterfaceName () = 0;
   virtual void signalDisconnect() = 0;
-  virtual void Handle(Deserializer& s) = 0;
-
+  // Fails the calls outstanding on one of the client's connections, which has closed.
+  virtual void failLane(size_t lane) = 0;
+  virtual void Bind(const RemoteInterface* remote) = 0;
+  // Handles a reply that arrived on the given connection of the client.
+  virtual void Handle(Deserializer& s, size_t lane) = 0;
+  // Handles a CallFailed frame for one of its calls; s is positioned after the interface id.
+  virtual void HandleFailure(Deserializer& s) = 0;
+  virtual void setExecutor(Executor* executor) = 0;
+  // Adds the statistics of every method called so far.
+  virtual void collectMetrics(MetricsSnapshot& snapshot) = 0;
 };
 
 }
 
-
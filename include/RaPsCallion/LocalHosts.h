@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <typeinfo>
+
+namespace Rapscallion {
+
+struct RpcHost;
+
+// The hosts of this process, by the names of the endpoints they listen on; see localName(). A client
+// connected to one of them can call its implementations directly.
+class LocalHosts {
+public:
+  static void add(const std::string& name, RpcHost* host);
+  static void remove(RpcHost* host);
+  // The implementation of the interface type registered on the host listening on name, or on the
+  // wildcard address at name's TCP port, if it may be called directly; see RpcHost::local.
+  static void* find(const std::string& name, const std::type_info& type);
+};
+
+}
+
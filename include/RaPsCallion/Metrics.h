@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "future.h"
+#include "Serializer.h"
+
+namespace Rapscallion {
+
+// Call latencies in nanoseconds, counted in log-linear buckets: every power of two is split into
+// 2^subBucketBits buckets, so a bucket's bounds are within 12.5% of each other. Values below
+// 2^(subBucketBits + 1) have a bucket each; values of 2^maxMagnitude and more go in the last one.
+struct LatencyHistogram {
+  static constexpr unsigned subBucketBits = 3;
+  static constexpr unsigned maxMagnitude = 40;
+  static constexpr size_t bucketCount = (maxMagnitude - subBucketBits + 1) << subBucketBits;
+  static size_t bucketOf(uint64_t ns);
+  // The smallest value counted in the bucket; percentiles report the largest instead.
+  static uint64_t lowerBound(size_t bucket);
+  static uint64_t upperBound(size_t bucket);
+
+  LatencyHistogram() : counts(bucketCount) {}
+  uint64_t count() const;
+  // The latency that a fraction (0 to 1) of the calls stayed at or below, or 0 without calls.
+  uint64_t percentile(double fraction) const;
+  void merge(const LatencyHistogram& other);
+  std::vector<uint64_t> counts;
+};
+
+// The statistics of one method of one proxy or dispatcher, or of several merged together.
+struct MethodMetrics {
+  std::string interfaceName;
+  std::string methodName;
+  uint64_t calls = 0;
+  // Calls still waiting for their reply (proxy) or for their result to be sent (dispatcher).
+  uint64_t inFlight = 0;
+  // Calls that ended without a reply, e.g. because they were dropped or the connection was lost.
+  uint64_t failures = 0;
+  // Whole frames, including their length prefix.
+  uint64_t requestBytes = 0;
+  uint64_t replyBytes = 0;
+  // From the call until its reply was received (proxy) or sent (dispatcher).
+  LatencyHistogram latency;
+  void merge(const MethodMetrics& other);
+};
+
+typedef std::vector<MethodMetrics> MetricsSnapshot;
+
+// Adds m to the snapshot, merged with the entry for the same method if there is one.
+void addTo(MetricsSnapshot& snapshot, const MethodMetrics& m);
+
+// Records the calls of one method. Each thread adds to one of a few separately allocated shards, so
+// the counters are updated with uncontended relaxed atomics; a snapshot sums the shards.
+class MethodStats {
+public:
+  static constexpr size_t shardCount = 16;
+  explicit MethodStats(const char* name)
+  : name_(name)
+  {
+    for (auto& shard : shards) shard.store(nullptr, std::memory_order_relaxed);
+  }
+  ~MethodStats() {
+    for (auto& shard : shards) delete shard.load(std::memory_order_relaxed);
+  }
+  MethodStats(const MethodStats&) = delete;
+  MethodStats& operator=(const MethodStats&) = delete;
+
+  void started(size_t requestBytes) {
+    Shard& shard = local();
+    add(shard.calls, 1);
+    add(shard.requestBytes, requestBytes);
+  }
+  void finished(size_t replyBytes, uint64_t startedAt) {
+    Shard& shard = local();
+    add(shard.replies, 1);
+    add(shard.replyBytes, replyBytes);
+    add(shard.latency[LatencyHistogram::bucketOf(now() - startedAt)], 1);
+  }
+  void failed() {
+    add(local().failures, 1);
+  }
+  MethodMetrics snapshot(const std::string& interfaceName) const;
+  // Nanoseconds on the steady clock, for passing to finished().
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+private:
+  struct Shard {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> requestBytes{0};
+    std::atomic<uint64_t> replyBytes{0};
+    std::atomic<uint64_t> latency[LatencyHistogram::bucketCount] = {};
+  };
+  static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+  // A shard is only allocated once a thread that maps to it records something.
+  Shard& local() {
+    static std::atomic<size_t> threads{0};
+    static thread_local size_t index = threads++ % shardCount;
+    Shard* shard = shards[index].load(std::memory_order_acquire);
+    if (shard) return *shard;
+    Shard* fresh = new Shard;
+    if (shards[index].compare_exchange_strong(shard, fresh, std::memory_order_acq_rel)) return *fresh;
+    delete fresh;
+    return *shard;
+  }
+  const char* name_;
+  std::atomic<Shard*> shards[shardCount];
+};
+
+// The MethodStats of one proxy or dispatcher, indexed by method and created on first use. Methods with
+// an index of capacity or more are not recorded.
+class MethodStatsTable {
+public:
+  static constexpr size_t capacity = 256;
+  MethodStatsTable() {
+    for (auto& entry : entries) entry.store(nullptr, std::memory_order_relaxed);
+  }
+  ~MethodStatsTable() {
+    for (auto& entry : entries) delete entry.load(std::memory_order_relaxed);
+  }
+  MethodStatsTable(const MethodStatsTable&) = delete;
+  MethodStatsTable& operator=(const MethodStatsTable&) = delete;
+  MethodStats* get(size_t index, const char* name) {
+    if (index >= capacity) return nullptr;
+    MethodStats* stats = entries[index].load(std::memory_order_acquire);
+    if (stats) return stats;
+    MethodStats* fresh = new MethodStats(name);
+    if (entries[index].compare_exchange_strong(stats, fresh, std::memory_order_acq_rel)) return fresh;
+    delete fresh;
+    return stats;
+  }
+  void collect(const std::string& interfaceName, MetricsSnapshot& snapshot) const {
+    for (auto& entry : entries) {
+      if (MethodStats* stats = entry.load(std::memory_order_acquire)) addTo(snapshot, stats->snapshot(interfaceName));
+    }
+  }
+private:
+  std::atomic<MethodStats*> entries[capacity];
+};
+
+template <>
+struct serializer<LatencyHistogram> {
+  static void write(Serializer& s, const LatencyHistogram& value);
+  static LatencyHistogram read(Deserializer& s);
+};
+template <>
+struct serializer<MethodMetrics> {
+  static void write(Serializer& s, const MethodMetrics& value);
+  static MethodMetrics read(Deserializer& s);
+};
+
+struct RpcMetricsDispatcher;
+struct RpcMetricsProxy;
+
+// The built-in interface through which a host serves the statistics of its interfaces; see
+// RpcHost::serveMetrics. Include MetricsService.h to call it.
+struct RpcMetrics {
+  typedef RpcMetricsDispatcher Dispatcher;
+  typedef RpcMetricsProxy Proxy;
+  virtual ~RpcMetrics() = default;
+  virtual future<MetricsSnapshot> snapshot() = 0;
+};
+
+}
+
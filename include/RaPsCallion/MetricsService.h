@@ -0,0 +1,27 @@
+#pragma once
+
+#include "Dispatcher.h"
+#include "Metrics.h"
+#include "Proxy.h"
+
+namespace Rapscallion {
+
+struct RpcMetricsDispatcher : public DispatcherBase<RpcMetrics> {
+  RpcMetricsDispatcher(RpcMetrics* inst)
+  : DispatcherBase<RpcMetrics>(inst)
+  {
+    DISPATCH_FUNC(snapshot);
+  }
+};
+
+struct RpcMetricsProxy : public ProxyBase<RpcMetrics> {
+  RpcMetricsProxy(RpcClient& conn)
+  : ProxyBase<RpcMetrics>(conn)
+  {}
+  future<MetricsSnapshot> snapshot() override {
+    return call(PROXY_METHOD(snapshot));
+  }
+};
+
+}
+
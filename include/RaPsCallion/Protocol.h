@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Rapscallion {
+
+// Every frame starts with a varint channel. Channel 0 carries control frames, which continue with one
+// of the opcodes below. Any other channel is the numeric id + 1 of the interface a call or reply
+// belongs to, as assigned by the host when it announces the interface:
+//   call:  channel, method id, request id, arguments
+//   reply: channel, request id, result
+// A call that fails is answered with a CallFailed control frame instead of a reply.
+static constexpr size_t controlChannel = 0;
+
+enum ControlOp : size_t {
+  // host -> client: interface name, interface id, method count, method names (the method id is the index)
+  AnnounceInterface = 0,
+  // client -> host: interface name, method name, request id, arguments. Only used for calls made
+  // before the announcement for that interface has arrived.
+  CallByName = 1,
+  // either way: stream id, a chunk of items. Stream ids are chosen by the sending side.
+  StreamChunk = 2,
+  // either way: stream id, whether it failed, and if so the message of its error
+  StreamEnd = 3,
+  // either way, for a stream the other side sends: stream id, the number of further chunks it may send
+  StreamCredit = 4,
+  // either way, once at the start: a codec the sender can decompress. Compressed frames are only sent
+  // to a peer that has announced their codec.
+  AcceptCompression = 5,
+  // either way: codec, uncompressed size, then the rest of the frame is one or more complete frames
+  // compressed with that codec
+  Compressed = 6,
+  // client -> host: interface id, request id of a call the client has stopped waiting for. The host
+  // does not run it if it has not started yet, and answers it with CallFailed; see RpcHandle::Cancel.
+  CancelCall = 7,
+  // host -> client: interface id, request id, and the message of the exception the call failed with.
+  // The client fails the call with a std::runtime_error carrying the message.
+  CallFailed = 8,
+  // host -> client: interface name, request id, and a message, for a CallByName naming an interface
+  // the host does not have. The client fails the call like a CallFailed one.
+  CallByNameFailed = 9,
+};
+
+enum Codec : size_t {
+  // see lz::compress
+  LzCodec = 1,
+};
+
+// An argument of type future<T> starts with one of these tags:
+enum FutureArgument : size_t {
+  // followed by the value (nothing for future<void>)
+  FutureValue = 0,
+  // followed by the interface id and request id of an earlier call on the same connection
+  FutureReference = 1,
+  // followed by the message of the exception the future holds
+  FutureError = 2,
+};
+
+}
+
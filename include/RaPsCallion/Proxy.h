@@ -2,16 +2,20 @@
 
 #include <functional>
 #include <thread>
-#include <map>
 #include <vector>
 #include <typeinfo>
 #include <atomic>
 #include <exception>
-#include <mutex>
+#include <stdexcept>
+#include <type_traits>
 #include "future.h"
+#include "Arguments.h"
+#include "RequestTable.h"
+#include "StreamTable.h"
 #include "Serializer.h"
 #include "RpcClient.h"
 #include "InterfaceProxy.h"
+#include "Protocol.h"
 
 namespace Rapscallion {
 
@@ -20,8 +24,35 @@ class IProxy;
 class IHasDispatch;
 class RpcClient;
 
+// One proxy method. Caches the method's numeric id together with the serial of the announcement it
+// was resolved against, so a call only compares two integers instead of looking up the method name.
+// The ordinal numbers the methods of one interface on the client side, to index their statistics.
+struct MethodRef {
+  MethodRef(const char* name_, size_t ordinal_)
+  : name(name_)
+  , ordinal(ordinal_)
+  {}
+  template <typename I>
+  static size_t nextOrdinal() {
+    static std::atomic<size_t> next{0};
+    return next++;
+  }
+  size_t idIn(const RemoteInterface& remote) {
+    uint64_t c = cached.load(std::memory_order_relaxed);
+    if ((c >> idBits) == remote.serial) return c & idMask;
+    size_t id = remote.methodId(name);
+    if (id <= idMask) cached.store((remote.serial << idBits) | id, std::memory_order_relaxed);
+    return id;
+  }
+  static constexpr unsigned idBits = 24;
+  static constexpr uint64_t idMask = (uint64_t(1) << idBits) - 1;
+  const char* name;
+  const size_t ordinal;
+  std::atomic<uint64_t> cached{0};
+};
+
 template <typename I>
-class ProxyBase : public I, public InterfaceProxy {
+class ProxyBase : public I, public InterfaceProxy, public CallOrigin {
 public:
   template <typename T>
   static std::string interfaceNameOf() {
@@ -30,80 +61,184 @@ public:
     return str;
   }
   std::string interfaceName = interfaceNameOf<I>();
-  const std::string& getInterfaceName() { 
+  const std::string& getInterfaceName() override {
     return interfaceName;
   }
   ProxyBase(RpcClient& conn)
   : conn_(&conn)
+  , requests(conn.requestCapacity())
   {
+    requests.setLimiter(conn.limiter());
+  }
+  void Bind(const RemoteInterface* remote) override {
+    remote_.store(remote, std::memory_order_release);
+  }
+  const void* channel() const override {
+    return conn_.load(std::memory_order_acquire);
+  }
+  size_t lane(size_t requestId) const override {
+    return requests.laneOf(requestId);
+  }
+  size_t remoteInterfaceId() const override {
+    const RemoteInterface* remote = remote_.load(std::memory_order_acquire);
+    return remote ? remote->id : RemoteInterface::npos;
   }
-  void signalDisconnect() {
-    for (const auto &p : callbacks) {
-      Deserializer s;
-      p.second(s);
+  void setExecutor(Executor* executor) override {
+    executor_.store(executor, std::memory_order_release);
+  }
+  Executor* executor() const override {
+    return executor_.load(std::memory_order_acquire);
+  }
+  StreamTable* streams(size_t lane) const override {
+    RpcClient* conn = conn_.load(std::memory_order_acquire);
+    return conn ? &conn->streams(lane) : nullptr;
+  }
+  void demand() override {
+    RpcClient* conn = conn_.load(std::memory_order_acquire);
+    if (conn) conn->Flush();
+  }
+  void abandon(size_t requestId) override {
+    RpcClient* conn = conn_.load(std::memory_order_acquire);
+    if (conn && conn->Abandon(this, requestId)) {
+      requests.fail(requestId, std::make_exception_ptr(std::runtime_error("Call dropped")));
     }
-    callbacks.clear();
-    conn_ = NULL;
+  }
+  void charge(size_t requestId, size_t bytes) override {
+    requests.charge(requestId, bytes);
+  }
+  bool expire(size_t requestId) override {
+    return requests.fail(requestId, std::make_exception_ptr(std::runtime_error("Deadline exceeded")));
+  }
+  void collectMetrics(MetricsSnapshot& snapshot) override {
+    metrics_.collect(interfaceName, snapshot);
+  }
+  // The client is going away; later calls fail at once.
+  void signalDisconnect() override {
+    conn_.store(nullptr, std::memory_order_release);
+    requests.failAll(std::make_exception_ptr(std::runtime_error("Disconnected")));
+  }
+  void failLane(size_t lane) override {
+    requests.failAll(std::make_exception_ptr(std::runtime_error("Disconnected")), lane);
   }
 protected:
-  size_t getRequestId() {
-    return newRequestId++;
-  }
-  template <typename T> future<T> getFutureFor(size_t requestId) {
-    std::shared_ptr<promise<T>> value = std::make_shared<promise<T>>();
-    future<T> rv = value->get_future();
-    callbacks[requestId] = [value](Deserializer&s){
-      try {
-        value->set_value(serializer<T>::read(s));
-      } catch (...) {
-        value->set_exception(std::current_exception());
-      }
-    };
-    return rv;
+  // Until the host has announced this interface, calls name their interface and method.
+  void writeCallHeader(Serializer& s, MethodRef& method, size_t reqId) {
+    const RemoteInterface* remote = remote_.load(std::memory_order_acquire);
+    size_t methodId = remote ? method.idIn(*remote) : RemoteInterface::npos;
+    if (methodId == RemoteInterface::npos) {
+      serializer<size_t>::write(s, controlChannel);
+      serializer<size_t>::write(s, CallByName);
+      serializer<std::string>::write(s, getInterfaceName());
+      serializer<std::string>::write(s, method.name);
+    } else {
+      serializer<size_t>::write(s, remote->id + 1);
+      serializer<size_t>::write(s, methodId);
+    }
+    serializer<size_t>::write(s, reqId);
   }
-public:
-  void Handle(Deserializer& s) override {
-    std::function<void(Deserializer&)> cb;
-    {
-      std::unique_lock<std::mutex> lock(cbM);
-      size_t id = serializer<size_t>::read(s);
-      auto it = callbacks.find(id);
-      if (it == callbacks.end()) {
-        printf("No callback found for requestID %zu on %p/%p interface %s\n", id, (void*)this, (void*)&conn_, getInterfaceName().c_str());
-        return;
-      }
-      cb = it->second;
-      callbacks.erase(it);
+  // Reserves a slot for a new call, returning its future and setting requestId.
+  template <typename T> future<T> getFutureFor(size_t& requestId, MethodStats* stats = nullptr, size_t lane = 0) {
+    return requests.template reserve<T>(requestId, stats, lane);
+  }
+  // Sends a call to the interface method identified by `method`, whose signature determines how each
+  // argument is serialized. Arguments are taken by reference and serialized without copies. The
+  // returned future can be passed as a future<R> argument to a later call through the same client.
+  // A call that takes such a future goes out on the connection the earlier call went out on. The
+  // client's deadline for the call, if any, starts now; see RpcClient::Deadline.
+  template <typename R, typename... Params, typename... Args>
+  future<R> call(MethodRef& method, future<R> (I::*)(Params...), const Args&... args) {
+    static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for remote call");
+    RpcClient* conn = conn_.load(std::memory_order_acquire);
+    if (!conn) return boost::make_exceptional_future<R>(std::runtime_error("Disconnected"));
+    size_t reqId;
+    const size_t lane = conn->pickLane(pinnedLane<typename std::decay<Params>::type...>(args...));
+    MethodStats* stats = metrics_.get(method.ordinal, method.name);
+    future<R> f = getFutureFor<R>(reqId, stats, lane);
+    // Channel, method id and request id; calls by name grow the frame.
+    Serializer s(conn->framePool(lane).acquire(), 3 * detail::maxVarintSize + argumentsSize<typename std::decay<Params>::type...>(args...));
+    writeCallHeader(s, method, reqId);
+    writeArguments<typename std::decay<Params>::type...>(s, OutgoingCall{*this, lane}, args...);
+    if (stats) stats->started(s.size());
+    if (!conn->SendCall(std::move(s), this, reqId, lane)) {
+      StreamTable::cancelPending();
+      requests.fail(reqId, std::make_exception_ptr(std::runtime_error("Too many calls in flight")));
+      return future<R>(std::move(f));
     }
-    cb(s);
+    if (conn->disconnected(lane)) {
+      conn->Drop(this, reqId);
+      requests.fail(reqId, std::make_exception_ptr(std::runtime_error("Disconnected")));
+      StreamTable::cancelPending();
+      return future<R>(std::move(f));
+    }
+    conn->WatchDeadline(this, reqId, lane);
+    // Stream arguments only start sending once the call is on its way.
+    if (StreamTable::hasPending()) {
+      conn->Flush();
+      StreamTable::startPending();
+    }
+    return future<R>(std::move(f), this, reqId);
   }
-  RpcClient* conn_;
-private:
-  size_t newRequestId = 0;
-  std::map<size_t, std::function<void(Deserializer&)>> callbacks;
+  template <typename... Ts, typename... Args>
+  static size_t argumentsSize(const Args&... args) {
+    size_t sizes[] = { 0, detail::Argument<Ts>::size(args)... };
+    size_t total = 0;
+    for (size_t size : sizes) total += size;
+    return total;
+  }
+  // The lane of the first pipelined argument, if there is one.
+  template <typename... Ts, typename... Args>
+  size_t pinnedLane(const Args&... args) const {
+    size_t lanes[] = { CallOrigin::noLane, detail::Argument<Ts>::lane(args, *this)... };
+    for (size_t lane : lanes) {
+      if (lane != CallOrigin::noLane) return lane;
+    }
+    return CallOrigin::noLane;
+  }
+  template <typename... Ts, typename... Args>
+  void writeArguments(Serializer& s, const OutgoingCall& outgoing, const Args&... args) {
+    int expand[] = { 0, (detail::Argument<Ts>::write(s, outgoing, args), 0)... };
+    (void)expand;
+  }
+  typedef I Interface;
 public:
-  std::mutex cbM;
+  void Handle(Deserializer& s, size_t lane) override {
+    size_t id = serializer<size_t>::read(s);
+    // A reply that matches no outstanding call is for one that has expired; it is dropped.
+    requests.complete(id, s, streams(lane));
+  }
+  void HandleFailure(Deserializer& s) override {
+    size_t id = serializer<size_t>::read(s);
+    std::string message = serializer<std::string>::read(s);
+    requests.fail(id, std::make_exception_ptr(std::runtime_error(message)));
+  }
+  // Null once the client has gone away.
+  std::atomic<RpcClient*> conn_;
+private:
+  std::atomic<const RemoteInterface*> remote_{nullptr};
+  std::atomic<Executor*> executor_{nullptr};
+  // Outlives requests, whose destructor records the calls it fails.
+  MethodStatsTable metrics_;
+  RequestTable requests;
 };
 
-#define PROXY_PROLOG(name, type)  \
-  std::unique_lock<std::mutex> lock(cbM); \
-  size_t reqId = getRequestId(); \
-  future<type> f = getFutureFor<type>(reqId); \
-  Rapscallion::Serializer s; \
-  Rapscallion::serializer<std::string>::write(s, getInterfaceName()); \
-  Rapscallion::serializer<std::string>::write(s, #name); \
-  Rapscallion::serializer<size_t>::write(s, reqId);
-#define PROXY_EPILOG(type) \
-  conn_->Send(s); \
-  return f;
-#define PROXY_FUNC0(name, type) future<type> name() override { PROXY_PROLOG(name, type) PROXY_EPILOG(type) }
-#define PROXY_FUNC1(name, type, a1) future<type> name(a1 A1) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); PROXY_EPILOG(type) }
-#define PROXY_FUNC2(name, type, a1, a2) future<type> name(a1 A1, a2 A2) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); PROXY_EPILOG(type) }
-#define PROXY_FUNC3(name, type, a1, a2, a3) future<type> name(a1 A1, a2 A2, a3 A3) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); Rapscallion::serializer<a3>::write(s, A3); PROXY_EPILOG(type) }
-#define PROXY_FUNC4(name, type, a1, a2, a3, a4) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); Rapscallion::serializer<a3>::write(s, A3); Rapscallion::serializer<a4>::write(s, A4); PROXY_EPILOG(type) }
-#define PROXY_FUNC5(name, type, a1, a2, a3, a4, a5) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); Rapscallion::serializer<a3>::write(s, A3); Rapscallion::serializer<a4>::write(s, A4); Rapscallion::serializer<a5>::write(s, A5); PROXY_EPILOG(type) }
-#define PROXY_FUNC6(name, type, a1, a2, a3, a4, a5, a6) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5, a6 A6) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); Rapscallion::serializer<a3>::write(s, A3); Rapscallion::serializer<a4>::write(s, A4); Rapscallion::serializer<a5>::write(s, A5); Rapscallion::serializer<a6>::write(s, A6); PROXY_EPILOG(type) }
-#define PROXY_FUNC7(name, type, a1, a2, a3, a4, a5, a6, a7) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5, a6 A6, a7 A7) override { PROXY_PROLOG(name, type) Rapscallion::serializer<a1>::write(s, A1); Rapscallion::serializer<a2>::write(s, A2); Rapscallion::serializer<a3>::write(s, A3); Rapscallion::serializer<a4>::write(s, A4); Rapscallion::serializer<a5>::write(s, A5); Rapscallion::serializer<a6>::write(s, A6); Rapscallion::serializer<a7>::write(s, A7); PROXY_EPILOG(type) }
+// Expands to the MethodRef and member function pointer that ProxyBase::call expects, e.g.
+//   future<std::string> getURI(const std::string& name) override { return call(PROXY_METHOD(getURI), name); }
+#define PROXY_METHOD(name) PROXY_METHOD_REF(name), &Interface::name
+#define PROXY_METHODn(name, type, ...) PROXY_METHOD_REF(name), static_cast<future<type> (Interface::*)(__VA_ARGS__)>(&Interface::name)
+#define PROXY_METHOD_REF(name) \
+  []() -> Rapscallion::MethodRef& { \
+    static Rapscallion::MethodRef method(#name, Rapscallion::MethodRef::nextOrdinal<Interface>()); \
+    return method; \
+  }()
+
+#define PROXY_FUNC0(name, type) future<type> name() override { return call(PROXY_METHOD_REF(name), static_cast<future<type> (Interface::*)()>(&Interface::name)); }
+#define PROXY_FUNC1(name, type, a1) future<type> name(a1 A1) override { return call(PROXY_METHODn(name, type, a1), A1); }
+#define PROXY_FUNC2(name, type, a1, a2) future<type> name(a1 A1, a2 A2) override { return call(PROXY_METHODn(name, type, a1, a2), A1, A2); }
+#define PROXY_FUNC3(name, type, a1, a2, a3) future<type> name(a1 A1, a2 A2, a3 A3) override { return call(PROXY_METHODn(name, type, a1, a2, a3), A1, A2, A3); }
+#define PROXY_FUNC4(name, type, a1, a2, a3, a4) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4) override { return call(PROXY_METHODn(name, type, a1, a2, a3, a4), A1, A2, A3, A4); }
+#define PROXY_FUNC5(name, type, a1, a2, a3, a4, a5) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5) override { return call(PROXY_METHODn(name, type, a1, a2, a3, a4, a5), A1, A2, A3, A4, A5); }
+#define PROXY_FUNC6(name, type, a1, a2, a3, a4, a5, a6) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5, a6 A6) override { return call(PROXY_METHODn(name, type, a1, a2, a3, a4, a5, a6), A1, A2, A3, A4, A5, A6); }
+#define PROXY_FUNC7(name, type, a1, a2, a3, a4, a5, a6, a7) future<type> name(a1 A1, a2 A2, a3 A3, a4 A4, a5 A5, a6 A6, a7 A7) override { return call(PROXY_METHODn(name, type, a1, a2, a3, a4, a5, a6, a7), A1, A2, A3, A4, A5, A6, A7); }
 
 }
 
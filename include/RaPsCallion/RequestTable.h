@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include "CallLimits.h"
+#include "future.h"
+#include "Metrics.h"
+#include "Serializer.h"
+#include "StreamTable.h"
+
+namespace Rapscallion {
+
+// The outstanding calls of one proxy, kept in a table of slots. A request id is a slot index combined
+// with that slot's generation, so a reply for a slot that has since been reused is recognized as
+// stale. Reserving and completing a slot each take a single compare-and-swap.
+// The table starts with a few slots and doubles whenever all of them are in use, up to its capacity.
+// Slots are never moved or freed before the table is, so a request id stays valid as it grows.
+class RequestTable {
+public:
+  static constexpr size_t defaultCapacity = 65536;
+  // The capacity is rounded up to a power of two.
+  explicit RequestTable(size_t capacity = defaultCapacity)
+  : indexBits(bitsFor(capacity) > firstSegmentBits ? bitsFor(capacity) : firstSegmentBits)
+  , mask((size_t(1) << indexBits) - 1)
+  , segments(new std::atomic<Slot*>[segmentOf(mask) + 1])
+  {
+    for (size_t segment = 0; segment <= segmentOf(mask); ++segment) {
+      segments[segment].store(nullptr, std::memory_order_relaxed);
+    }
+    segments[0].store(new Slot[size_t(1) << firstSegmentBits], std::memory_order_relaxed);
+  }
+  ~RequestTable() {
+    failAll(std::make_exception_ptr(std::runtime_error("Proxy destroyed")));
+    for (size_t segment = 0; segment <= segmentOf(mask); ++segment) {
+      delete[] segments[segment].load(std::memory_order_relaxed);
+    }
+  }
+
+  // Returns the future for a new call and its request id. Throws if every slot is in use and the table
+  // cannot grow. The call's outcome and latency are recorded in stats, if given; lane is kept for
+  // laneOf().
+  template <typename T>
+  future<T> reserve(size_t& requestId, MethodStats* stats = nullptr, size_t lane = 0) {
+    static_assert(sizeof(promise<T>) <= sizeof(Storage) && alignof(promise<T>) <= alignof(Storage), "promise<T> does not fit a request slot");
+    for (;;) {
+      const size_t count = live.load(std::memory_order_acquire);
+      for (size_t attempt = 0; attempt < count; ++attempt) {
+        size_t index = next.fetch_add(1, std::memory_order_relaxed) & (count - 1);
+        Slot& slot = *slotAt(index);
+        uint32_t state = slot.state.load(std::memory_order_relaxed);
+        if ((state & phaseMask) != Free ||
+            !slot.state.compare_exchange_strong(state, state | Claimed, std::memory_order_acquire)) {
+          continue;
+        }
+        return start<T>(slot, index, state, requestId, stats, lane);
+      }
+      if (!grow(count)) throw std::runtime_error("Too many outstanding requests");
+    }
+  }
+
+  // Fulfils the call with the reply in s, receiving any stream in it on streams. Returns false if the
+  // id does not belong to an outstanding call.
+  bool complete(size_t requestId, Deserializer& s, StreamTable* streams = nullptr) {
+    Slot* slot = claim(requestId);
+    if (!slot) return false;
+    if (slot->stats) slot->stats->finished(s.packetSize(), slot->startedAt);
+    uncharge(*slot);
+    slot->complete(&slot->storage, &s, streams, nullptr);
+    release(*slot);
+    return true;
+  }
+
+  // The lane the call was reserved with, or CallOrigin::noLane if it is no longer outstanding.
+  size_t laneOf(size_t requestId) const {
+    const Slot* found = slotAt(requestId & mask);
+    if (!found) return CallOrigin::noLane;
+    const Slot& slot = *found;
+    const uint32_t expected = (uint32_t(requestId >> indexBits) << phaseBits) | Pending;
+    if (slot.state.load(std::memory_order_acquire) != expected) return CallOrigin::noLane;
+    size_t lane = slot.lane.load(std::memory_order_relaxed);
+    // The slot may have been completed and reused in the meantime.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.state.load(std::memory_order_relaxed) == expected ? lane : CallOrigin::noLane;
+  }
+
+  // Fails the call with error. Returns false if the id does not belong to an outstanding call.
+  bool fail(size_t requestId, std::exception_ptr error) {
+    Slot* slot = claim(requestId);
+    if (!slot) return false;
+    if (slot->stats) slot->stats->failed();
+    uncharge(*slot);
+    slot->complete(&slot->storage, nullptr, nullptr, error);
+    release(*slot);
+    return true;
+  }
+
+  // Calls charged to the limiter (see CallLimiter::admit) are released to it once they complete.
+  void setLimiter(std::shared_ptr<CallLimiter> limiter) {
+    limiter_ = std::move(limiter);
+  }
+  void charge(size_t requestId, size_t bytes) {
+    slotAt(requestId & mask)->charged.store(bytes, std::memory_order_relaxed);
+  }
+
+  // Fails every outstanding call, or only those reserved with the given lane.
+  void failAll(std::exception_ptr error, size_t lane = CallOrigin::noLane) {
+    const size_t count = live.load(std::memory_order_acquire);
+    for (size_t index = 0; index < count; ++index) {
+      Slot& slot = *slotAt(index);
+      uint32_t state = slot.state.load(std::memory_order_acquire);
+      // The lane belongs to the generation in state if the slot still holds it when claimed.
+      if ((state & phaseMask) == Pending &&
+          (lane == CallOrigin::noLane || slot.lane.load(std::memory_order_relaxed) == lane) &&
+          slot.state.compare_exchange_strong(state, (state & ~phaseMask) | Claimed, std::memory_order_acquire)) {
+        if (slot.stats) slot.stats->failed();
+        uncharge(slot);
+        slot.complete(&slot.storage, nullptr, nullptr, error);
+        release(slot);
+      }
+    }
+  }
+
+private:
+  enum Phase : uint32_t { Free = 0, Claimed = 1, Pending = 2 };
+  static constexpr unsigned phaseBits = 2;
+  static constexpr uint32_t phaseMask = (1 << phaseBits) - 1;
+  typedef typename std::aligned_storage<sizeof(promise<int>), alignof(promise<int>)>::type Storage;
+
+  struct Slot {
+    // generation << phaseBits | phase
+    std::atomic<uint32_t> state{0};
+    void (*complete)(void* storage, Deserializer* s, StreamTable* streams, std::exception_ptr error) = nullptr;
+    MethodStats* stats = nullptr;
+    std::atomic<size_t> lane{0};
+    // The request bytes the limiter counts for the call, or 0 if it does not count it.
+    std::atomic<size_t> charged{0};
+    uint64_t startedAt = 0;
+    Storage storage;
+  };
+
+  template <typename T>
+  struct ResultOf {
+    static void set(promise<T>& p, Deserializer& s, StreamTable*) { p.set_value(serializer<T>::read(s)); }
+  };
+  template <typename T>
+  struct ResultOf<stream<T>> {
+    static void set(promise<stream<T>>& p, Deserializer& s, StreamTable* streams) {
+      size_t id = serializer<size_t>::read(s);
+      if (!streams) throw std::runtime_error("No connection to receive a stream on");
+      p.set_value(streams->receive<T>(id));
+    }
+  };
+
+  // Sets the promise from the reply, or to error if there is no reply, and destroys it.
+  template <typename T>
+  static void completeWith(void* storage, Deserializer* s, StreamTable* streams, std::exception_ptr error) {
+    promise<T>& p = *static_cast<promise<T>*>(storage);
+    if (s) {
+      try {
+        ResultOf<T>::set(p, *s, streams);
+      } catch (...) {
+        p.set_exception(std::current_exception());
+      }
+    } else {
+      // Rethrown so the future throws the error itself rather than a std::exception_ptr holding it.
+      try {
+        std::rethrow_exception(error);
+      } catch (...) {
+        p.set_exception(boost::current_exception());
+      }
+    }
+    p.~promise<T>();
+  }
+
+  template <typename T>
+  future<T> start(Slot& slot, size_t index, uint32_t state, size_t& requestId, MethodStats* stats, size_t lane) {
+    promise<T>* p = new (&slot.storage) promise<T>();
+    slot.complete = &completeWith<T>;
+    slot.stats = stats;
+    slot.lane.store(lane, std::memory_order_relaxed);
+    if (stats) slot.startedAt = MethodStats::now();
+    future<T> f = p->get_future();
+    requestId = (size_t(state >> phaseBits) << indexBits) | index;
+    slot.state.store((state & ~phaseMask) | Pending, std::memory_order_release);
+    return f;
+  }
+
+  Slot* claim(size_t requestId) {
+    Slot* slot = slotAt(requestId & mask);
+    uint32_t expected = (uint32_t(requestId >> indexBits) << phaseBits) | Pending;
+    if (!slot || (requestId >> indexBits) > (UINT32_MAX >> phaseBits) ||
+        !slot->state.compare_exchange_strong(expected, (expected & ~phaseMask) | Claimed, std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return slot;
+  }
+
+  // Segment 0 holds the first 2^firstSegmentBits slots, and every later segment as many slots as all
+  // segments before it.
+  static size_t segmentOf(size_t index) {
+    size_t segment = 0;
+    for (index >>= firstSegmentBits; index; index >>= 1) ++segment;
+    return segment;
+  }
+  // The slot, or null if the table has not grown that far yet.
+  Slot* slotAt(size_t index) const {
+    if (index >= live.load(std::memory_order_acquire)) return nullptr;
+    const size_t segment = segmentOf(index);
+    const size_t first = segment ? size_t(1) << (firstSegmentBits + segment - 1) : 0;
+    return segments[segment].load(std::memory_order_relaxed) + (index - first);
+  }
+  // Doubles the table, unless another caller already grew it past count. Returns false if it is full.
+  bool grow(size_t count) {
+    std::lock_guard<std::mutex> l(growMutex);
+    if (live.load(std::memory_order_relaxed) != count) return true;
+    if (count > mask) return false;
+    segments[segmentOf(count)].store(new Slot[count], std::memory_order_relaxed);
+    live.store(count * 2, std::memory_order_release);
+    return true;
+  }
+
+  // Hands the call's room back to the limiter before its future is ready, so whoever the result
+  // wakes up finds the room already there.
+  void uncharge(Slot& slot) {
+    size_t charged = slot.charged.exchange(0, std::memory_order_relaxed);
+    if (charged && limiter_) limiter_->release(charged);
+  }
+  // Frees the slot under the next generation; the generation wraps around harmlessly.
+  static void release(Slot& slot) {
+    uint32_t state = slot.state.load(std::memory_order_relaxed);
+    slot.state.store((state & ~phaseMask) + (1 << phaseBits), std::memory_order_release);
+  }
+
+  static unsigned bitsFor(size_t capacity) {
+    unsigned bits = 0;
+    while ((size_t(1) << bits) < capacity) ++bits;
+    return bits;
+  }
+
+  static constexpr unsigned firstSegmentBits = 6;
+  const unsigned indexBits;
+  const size_t mask;
+  std::unique_ptr<std::atomic<Slot*>[]> segments;
+  // The slots allocated so far, a power of two.
+  std::atomic<size_t> live{size_t(1) << firstSegmentBits};
+  std::mutex growMutex;
+  std::atomic<size_t> next{0};
+  std::shared_ptr<CallLimiter> limiter_;
+};
+
+template <>
+struct RequestTable::ResultOf<void> {
+  static void set(promise<void>& p, Deserializer&, StreamTable*) { p.set_value(); }
+};
+
+}
+
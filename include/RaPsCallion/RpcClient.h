@@ -1,57 +1,676 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <boost/make_unique.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <vector>
 #include <memory>
+#include "future.h"
+#include "CallLimits.h"
 #include "InterfaceProxy.h"
 #include "Connection.h"
+#include "LocalHosts.h"
+#include "Protocol.h"
+#include "RequestTable.h"
+#include "StreamTable.h"
 
 namespace Rapscallion {
 
 class Connection;
 class InterfaceProxy;
 
+// In lazy mode an RpcClient queues calls instead of sending them. The queue goes out in a single write,
+// in the order the calls were made, once a result is waited for or given a continuation, Flush() is
+// called, or one of these limits is reached. Calls whose future is dropped unused while still queued
+// are never sent.
+struct LazyOptions {
+  size_t maxQueuedBytes = 64 * 1024;
+  // The longest a call is held back.
+  std::chrono::microseconds maxDelay = std::chrono::milliseconds(1);
+};
+
 struct RpcClient {
   RpcClient(boost::asio::ip::tcp::socket socket)
-  : connection_(std::make_shared<Connection>(std::move(socket), [this](const char* data, size_t size){
-    des.AddBytes(reinterpret_cast<const uint8_t*>(data), size);
-    while (des.HasFullPacket()) {
-      Handle();
-      des.RemovePacket();
-    }
-  }))
+  : RpcClient(makeTransport(std::move(socket)))
+  {}
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  RpcClient(boost::asio::local::stream_protocol::socket socket)
+  : RpcClient(makeTransport(std::move(socket)))
+  {}
+#endif
+  explicit RpcClient(std::unique_ptr<Transport> transport)
+  : RpcClient(only(std::move(transport)))
+  {}
+  // Spreads the calls over several connections to the same host, e.g. from connectAll(). Each call
+  // goes out on the connection with the fewest calls in flight, so a large or slow reply only holds
+  // up the calls behind it on its own connection. A call that takes the future of an earlier call
+  // follows it on its connection; calls on different connections may be handled in any order.
+  explicit RpcClient(std::vector<std::unique_ptr<Transport>> transports)
+  : peer_(transports.empty() ? std::string() : transports.front()->peerName())
+  , flushTimer(transports.at(0)->executor())
+  , deadlineTimer(transports.at(0)->executor())
+  , limiter_(std::make_shared<CallLimiter>([this](std::vector<CallLimiter::QueuedCall> calls){ SendQueued(std::move(calls)); }))
   {
-    connection_->start();
+    for (size_t n = 0; n < transports.size(); ++n) {
+      auto lane = boost::make_unique<Lane>();
+      Lane* l = lane.get();
+      lane->connection = std::make_shared<Connection>(std::move(transports[n]), lane->des, [this, l, n]{
+        while (l->des.HasFullPacket()) {
+          Handle(l->des, n);
+          l->des.RemovePacket();
+        }
+      }, [this, n]{
+        LaneClosed(n);
+      });
+      lane->streams = std::make_shared<StreamTable>(lane->connection);
+      lanes_.push_back(std::move(lane));
+    }
+    for (auto& lane : lanes_) {
+      lane->connection->acceptCompression();
+      lane->connection->start();
+    }
   }
   ~RpcClient() {
+    {
+      std::lock_guard<std::mutex> l(lifetime_->m);
+      lifetime_->alive = false;
+    }
+    flushTimer.cancel();
+    deadlineTimer.cancel();
+    limiter_->close();
+    for (auto& lane : lanes_) {
+      lane->connection->detach();
+      lane->streams->disconnect();
+    }
     for (auto& proxy : proxies) {
       proxy->signalDisconnect();
     }
   }
   template <typename T>
   T* Get() {
+    if (shortCircuit) {
+      if (void* implementation = LocalHosts::find(peer_, typeid(T))) return static_cast<T*>(implementation);
+    }
     std::lock_guard<std::mutex> l(m);
+    // Every Get() for an interface shares one proxy. Proxies are never deleted, on purpose: the futures
+    // of their calls may outlive the client and still call into them, and find them disconnected.
+    for (auto existing : proxies) {
+      if (auto proxy = dynamic_cast<typename T::Proxy*>(existing)) return proxy;
+    }
     typename T::Proxy* proxy = new typename T::Proxy(*this);
+    proxy->setExecutor(executor);
     proxies.push_back(proxy);
+    auto it = remoteInterfaces.find(proxy->getInterfaceName());
+    if (it != remoteInterfaces.end()) {
+      Bind(proxy, it->second.get());
+    }
     return proxy;
   }
-  void Send(const Serializer& s) {
-    connection_->write(reinterpret_cast<const char*>(s.data()), s.size());
+  // The statistics of every method called through this client's proxies.
+  MetricsSnapshot metrics() {
+    std::lock_guard<std::mutex> l(m);
+    MetricsSnapshot snapshot;
+    for (auto& proxy : proxies) {
+      proxy->collectMetrics(snapshot);
+    }
+    return snapshot;
+  }
+  // The number of connections calls are spread over.
+  size_t lanes() const {
+    return lanes_.size();
+  }
+  Connection& connection(size_t lane = 0) {
+    return *lanes_[lane]->connection;
+  }
+  FramePool& framePool(size_t lane = 0) {
+    return lanes_[lane]->connection->framePool();
+  }
+  StreamTable& streams(size_t lane = 0) {
+    return *lanes_[lane]->streams;
+  }
+  // The connection for a new call: pinned if it is a lane, otherwise the least busy one. Ties go
+  // round-robin, so calls made one at a time are spread too.
+  size_t pickLane(size_t pinned) {
+    if (pinned < lanes_.size()) return pinned;
+    const size_t count = lanes_.size();
+    if (count == 1) return 0;
+    const size_t start = nextLane.fetch_add(1, std::memory_order_relaxed) % count;
+    size_t best = start;
+    size_t least = load(start);
+    for (size_t n = 1; n < count && least > 0; ++n) {
+      size_t lane = (start + n) % count;
+      size_t inFlight = load(lane);
+      if (inFlight < least) {
+        best = lane;
+        least = inFlight;
+      }
+    }
+    return best;
+  }
+  // Whether the lane's connection has closed. Checked after a call is sent, as its frame is dropped
+  // if the connection closed before the call could be failed with the others.
+  bool disconnected(size_t lane) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return lanes_[lane]->closed.load(std::memory_order_relaxed);
+  }
+  // Continuations attached to the futures of this client's calls run on executor, unless they are
+  // given a launch policy or executor of their own.
+  void setExecutor(Executor* ex) {
+    std::lock_guard<std::mutex> l(m);
+    executor = ex;
+    for (auto& proxy : proxies) {
+      proxy->setExecutor(executor);
+    }
+  }
+
+  // Lets Get() hand out the implementation itself instead of a proxy when the host at the other end
+  // lives in this process and runs it inline (see RpcHost::local), so a call costs a virtual call.
+  // Such calls run on the calling thread, are not counted in metrics(), and an exception the
+  // implementation throws reaches the caller directly. Only affects later calls to Get().
+  void setShortCircuit(bool enable) {
+    shortCircuit = enable;
+  }
+
+  // Writes of at least options.threshold bytes are compressed once the host accepts compression.
+  void setCompression(const CompressionOptions& options) {
+    for (auto& lane : lanes_) {
+      lane->connection->setCompression(options);
+    }
+  }
+
+  // A reply frame with a longer payload closes the connection it arrived on.
+  void setMaxFrameSize(size_t bytes) {
+    for (auto& lane : lanes_) {
+      lane->connection->setMaxFrameSize(bytes);
+    }
+  }
+
+  void setLazy(bool enable, const LazyOptions& options = LazyOptions()) {
+    {
+      std::lock_guard<std::mutex> l(lazyMutex);
+      lazyOptions = options;
+      lazy = enable;
+    }
+    if (!enable) Flush();
+  }
+  // Collects the calls this thread makes on the client while the batch is in scope, and writes them
+  // to each connection at once when the batch is flushed or destroyed, or a result of any call on the
+  // client is needed, on whichever thread.
+  class Batch {
+  public:
+    explicit Batch(RpcClient& client)
+    : client_(client)
+    , outer_(innermost())
+    {
+      innermost() = this;
+      std::lock_guard<std::mutex> l(client_.batchMutex);
+      client_.batches.push_back(this);
+      client_.openBatches = client_.batches.size();
+    }
+    ~Batch() {
+      flush();
+      innermost() = outer_;
+      std::lock_guard<std::mutex> l(client_.batchMutex);
+      client_.batches.erase(std::find(client_.batches.begin(), client_.batches.end(), this));
+      client_.openBatches = client_.batches.size();
+    }
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+    void flush() {
+      // Held while writing, so calls flushed by two threads at once still go out in order.
+      std::lock_guard<std::mutex> l(m_);
+      if (bytes_ == flushedBytes_) return;
+      flushedBytes_ = bytes_;
+      // Calls queued in lazy mode may be referenced by calls in this batch, so they go first.
+      std::lock_guard<std::mutex> lazy(client_.lazyMutex);
+      client_.FlushLocked();
+      for (size_t lane = 0; lane < frames_.size(); ++lane) {
+        if (frames_[lane].empty()) continue;
+        std::vector<Frame> frames;
+        frames.swap(frames_[lane]);
+        client_.connection(lane).write(std::move(frames));
+      }
+    }
+    // The number of calls and bytes coalesced by this batch so far.
+    size_t calls() const {
+      std::lock_guard<std::mutex> l(m_);
+      return calls_;
+    }
+    size_t bytes() const {
+      std::lock_guard<std::mutex> l(m_);
+      return bytes_;
+    }
+  private:
+    friend struct RpcClient;
+    void add(Frame frame, size_t lane) {
+      std::lock_guard<std::mutex> l(m_);
+      if (frames_.size() <= lane) frames_.resize(lane + 1);
+      ++calls_;
+      bytes_ += frame.size();
+      frames_[lane].push_back(std::move(frame));
+    }
+    static Batch*& innermost() {
+      static thread_local Batch* batch = nullptr;
+      return batch;
+    }
+    static Batch* find(const RpcClient* client) {
+      for (Batch* batch = innermost(); batch; batch = batch->outer_) {
+        if (&batch->client_ == client) return batch;
+      }
+      return nullptr;
+    }
+    RpcClient& client_;
+    Batch* outer_;
+    // Guards the frames and counts, which other threads flush.
+    mutable std::mutex m_;
+    std::vector<std::vector<Frame>> frames_;
+    size_t calls_ = 0;
+    size_t bytes_ = 0;
+    size_t flushedBytes_ = 0;
+  };
+
+  // Applies to calls made from now on; calls already waiting or queued are let through once the new
+  // limits allow it.
+  void setLimits(const CallLimits& limits) {
+    limiter_->setLimits(limits);
+  }
+  const std::shared_ptr<CallLimiter>& limiter() const {
+    return limiter_;
+  }
+  // How many calls a proxy can have outstanding before further calls throw. Only applies to proxies
+  // that Get() creates after it is set.
+  void setRequestCapacity(size_t capacity) {
+    requestCapacity_ = capacity;
+  }
+  size_t requestCapacity() const {
+    return requestCapacity_;
+  }
+  // Calls made outside any Deadline fail once they have waited this long for their reply; zero, the
+  // default, lets them wait forever.
+  void setTimeout(std::chrono::steady_clock::duration timeout) {
+    defaultTimeout = timeout.count();
   }
-  void Handle() {
+  // Gives the calls this thread makes on the client while it is in scope a deadline of their own; the
+  // innermost one applies. A call that is still outstanding at its deadline fails with "Deadline
+  // exceeded" and frees its request slot. If it was sent, the host is told to cancel it, which stops
+  // it unless it has started running already; a late reply is dropped.
+  class Deadline {
+  public:
+    Deadline(RpcClient& client, std::chrono::steady_clock::duration timeout)
+    : Deadline(client, std::chrono::steady_clock::now() + timeout)
+    {}
+    Deadline(RpcClient& client, std::chrono::steady_clock::time_point at)
+    : client_(client)
+    , at_(at)
+    , outer_(innermost())
+    {
+      innermost() = this;
+    }
+    ~Deadline() {
+      innermost() = outer_;
+    }
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+  private:
+    friend struct RpcClient;
+    static Deadline*& innermost() {
+      static thread_local Deadline* deadline = nullptr;
+      return deadline;
+    }
+    static Deadline* find(const RpcClient* client) {
+      for (Deadline* deadline = innermost(); deadline; deadline = deadline->outer_) {
+        if (&deadline->client_ == client) return deadline;
+      }
+      return nullptr;
+    }
+    RpcClient& client_;
+    std::chrono::steady_clock::time_point at_;
+    Deadline* outer_;
+  };
+
+  // Returns false if the client's CallLimits reject the call.
+  bool SendCall(Serializer&& s, CallOrigin* origin, size_t requestId, size_t lane = 0) {
+    Frame frame = s.release();
+    if (limiter_->active()) {
+      switch (limiter_->admit(frame, origin, requestId, lane, !Connection::inHandler(), !StreamTable::hasPending(), [this]{ Flush(); })) {
+      case CallLimiter::Queued:
+        return true;
+      case CallLimiter::Rejected:
+        framePool(lane).release(std::move(frame.buffer));
+        return false;
+      case CallLimiter::Send:
+        break;
+      }
+    }
+    Dispatch(std::move(frame), origin, requestId, lane);
+    return true;
+  }
+  void Dispatch(Frame frame, const CallOrigin* origin, size_t requestId, size_t lane) {
+    lanes_[lane]->inFlight.fetch_add(1, std::memory_order_relaxed);
+    if (Batch* batch = Batch::find(this)) {
+      batch->add(std::move(frame), lane);
+      return;
+    }
+    if (!lazy && queuedCalls == 0) {
+      connection(lane).write(std::move(frame));
+      return;
+    }
+    std::lock_guard<std::mutex> l(lazyMutex);
+    queuedBytes += frame.size();
+    lazyQueue.push_back(QueuedCall{origin, requestId, lane, std::move(frame)});
+    queuedCalls = lazyQueue.size();
+    if (!lazy || queuedBytes >= lazyOptions.maxQueuedBytes) {
+      FlushLocked();
+      return;
+    }
+    if (lazyQueue.size() == 1) oldestQueued = std::chrono::steady_clock::now();
+    if (!timerArmed) ArmFlushTimer(lazyOptions.maxDelay);
+  }
+  void Flush() {
+    if (openBatches != 0) {
+      std::lock_guard<std::mutex> l(batchMutex);
+      for (Batch* batch : batches) batch->flush();
+    }
+    if (queuedCalls == 0) return;
+    std::lock_guard<std::mutex> l(lazyMutex);
+    FlushLocked();
+  }
+  // Calls the limiter held back that have room now. Calls queued in lazy mode came first, and may be
+  // referenced by these, so they go out before them.
+  void SendQueued(std::vector<CallLimiter::QueuedCall> calls) {
+    std::lock_guard<std::mutex> l(lazyMutex);
+    FlushLocked();
+    for (auto& call : calls) {
+      lanes_[call.lane]->inFlight.fetch_add(1, std::memory_order_relaxed);
+      connection(call.lane).write(std::move(call.frame));
+    }
+  }
+  // The future of a call was dropped unused. In lazy mode a call that has not gone out yet never
+  // does; otherwise it is still sent, as a call may be made for its effect alone. Returns whether
+  // it was dropped.
+  bool Abandon(const CallOrigin* origin, size_t requestId) {
+    return lazy && Drop(origin, requestId);
+  }
+  // Removes a call from the lazy queue or the limiter's queue. Returns false if it is not queued (any more).
+  bool Drop(const CallOrigin* origin, size_t requestId) {
+    if (limiter_->drop(origin, requestId)) return true;
+    if (queuedCalls == 0) return false;
+    std::lock_guard<std::mutex> l(lazyMutex);
+    for (auto it = lazyQueue.begin(); it != lazyQueue.end(); ++it) {
+      if (it->origin == origin && it->requestId == requestId) {
+        lanes_[it->lane]->inFlight.fetch_sub(1, std::memory_order_relaxed);
+        queuedBytes -= it->frame.size();
+        lazyQueue.erase(it);
+        queuedCalls = lazyQueue.size();
+        return true;
+      }
+    }
+    return false;
+  }
+  // Starts the deadline of a call that was just sent, if it has one. Calls are kept in order of their
+  // deadline, with one timer for the earliest; a call that completes in time stays in there until its
+  // deadline, when expiring it finds nothing to do.
+  void WatchDeadline(CallOrigin* origin, size_t requestId, size_t lane) {
+    std::chrono::steady_clock::time_point at;
+    if (Deadline* deadline = Deadline::find(this)) {
+      at = deadline->at_;
+    } else {
+      auto timeout = defaultTimeout.load(std::memory_order_relaxed);
+      if (timeout == 0) return;
+      at = std::chrono::steady_clock::now() + std::chrono::steady_clock::duration(timeout);
+    }
+    std::lock_guard<std::mutex> l(deadlineMutex);
+    bool earliest = deadlines.empty() || at < deadlines.begin()->first;
+    deadlines.emplace(at, ExpiringCall{origin, requestId, lane});
+    if (earliest) ArmDeadlineTimer(at);
+  }
+  void ArmDeadlineTimer(std::chrono::steady_clock::time_point at) {
+    deadlineTimer.expires_at(at);
+    std::shared_ptr<Lifetime> lifetime = lifetime_;
+    deadlineTimer.async_wait([this, lifetime](const boost::system::error_code& error){
+      if (error == boost::asio::error::operation_aborted) return;
+      std::lock_guard<std::mutex> alive(lifetime->m);
+      if (!lifetime->alive) return;
+      Connection::HandlerScope scope;
+      std::vector<ExpiringCall> due;
+      {
+        std::lock_guard<std::mutex> l(deadlineMutex);
+        auto now = std::chrono::steady_clock::now();
+        while (!deadlines.empty() && deadlines.begin()->first <= now) {
+          due.push_back(deadlines.begin()->second);
+          deadlines.erase(deadlines.begin());
+        }
+        if (!deadlines.empty()) ArmDeadlineTimer(deadlines.begin()->first);
+      }
+      for (auto& call : due) Expire(call);
+    });
+  }
+  struct ExpiringCall {
+    CallOrigin* origin;
+    size_t requestId;
+    size_t lane;
+  };
+  // The cancel goes out before the call fails, so once the caller sees the failure, a later call on
+  // the same connection reaches the host after it.
+  void Expire(const ExpiringCall& call) {
+    if (call.origin->lane(call.requestId) == CallOrigin::noLane) return;
+    const size_t interfaceId = call.origin->remoteInterfaceId();
+    if (!Drop(call.origin, call.requestId) && interfaceId != RemoteInterface::npos) {
+      Serializer s(framePool(call.lane).acquire(), 0);
+      serializer<size_t>::write(s, controlChannel);
+      serializer<size_t>::write(s, CancelCall);
+      serializer<size_t>::write(s, interfaceId);
+      serializer<size_t>::write(s, call.requestId);
+      connection(call.lane).write(s.release());
+    }
+    call.origin->expire(call.requestId);
+  }
+  // Handles a frame that arrived on the given lane. decompressed is set for the frames of a
+  // Compressed frame, which may not hold another one.
+  void Handle(Deserializer& d, size_t lane, bool decompressed = false) {
+    size_t channel = serializer<size_t>::read(d);
+    if (channel == controlChannel) {
+      HandleControl(d, lane, decompressed);
+      return;
+    }
+    lanes_[lane]->inFlight.fetch_sub(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> l(m);
+    if (channel <= byRemoteId.size() && byRemoteId[channel - 1]) {
+      byRemoteId[channel - 1]->Handle(d, lane);
+    }
+  }
+  // Stream chunks can complete a reader's continuation, so only announcements are handled under m.
+  void HandleControl(Deserializer& d, size_t lane, bool decompressed) {
+    size_t op = serializer<size_t>::read(d);
+    switch (op) {
+    case AnnounceInterface:
+      HandleAnnounce(d);
+      break;
+    case StreamChunk:
+    case StreamEnd:
+    case StreamCredit:
+      streams(lane).Handle(op, d);
+      break;
+    case AcceptCompression:
+      connection(lane).peerAccepts(serializer<size_t>::read(d));
+      break;
+    case CallFailed: {
+      lanes_[lane]->inFlight.fetch_sub(1, std::memory_order_relaxed);
+      size_t interfaceId = serializer<size_t>::read(d);
+      std::lock_guard<std::mutex> l(m);
+      if (interfaceId < byRemoteId.size() && byRemoteId[interfaceId]) {
+        byRemoteId[interfaceId]->HandleFailure(d);
+      }
+      break;
+    }
+    case CallByNameFailed: {
+      lanes_[lane]->inFlight.fetch_sub(1, std::memory_order_relaxed);
+      std::string name = serializer<std::string>::read(d);
+      std::lock_guard<std::mutex> l(m);
+      for (auto& proxy : proxies) {
+        if (proxy->getInterfaceName() == name) {
+          proxy->HandleFailure(d);
+          break;
+        }
+      }
+      break;
+    }
+    case Compressed: {
+      if (decompressed) throw std::runtime_error("Nested compressed frame");
+      Deserializer inner;
+      readCompressed(d, inner, connection(lane).frameSizeLimit());
+      while (inner.HasFullPacket()) {
+        Handle(inner, lane, true);
+        inner.RemovePacket();
+      }
+      break;
+    }
+    }
+  }
+  void HandleAnnounce(Deserializer& d) {
     std::lock_guard<std::mutex> l(m);
-    std::string ifId = serializer<std::string>::read(des);
-    for (auto& iface : proxies) {
-      if (iface->getInterfaceName() == ifId) {
-        iface->Handle(des);
-        return;
+    std::string name = serializer<std::string>::read(d);
+    size_t id = serializer<size_t>::read(d);
+    std::vector<std::string> methods(serializer<size_t>::read(d));
+    for (auto& method : methods) {
+      method = serializer<std::string>::read(d);
+    }
+    auto& remote = remoteInterfaces[name];
+    if (remote) return;
+    remote.reset(new RemoteInterface(name, id, std::move(methods)));
+    for (auto& proxy : proxies) {
+      if (proxy->getInterfaceName() == name) {
+        Bind(proxy, remote.get());
       }
     }
   }
+  void Bind(InterfaceProxy* proxy, const RemoteInterface* remote) {
+    proxy->Bind(remote);
+    if (byRemoteId.size() <= remote->id) byRemoteId.resize(remote->id + 1);
+    if (!byRemoteId[remote->id]) byRemoteId[remote->id] = proxy;
+  }
+  // A closed connection takes no more calls, so it counts as the busiest.
+  size_t load(size_t lane) const {
+    if (lanes_[lane]->closed.load(std::memory_order_relaxed)) return size_t(-1);
+    return lanes_[lane]->inFlight.load(std::memory_order_relaxed);
+  }
+  // Called on the lane's strand once its connection has closed. Fails the calls outstanding on it
+  // and the streams it carried; once every lane has closed, calls that wait for room go through.
+  void LaneClosed(size_t lane) {
+    lanes_[lane]->closed.store(true, std::memory_order_relaxed);
+    // Pairs with disconnected(): a call either sees the lane closed or is failed below.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    limiter_->dropLane(lane);
+    lanes_[lane]->streams->disconnect();
+    std::vector<InterfaceProxy*> current;
+    {
+      std::lock_guard<std::mutex> l(m);
+      current = proxies;
+    }
+    for (auto& proxy : current) {
+      proxy->failLane(lane);
+    }
+    if (++closedLanes == lanes_.size()) limiter_->close();
+  }
+  // The connections are written under lazyMutex, so flushes from different threads cannot reorder calls.
+  void FlushLocked() {
+    if (lazyQueue.empty()) return;
+    std::vector<std::vector<Frame>> frames(lanes_.size());
+    for (auto& call : lazyQueue) {
+      frames[call.lane].push_back(std::move(call.frame));
+    }
+    lazyQueue.clear();
+    queuedBytes = 0;
+    queuedCalls = 0;
+    for (size_t lane = 0; lane < frames.size(); ++lane) {
+      if (!frames[lane].empty()) connection(lane).write(std::move(frames[lane]));
+    }
+  }
+  void ArmFlushTimer(std::chrono::steady_clock::duration delay) {
+    timerArmed = true;
+    flushTimer.expires_after(delay);
+    std::shared_ptr<Lifetime> lifetime = lifetime_;
+    flushTimer.async_wait([this, lifetime](const boost::system::error_code& error){
+      if (error == boost::asio::error::operation_aborted) return;
+      std::lock_guard<std::mutex> alive(lifetime->m);
+      if (!lifetime->alive) return;
+      Connection::HandlerScope scope;
+      std::lock_guard<std::mutex> l(lazyMutex);
+      timerArmed = false;
+      if (lazyQueue.empty()) return;
+      auto due = oldestQueued + lazyOptions.maxDelay;
+      auto now = std::chrono::steady_clock::now();
+      if (now >= due) {
+        FlushLocked();
+      } else {
+        ArmFlushTimer(due - now);
+      }
+    });
+  }
+  struct QueuedCall {
+    const CallOrigin* origin;
+    size_t requestId;
+    size_t lane;
+    Frame frame;
+  };
+  // One of the client's connections to the host.
+  struct Lane {
+    Deserializer des;
+    std::shared_ptr<Connection> connection;
+    std::shared_ptr<StreamTable> streams;
+    // Calls sent on it that have not been answered yet.
+    std::atomic<size_t> inFlight{0};
+    std::atomic<bool> closed{false};
+  };
+  static std::vector<std::unique_ptr<Transport>> only(std::unique_ptr<Transport> transport) {
+    std::vector<std::unique_ptr<Transport>> transports;
+    transports.push_back(std::move(transport));
+    return transports;
+  }
   std::mutex m;
+  Executor* executor = nullptr;
   std::vector<InterfaceProxy*> proxies;
-  std::shared_ptr<Connection> connection_;
-  Deserializer des;
+  std::map<std::string, std::unique_ptr<RemoteInterface>> remoteInterfaces;
+  // Replies are routed by the channel they arrive on, which is the host's interface id + 1.
+  std::vector<InterfaceProxy*> byRemoteId;
+  // The name of the host's endpoint, for finding it in LocalHosts.
+  const std::string peer_;
+  std::atomic<bool> shortCircuit{false};
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::atomic<size_t> nextLane{0};
+  std::atomic<size_t> closedLanes{0};
+  // The open batches of every thread; taken before a batch's own mutex.
+  std::mutex batchMutex;
+  std::vector<Batch*> batches;
+  std::atomic<size_t> openBatches{0};
+  std::mutex lazyMutex;
+  LazyOptions lazyOptions;
+  std::atomic<bool> lazy{false};
+  std::deque<QueuedCall> lazyQueue;
+  // Mirrors lazyQueue.size(), so eager clients can skip lazyMutex.
+  std::atomic<size_t> queuedCalls{0};
+  size_t queuedBytes = 0;
+  std::chrono::steady_clock::time_point oldestQueued;
+  bool timerArmed = false;
+  // Shared with the timer handlers, which may still run once the client is gone. The destructor
+  // marks it dead under its mutex, so a handler either finishes first or returns without touching
+  // the client.
+  struct Lifetime {
+    std::mutex m;
+    bool alive = true;
+  };
+  std::shared_ptr<Lifetime> lifetime_ = std::make_shared<Lifetime>();
+  boost::asio::steady_timer flushTimer;
+  std::atomic<std::chrono::steady_clock::rep> defaultTimeout{0};
+  std::mutex deadlineMutex;
+  std::multimap<std::chrono::steady_clock::time_point, ExpiringCall> deadlines;
+  boost::asio::steady_timer deadlineTimer;
+  std::shared_ptr<CallLimiter> limiter_;
+  std::atomic<size_t> requestCapacity_{RequestTable::defaultCapacity};
 };
 
 }
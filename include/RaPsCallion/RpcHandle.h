@@ -1,23 +1,88 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include "FramePool.h"
 #include "Serializer.h"
+#include "Transport.h"
+#include "future.h"
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
 
 namespace Rapscallion {
 
 class RpcHost;
 class Connection;
-class InterfaceDispatcher;
+class StreamTable;
+struct InterfaceDispatcher;
 
 struct RpcHandle {
-  RpcHandle(RpcHost& host, boost::asio::ip::tcp::socket sock);
-  void SendInterface(std::unique_ptr<InterfaceDispatcher>& iface);
-  void Send(Serializer& s);
-  std::shared_ptr<Connection> conn;
+  RpcHandle(RpcHost& host, std::unique_ptr<Transport> transport);
+  // Starts reading requests.
+  void start();
+  // Interfaces are announced in id order.
+  void SendInterface(InterfaceDispatcher& iface);
+  void Send(Serializer&& s);
+  // Answers a call with CallFailed, or with CallByNameFailed when the interface is not known by id.
+  void SendFailure(size_t interfaceId, size_t requestId, const std::string& message);
+  void SendFailure(const std::string& interfaceName, size_t requestId, const std::string& message);
+  FramePool& framePool();
+  // Remembers the result of a dispatched call, so later calls on this connection can take it as an
+  // argument. Only the last pipelineWindow calls are remembered. Must be called from the read handler.
+  template <typename R>
+  void Retain(size_t interfaceId, size_t requestId, const boost::shared_future<R>& result) {
+    if (retained.empty()) return;
+    RetainedResult& entry = retained[nextRetained++ % retained.size()];
+    entry.interfaceId = interfaceId;
+    entry.requestId = requestId;
+    entry.type = &typeid(R);
+    entry.result = std::make_shared<boost::shared_future<R>>(result);
+  }
+  template <typename R>
+  boost::shared_future<R> Pipelined(size_t interfaceId, size_t requestId) {
+    for (auto& entry : retained) {
+      if (entry.result && entry.interfaceId == interfaceId && entry.requestId == requestId) {
+        if (*entry.type != typeid(R)) {
+          return boost::make_exceptional_future<R>(std::runtime_error("Pipelined result has a different type")).share();
+        }
+        return *static_cast<boost::shared_future<R>*>(entry.result.get());
+      }
+    }
+    return boost::make_exceptional_future<R>(std::runtime_error("Pipelined result is no longer available")).share();
+  }
+  // A call that waits for pipelined arguments or for its executor can still be cancelled. Start()
+  // returns false if it was, and the call must then not run. A Cancel for a call that is not waiting,
+  // because it already ran or never arrived, is ignored.
+  void Waiting(size_t interfaceId, size_t requestId);
+  bool Start(size_t interfaceId, size_t requestId);
+  void Cancel(size_t interfaceId, size_t requestId);
   Deserializer des;
+  std::shared_ptr<Connection> conn;
+  std::shared_ptr<StreamTable> streams;
+  // The host's interface table as of the last request; see RpcHost::interfacesFor.
+  std::shared_ptr<const std::vector<InterfaceDispatcher*>> interfaces;
+  size_t interfaceCount = size_t(-1);
+  // The number of interfaces announced on this connection so far.
+  std::atomic<size_t> announced{0};
+private:
+  struct RetainedResult {
+    size_t interfaceId = 0;
+    size_t requestId = 0;
+    const std::type_info* type = nullptr;
+    std::shared_ptr<void> result;
+  };
+  std::vector<RetainedResult> retained;
+  size_t nextRetained = 0;
+  // (interface id, request id) of the waiting calls, and whether each was cancelled. Calls start on
+  // executor threads, so this has a lock of its own.
+  std::mutex waitingMutex;
+  std::map<std::pair<size_t, size_t>, bool> waiting;
 };
 
 }
 
-
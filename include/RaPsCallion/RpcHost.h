@@ -2,54 +2,239 @@
 
 #include <boost/asio.hpp>
 #include <boost/make_unique.hpp>
+#include <atomic>
 #include <mutex>
+#include <thread>
 #include <vector>
 #include <memory>
+#include "LocalHosts.h"
 #include "Server.h"
+#include "SharedMemory.h"
 #include "InterfaceDispatcher.h"
+#include "Metrics.h"
+#include "Protocol.h"
+#include "StreamTable.h"
 
 namespace Rapscallion {
 
 struct InterfaceDispatcher;
 struct RpcHandle;
 
+// Indexed by interface id. Interfaces are only ever added, so a table is never modified once published.
+typedef std::vector<InterfaceDispatcher*> InterfaceTable;
+
+// The io_service may be run by any number of threads. Each connection's reads and writes go through
+// its own strand, so requests on one connection are dispatched in order while different connections
+// are served in parallel.
 struct RpcHost {
-  RpcHost(boost::asio::io_service &io_service, uint16_t port)
-  : server(io_service, port, [this](boost::asio::ip::tcp::socket s){ addSocket(std::move(s)); })
+  // A host that only serves the connections given to addTransport() until listen() is called.
+  explicit RpcHost(boost::asio::io_service &io_service)
+  : io_service_(io_service)
   {}
-  void addSocket(boost::asio::ip::tcp::socket socket) {
+  // Listens for TCP connections on port, on every IPv4 address; 0 picks a free port.
+  RpcHost(boost::asio::io_service &io_service, uint16_t port)
+  : RpcHost(io_service)
+  {
+    listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+  }
+  // Joins the threads started by run(), which return once the io_service is stopped.
+  ~RpcHost() {
+    LocalHosts::remove(this);
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  // Runs the io_service on this many additional threads.
+  void run(size_t threadCount) {
+    for (size_t n = 0; n < threadCount; ++n) {
+      threads.emplace_back([this]{ io_service_.run(); });
+    }
+  }
+  // Accepts connections on another endpoint as well.
+  void listen(const boost::asio::ip::tcp::endpoint& endpoint) {
+    auto server = boost::make_unique<Server>(io_service_, endpoint, [this](std::unique_ptr<Transport> t){ addTransport(std::move(t)); });
+    LocalHosts::add(localName(server->acceptor_.local_endpoint()), this);
+    listeners.emplace_back(std::move(server));
+  }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  // Unix domain sockets skip the TCP stack, which makes calls between processes on one machine cheaper.
+  void listen(const boost::asio::local::stream_protocol::endpoint& endpoint) {
+    listeners.emplace_back(boost::make_unique<LocalServer>(io_service_, endpoint, [this](std::unique_ptr<Transport> t){ addTransport(std::move(t)); }));
+    LocalHosts::add(localName(endpoint), this);
+  }
+#endif
+#if defined(__linux__)
+  // Accepts connections from connectShared() on a Unix domain socket path; see SharedMemoryOptions.
+  void listenShared(const std::string& path, const SharedMemoryOptions& options = SharedMemoryOptions()) {
+    listeners.emplace_back(boost::make_unique<SharedMemoryServer>(io_service_, path, options, [this](std::unique_ptr<Transport> t){ addTransport(std::move(t)); }));
+    LocalHosts::add(localName(boost::asio::local::stream_protocol::endpoint(path)), this);
+  }
+#endif
+  // The port of the first TCP endpoint listened on, or 0 if there is none.
+  uint16_t port() const {
+    for (auto& listener : listeners) {
+      if (auto server = dynamic_cast<const Server*>(listener.get())) return server->acceptor_.local_endpoint().port();
+    }
+    return 0;
+  }
+  // Serves a connection that was set up elsewhere.
+  void addTransport(std::unique_ptr<Transport> transport) {
     std::lock_guard<std::mutex> l(m);
-    std::shared_ptr<RpcHandle> handle = std::make_shared<RpcHandle>(*this, std::move(socket));
+    std::shared_ptr<RpcHandle> handle = std::make_shared<RpcHandle>(*this, std::move(transport));
     handles.push_back(handle);
+    handle->conn->setCompression(compression);
+    handle->conn->setMaxFrameSize(maxFrameSize);
+    handle->conn->acceptCompression();
     for (auto& interface : interfaces) {
-      handle->SendInterface(interface);
+      handle->SendInterface(*interface);
     }
+    // Only start reading now, so no reply can overtake the announcements.
+    handle->start();
   }
+  // Handlers for the interface run on executor, or inline on the IO thread when it is null; a slow
+  // handler then holds up every later request on the same connection.
   template <typename T>
-  void Register(T* handler) {
+  void Register(T* handler, Executor* executor = nullptr) {
     std::lock_guard<std::mutex> l(m);
     interfaces.emplace_back(boost::make_unique<typename T::Dispatcher>(handler));
+    interfaces.back()->interfaceId = interfaces.size() - 1;
+    interfaces.back()->executor = executor;
+    std::shared_ptr<InterfaceTable> next = std::make_shared<InterfaceTable>();
+    for (auto& interface : interfaces) {
+      next->push_back(interface.get());
+    }
+    std::atomic_store(&table, std::shared_ptr<const InterfaceTable>(std::move(next)));
+    interfaceCount.store(interfaces.size(), std::memory_order_release);
+    for (auto& handle : handles) {
+      handle->SendInterface(*interfaces.back());
+    }
+  }
+  // The implementation registered for the interface type, if it runs inline; calls to one with an
+  // executor must go through the dispatcher so they run there.
+  void* local(const std::type_info& type) {
+    std::lock_guard<std::mutex> l(m);
+    for (auto& interface : interfaces) {
+      if (interface->executor) continue;
+      if (void* implementation = interface->implementation(type)) return implementation;
+    }
+    return nullptr;
+  }
+  // Applies to every connection, including those already accepted.
+  void setCompression(const CompressionOptions& options) {
+    std::lock_guard<std::mutex> l(m);
+    compression = options;
     for (auto& handle : handles) {
-      handle->SendInterface(interfaces.back());
+      handle->conn->setCompression(options);
     }
   }
-  void Handle(Deserializer& deserializer, RpcHandle& handle) {
+  // A client that sends a frame with a longer payload is disconnected. Applies to every connection,
+  // including those already accepted.
+  void setMaxFrameSize(size_t bytes) {
     std::lock_guard<std::mutex> l(m);
+    maxFrameSize = bytes;
+    for (auto& handle : handles) {
+      handle->conn->setMaxFrameSize(bytes);
+    }
+  }
+  // Called on the connection's strand. Does not take the host-wide mutex. decompressed is set for
+  // the frames of a Compressed frame, which may not hold another one.
+  void Handle(Deserializer& deserializer, RpcHandle& handle, bool decompressed = false) {
+    const InterfaceTable& current = interfacesFor(handle);
+    size_t channel = serializer<size_t>::read(deserializer);
+    if (channel == controlChannel) {
+      HandleControl(deserializer, handle, current, decompressed);
+    } else if (channel <= current.size()) {
+      size_t methodId = serializer<size_t>::read(deserializer);
+      current[channel - 1]->Handle(methodId, deserializer, handle);
+    } else {
+      serializer<size_t>::read(deserializer);
+      handle.SendFailure(channel - 1, serializer<size_t>::read(deserializer), "No such interface");
+    }
+  }
+  // Each connection keeps the table it last saw, and only fetches a new one after a registration.
+  const InterfaceTable& interfacesFor(RpcHandle& handle) {
+    if (handle.interfaceCount != interfaceCount.load(std::memory_order_acquire)) {
+      handle.interfaces = std::atomic_load(&table);
+      handle.interfaceCount = handle.interfaces->size();
+    }
+    return *handle.interfaces;
+  }
+  void HandleControl(Deserializer& deserializer, RpcHandle& handle, const InterfaceTable& current, bool decompressed) {
+    size_t op = serializer<size_t>::read(deserializer);
+    switch (op) {
+    case CallByName:
+      HandleCallByName(deserializer, handle, current);
+      break;
+    case StreamChunk:
+    case StreamEnd:
+    case StreamCredit:
+      handle.streams->Handle(op, deserializer);
+      break;
+    case AcceptCompression:
+      handle.conn->peerAccepts(serializer<size_t>::read(deserializer));
+      break;
+    case CancelCall: {
+      size_t interfaceId = serializer<size_t>::read(deserializer);
+      handle.Cancel(interfaceId, serializer<size_t>::read(deserializer));
+      break;
+    }
+    case Compressed: {
+      if (decompressed) throw std::runtime_error("Nested compressed frame");
+      Deserializer inner;
+      readCompressed(deserializer, inner, handle.conn->frameSizeLimit());
+      while (inner.HasFullPacket()) {
+        Handle(inner, handle, true);
+        inner.RemovePacket();
+      }
+      break;
+    }
+    }
+  }
+  void HandleCallByName(Deserializer& deserializer, RpcHandle& handle, const InterfaceTable& current) {
     std::string ifId = serializer<std::string>::read(deserializer);
-    for (auto& iface : interfaces) {
+    std::string method = serializer<std::string>::read(deserializer);
+    for (auto& iface : current) {
       if (iface->getInterfaceName() == ifId) {
-        iface->Handle(deserializer, handle);
+        // An interface registered just now may not be announced on this connection yet. Replies are
+        // sent on its id, so the client must learn it first; a second announcement is ignored.
+        if (iface->interfaceId >= handle.announced) handle.SendInterface(*iface);
+        size_t methodId = iface->getMethodId(method);
+        if (methodId == InterfaceDispatcher::npos) {
+          handle.SendFailure(iface->interfaceId, serializer<size_t>::read(deserializer), "No such method");
+        } else {
+          iface->Handle(methodId, deserializer, handle);
+        }
         return;
       }
     }
-    // LOG error somehow. 
+    handle.SendFailure(ifId, serializer<size_t>::read(deserializer), "No such interface");
   }
+  // The statistics of every interface method called on this host, summed over all connections.
+  MetricsSnapshot metrics() {
+    std::lock_guard<std::mutex> l(m);
+    MetricsSnapshot snapshot;
+    for (auto& interface : interfaces) {
+      interface->collectMetrics(snapshot);
+    }
+    return snapshot;
+  }
+  // Registers the built-in RpcMetrics interface, which returns metrics() to remote callers.
+  void serveMetrics();
+  // How many recent call results each new connection keeps for promise pipelining; 0 disables it.
+  size_t pipelineWindow = 64;
+  CompressionOptions compression;
+  size_t maxFrameSize = Deserializer::defaultMaxFrameSize;
+  boost::asio::io_service& io_service_;
+  // Guards interfaces and handles; only taken when a connection or interface is added.
   std::mutex m;
+  std::unique_ptr<RpcMetrics> metricsService;
   std::vector<std::unique_ptr<InterfaceDispatcher>> interfaces;
   std::vector<std::shared_ptr<RpcHandle>> handles;
-  Server server;
+  std::shared_ptr<const InterfaceTable> table = std::make_shared<InterfaceTable>();
+  std::atomic<size_t> interfaceCount{0};
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<Listener>> listeners;
 };
 
 }
 
-
@@ -5,11 +5,21 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <cstring>
+#include <stdexcept>
 
 namespace Rapscallion {
 
+// A finished, length-prefixed frame that owns its bytes.
+struct Frame {
+  std::vector<uint8_t> buffer;
+  size_t offset = 0;
+  const uint8_t *data() const { return buffer.data() + offset; }
+  size_t size() const { return buffer.size() - offset; }
+};
+
 class Serializer {
 private:
   mutable std::vector<uint8_t> buffer;
@@ -18,9 +28,34 @@ public:
   Serializer() {
     buffer.resize(8);
   }
+  // Allocates room for a payload of this many bytes up front.
+  explicit Serializer(size_t payloadSize) {
+    buffer.reserve(8 + payloadSize);
+    buffer.resize(8);
+  }
+  // Writes into storage, reusing its capacity, e.g. a buffer from a FramePool.
+  Serializer(std::vector<uint8_t>&& storage, size_t payloadSize)
+  : buffer(std::move(storage))
+  {
+    buffer.clear();
+    buffer.reserve(8 + payloadSize);
+    buffer.resize(8);
+  }
   void addByte(uint8_t b) { buffer.push_back(b); }
+  void addBytes(const void* bytes, size_t count) {
+    const uint8_t* first = static_cast<const uint8_t*>(bytes);
+    buffer.insert(buffer.end(), first, first + count);
+  }
   uint8_t *data() const { finalize(); return buffer.data() + offs; }
   size_t size() const { finalize(); return buffer.size() - offs; }
+  // Moves the finalized frame out; the Serializer must not be used afterwards.
+  Frame release() {
+    finalize();
+    Frame frame;
+    frame.buffer = std::move(buffer);
+    frame.offset = offs;
+    return frame;
+  }
 private:
   void finalize() const {
     if (offs != 9) return;
@@ -36,47 +71,137 @@ private:
   }
 };
 
+// Thrown for received bytes that cannot be the start of a frame. Nothing after them can be parsed,
+// so the connection they arrived on is closed.
+struct FrameError : std::runtime_error {
+  explicit FrameError(const char* what) : std::runtime_error(what) {}
+};
+
+// Received bytes are kept in one linear buffer and frames are parsed where they lie. Consumed frames
+// only advance `start`; the unparsed tail is moved to the front at most once per read, in prepare().
+// A frame can be pinned to keep the bytes borrowed from it valid after it is removed; until the pin
+// is dropped, prepare() moves the tail to fresh memory instead of overwriting them.
 class Deserializer {
 public:
+  static constexpr size_t minReadSize = 16384;
+  static constexpr size_t defaultMaxFrameSize = 64 * 1024 * 1024;
+  // Serializer writes a length prefix of at most this many bytes.
+  static constexpr size_t maxPrefixSize = 8;
   Deserializer() {}
-  Deserializer(const Serializer& s)
-    : buffer(s.data(), s.data() + s.size())
-  {
+  Deserializer(const Serializer& s) {
+    allocate(s.size());
+    memcpy(data_, s.data(), s.size());
+    end = s.size();
     HasFullPacket();
   }
   size_t getByte() {
     if (offs == size) throw std::runtime_error("Exceeded packet size");
-    return buffer[offs++];
+    return data_[offs++];
   }
   uint8_t *getByteRange(size_t byteCount) {
-    if (offs + byteCount > size) throw std::runtime_error("Exceeded packet size");
+    if (byteCount > size - offs) throw std::runtime_error("Exceeded packet size");
     size_t oldOffs = offs;
     offs += byteCount;
-    return buffer.data() + oldOffs;
+    return data_ + oldOffs;
+  }
+  // The received bytes that have not been removed yet.
+  const uint8_t* unread() const { return data_ + start; }
+  size_t unreadSize() const { return end - start; }
+  // Keeps the bytes of the current frame, and of the frames before it, valid for as long as the
+  // returned handle lives.
+  std::shared_ptr<const void> pin() {
+    pinnedEnd = std::max(pinnedEnd, size);
+    return storage;
+  }
+  // Returns space for the next read directly behind the received data. The space is at least
+  // `minimum` bytes, and large enough for the rest of a partially received frame.
+  uint8_t *prepare(size_t minimum = minReadSize) {
+    size_t wanted = minimum;
+    if (needed > end + wanted) wanted = needed - end;
+    const bool pinned = storage.use_count() > 1;
+    if (!pinned) pinnedEnd = 0;
+    // Reading behind pinned bytes is fine, but reading over them is not.
+    if (capacity_ - end < wanted || end < pinnedEnd) {
+      const size_t live = end - start;
+      if (!pinned && capacity_ - live >= wanted) {
+        memmove(data_, data_ + start, live);
+        end = live;
+        needed -= std::min(needed, start);
+        start = 0;
+      } else {
+        allocate(capacity_ - live >= wanted ? capacity_ : std::max(capacity_ * 2, live + wanted));
+      }
+    }
+    return data_ + end;
+  }
+  size_t capacity() const { return capacity_ - end; }
+  void commit(size_t addedSize) {
+    end += addedSize;
   }
   void AddBytes(const uint8_t *bytes, size_t addedSize) {
-    buffer.insert(buffer.end(), bytes, bytes + addedSize);
+    while (addedSize > 0) {
+      uint8_t *space = prepare();
+      size_t chunk = std::min(addedSize, capacity());
+      memcpy(space, bytes, chunk);
+      commit(chunk);
+      bytes += chunk;
+      addedSize -= chunk;
+    }
   }
+  // HasFullPacket throws FrameError for a frame with a longer payload, before prepare() makes room
+  // for it.
+  void setMaxFrameSize(size_t bytes) { maxFrameSize = bytes; }
   bool HasFullPacket() {
-    offs = 0; size = 0;
-    while (offs < buffer.size()) {
-      size = (size << 7) | (buffer[offs] & 0x7F);
-      if ((buffer[offs] & 0x80) == 0) {
+    offs = start; size = 0;
+    while (offs < end) {
+      if (offs - start == maxPrefixSize) throw FrameError("Frame length prefix too long");
+      size = (size << 7) | (data_[offs] & 0x7F);
+      if ((data_[offs] & 0x80) == 0) {
         offs++;
+        if (size > maxFrameSize) throw FrameError("Frame too large");
         size += offs;
-        return (buffer.size() + offs >= size);
+        needed = size;
+        return (end >= size);
       }
       offs++;
     }
     return false;
   }
+  // The size of the frame found by the last HasFullPacket, including its length prefix.
+  size_t packetSize() const { return size - start; }
   void RemovePacket() {
-    memmove(buffer.data(), buffer.data() + size, buffer.size() - size);
-    buffer.resize(buffer.size() - size);
+    start = size;
+    if (start == end) {
+      start = end = needed = 0;
+    }
   }
   size_t size = 0;
   size_t offs = 0;
-  std::vector<uint8_t> buffer;
+private:
+  // Moves the unparsed bytes to the front of new storage of the given capacity. Old storage that is
+  // pinned stays alive with its pins.
+  void allocate(size_t newCapacity) {
+    std::shared_ptr<uint8_t> fresh(new uint8_t[newCapacity], std::default_delete<uint8_t[]>());
+    if (end > start) memcpy(fresh.get(), data_ + start, end - start);
+    end -= start;
+    needed -= std::min(needed, start);
+    size -= std::min(size, start);
+    offs -= std::min(offs, start);
+    start = 0;
+    storage = std::move(fresh);
+    data_ = storage.get();
+    capacity_ = newCapacity;
+    pinnedEnd = 0;
+  }
+  std::shared_ptr<uint8_t> storage;
+  uint8_t* data_ = nullptr;
+  size_t capacity_ = 0;
+  size_t start = 0;
+  size_t end = 0;
+  size_t needed = 0;
+  size_t maxFrameSize = defaultMaxFrameSize;
+  // The end of the pinned bytes, while the storage is pinned.
+  size_t pinnedEnd = 0;
 };
 
 #define DECLARE_READER_WRITER(type) \
@@ -120,23 +245,50 @@ struct serializer<optional<T> > {
   }
 };
 
+// Vectors of types with a packed encoding are sent as their element count followed by the raw bytes
+// of the elements, instead of element by element. This holds for byte-like types; specialize it for
+// other trivially copyable types whose in-memory layout is the same on both ends of the connection.
+template <typename T>
+struct packed_encoding : std::false_type {};
+template <> struct packed_encoding<char> : std::true_type {};
+template <> struct packed_encoding<signed char> : std::true_type {};
+template <> struct packed_encoding<unsigned char> : std::true_type {};
+
 template <typename T>
 struct serializer<std::vector<T> > {
   static void write(Serializer& s, const std::vector<T>& value) {
     serializer<std::uint_least64_t>::write(s, value.size());
+    write(s, value, packed_encoding<T>());
+  }
+  static std::vector<T> read(Deserializer& s) {
+    const auto size = serializer<std::uint_least64_t>::read(s);
+    return read(s, size, packed_encoding<T>());
+  }
+private:
+  static void write(Serializer& s, const std::vector<T>& value, std::false_type) {
     for (const T &v : value) {
       serializer<T>::write(s, v);
     }
   }
-  static std::vector<T> read(Deserializer& s) {
+  static void write(Serializer& s, const std::vector<T>& value, std::true_type) {
+    static_assert(std::is_trivially_copyable<T>::value, "A packed encoding needs a trivially copyable type");
+    s.addBytes(value.data(), value.size() * sizeof(T));
+  }
+  static std::vector<T> read(Deserializer& s, std::uint_least64_t size, std::false_type) {
     std::vector<T> t;
-    const auto size = serializer<std::uint_least64_t>::read(s);
     t.reserve(size);
     for (decltype(+size) n = 0; n < size; ++n) {
       t.push_back(serializer<T>::read(s));
     }
     return t;
   }
+  static std::vector<T> read(Deserializer& s, std::uint_least64_t size, std::true_type) {
+    if (size > s.size / sizeof(T)) throw std::runtime_error("Exceeded packet size");
+    const uint8_t* range = s.getByteRange(size * sizeof(T));
+    std::vector<T> t(size);
+    if (size) memcpy(t.data(), range, size * sizeof(T));
+    return t;
+  }
 };
 
 template <typename T>
@@ -157,5 +309,105 @@ struct serializer<std::shared_ptr<T>> {
   }
 };
 
+// An upper bound on the number of bytes serializer<T>::write produces for a value, so that a frame can
+// be allocated once before it is written. Types with a bound that does not depend on the value also
+// provide it as `fixed`. Types without a specialization report 0 and grow the frame as they are written.
+template <typename T>
+struct serialized_size {
+  static size_t of(const T&) { return 0; }
+};
+
+inline size_t varintSize(std::uint_least64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+template <>
+struct serialized_size<std::uint_least64_t> {
+  static size_t of(std::uint_least64_t value) { return varintSize(value); }
+};
+// Computed in unsigned arithmetic, so that LONG_MIN has one.
+inline std::uint_least64_t magnitudeOf(long value) {
+  return value < 0 ? 0 - static_cast<std::uint_least64_t>(value) : static_cast<std::uint_least64_t>(value);
+}
+
+template <>
+struct serialized_size<long> {
+  static size_t of(long value) { return varintSize((magnitudeOf(value) << 1) | 1); }
+};
+template <>
+struct serialized_size<int> {
+  static size_t of(int value) { return serialized_size<long>::of(value); }
+};
+template <>
+struct serialized_size<bool> {
+  static constexpr size_t fixed = 1;
+  static size_t of(bool) { return fixed; }
+};
+// See src/Serializer.cpp: the exponent, signed and offset, stays below 2^13 and takes at most 2
+// bytes; the fraction takes one byte per 7 of its significant bits.
+template <>
+struct serialized_size<double> {
+  // 53 significant bits.
+  static constexpr size_t fixed = 2 + 8;
+  static size_t of(double) { return fixed; }
+};
+template <>
+struct serialized_size<float> {
+  // 24 significant bits.
+  static constexpr size_t fixed = 2 + 4;
+  static size_t of(float) { return fixed; }
+};
+template <>
+struct serialized_size<std::string> {
+  static size_t of(const std::string& value) { return varintSize(value.size()) + value.size(); }
+};
+
+namespace detail {
+
+template <typename T>
+struct has_fixed_size {
+  template <typename U> static std::true_type test(decltype(&U::fixed));
+  template <typename U> static std::false_type test(...);
+  static constexpr bool value = decltype(test<serialized_size<T>>(nullptr))::value;
+};
+
+template <typename T>
+size_t elementsSize(const std::vector<T>& value, std::true_type /* packed */, bool) {
+  return value.size() * sizeof(T);
+}
+template <typename T>
+size_t elementsSize(const std::vector<T>& value, std::false_type, std::true_type /* fixed */) {
+  return value.size() * serialized_size<T>::fixed;
+}
+template <typename T>
+size_t elementsSize(const std::vector<T>& value, std::false_type, std::false_type) {
+  size_t size = 0;
+  for (const T& v : value) {
+    size += serialized_size<T>::of(v);
+  }
+  return size;
+}
+
 }
 
+template <typename T>
+struct serialized_size<std::vector<T>> {
+  static size_t of(const std::vector<T>& value) {
+    return varintSize(value.size()) + detail::elementsSize(value, packed_encoding<T>(), std::integral_constant<bool, detail::has_fixed_size<T>::value>());
+  }
+};
+template <typename T>
+struct serialized_size<optional<T>> {
+  static size_t of(const optional<T>& opt) { return 1 + (opt.value ? serialized_size<T>::of(*opt.value) : 0); }
+};
+template <typename T>
+struct serialized_size<std::shared_ptr<T>> {
+  static size_t of(const std::shared_ptr<T>& p) { return 1 + (p ? serialized_size<T>::of(*p) : 0); }
+};
+
+}
@@ -3,31 +3,44 @@
 #include <boost/asio.hpp>
 #include <functional>
 #include <cstdint>
+#include <memory>
+#include "Transport.h"
 
 namespace Rapscallion {
 
-struct Server {
-  boost::asio::ip::tcp::acceptor acceptor_;
-  std::function<void(boost::asio::ip::tcp::socket)> onConnect_;
+// Accepts connections on one endpoint, and hands each one over as a Transport.
+struct Listener {
+  virtual ~Listener() = default;
+};
+
+template <typename Protocol>
+struct BasicServer : Listener {
+  typename Protocol::acceptor acceptor_;
+  std::function<void(std::unique_ptr<Transport>)> onConnect_;
 
-  Server(boost::asio::io_service &io_service, uint16_t port, std::function<void(boost::asio::ip::tcp::socket)> onConnect)
-    : acceptor_(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
+  BasicServer(boost::asio::io_service &io_service, const typename Protocol::endpoint& endpoint, std::function<void(std::unique_ptr<Transport>)> onConnect)
+    : acceptor_(io_service, endpoint)
     , onConnect_(onConnect)
   {
     accept_one();
   }
 
   void accept_one() {
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket = std::make_shared<boost::asio::ip::tcp::socket>(acceptor_.get_io_service());
+    std::shared_ptr<typename Protocol::socket> socket = std::make_shared<typename Protocol::socket>(acceptor_.get_executor());
     acceptor_.async_accept(*socket.get(), [this, socket](const boost::system::error_code& ec) {
       if (!ec) {
-        onConnect_(std::move(*socket));
+        onConnect_(makeTransport(std::move(*socket)));
         accept_one();
       }
     });
   }
 };
 
-}
+typedef BasicServer<boost::asio::ip::tcp> Server;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Listens on a Unix domain socket path, which must not exist yet.
+typedef BasicServer<boost::asio::local::stream_protocol> LocalServer;
+#endif
 
+}
 
@@ -0,0 +1,46 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include "Server.h"
+#include "Transport.h"
+
+namespace Rapscallion {
+
+// A transport for peers on the same machine. Each direction is a single-producer single-consumer ring
+// in memory both processes map, so a message is copied in and out of the ring and never passes
+// through the kernel. A side that finds nothing to read, or no room to write, sleeps on an eventfd;
+// the other side only signals it when it is actually asleep. The memory and eventfds are handed over
+// on a Unix domain socket, which stays open so either side notices when the other one goes away.
+struct SharedMemoryOptions {
+  // The size of each ring; rounded up to a power of two. Chosen by the connecting side.
+  size_t ringBytes = 1 << 20;
+  // How long a read keeps looking at an empty ring before it sleeps. While the peer keeps the ring
+  // busy, a polling reader never sleeps or needs to be woken, at the price of keeping an IO thread busy.
+  std::chrono::microseconds poll{0};
+};
+
+// Connects to a host listening with RpcHost::listenShared, e.g. RpcClient client(connectShared(io, path)).
+std::unique_ptr<Transport> connectShared(boost::asio::io_service& io_service, const std::string& path, const SharedMemoryOptions& options = SharedMemoryOptions());
+
+// Accepts shared memory connections on a Unix domain socket path, which must not exist yet.
+class SharedMemoryServer : public Listener {
+public:
+  SharedMemoryServer(boost::asio::io_service& io_service, const std::string& path, const SharedMemoryOptions& options, std::function<void(std::unique_ptr<Transport>)> onConnect);
+private:
+  void accept_one();
+  void handshake(std::shared_ptr<boost::asio::local::stream_protocol::socket> socket);
+  boost::asio::local::stream_protocol::acceptor acceptor_;
+  SharedMemoryOptions options_;
+  std::function<void(std::unique_ptr<Transport>)> onConnect_;
+};
+
+}
+
+#endif
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "Arguments.h"
+#include "Connection.h"
+#include "Protocol.h"
+#include "Serializer.h"
+#include "future.h"
+#include "stream.h"
+
+namespace Rapscallion {
+
+// The streams one end of a connection sends and receives. A stream passed in a call or reply is sent
+// as an id; its chunks follow in StreamChunk frames and its end in a StreamEnd frame. The sender may
+// have `window` chunks outstanding, and gets credit for one more each time the receiver reads a chunk.
+class StreamTable : public std::enable_shared_from_this<StreamTable> {
+public:
+  static constexpr size_t window = stream<int>::defaultCapacity;
+  explicit StreamTable(std::weak_ptr<Connection> conn)
+  : conn_(std::move(conn))
+  {}
+  ~StreamTable() {
+    disconnect();
+  }
+
+  // Registers source to be sent and returns its id. Sending only starts at startPending(), which the
+  // caller runs once the frame carrying the id has been written, so no chunk can overtake it.
+  template <typename T>
+  size_t send(const stream<T>& source) {
+    std::lock_guard<std::mutex> l(m);
+    size_t id = nextId++;
+    auto out = std::make_shared<Outgoing<T>>(shared_from_this(), id, source);
+    outgoing[id] = out;
+    pending().push_back(out);
+    return id;
+  }
+  // Starts sending the streams this thread registered.
+  static void startPending() {
+    if (pending().empty()) return;
+    std::vector<std::shared_ptr<Sender>> started;
+    started.swap(pending());
+    for (auto& out : started) out->credit(window);
+  }
+  // Forgets the streams this thread registered, for a call that was not sent after all.
+  static void cancelPending() {
+    std::vector<std::shared_ptr<Sender>> cancelled;
+    cancelled.swap(pending());
+    for (auto& out : cancelled) out->cancel();
+  }
+  static bool hasPending() {
+    return !pending().empty();
+  }
+
+  // The stream the other side sends with this id.
+  template <typename T>
+  stream<T> receive(size_t id) {
+    stream<T> sink(window);
+    std::weak_ptr<StreamTable> self = shared_from_this();
+    sink.onConsumed([self, id]{
+      if (auto table = self.lock()) table->sendCredit(id, 1);
+    });
+    std::lock_guard<std::mutex> l(m);
+    incoming[id] = std::make_shared<Incoming<T>>(sink);
+    return sink;
+  }
+
+  // Handles a StreamChunk, StreamEnd or StreamCredit frame.
+  void Handle(size_t op, Deserializer& des) {
+    size_t id = serializer<size_t>::read(des);
+    if (op == StreamCredit) {
+      size_t credit = serializer<size_t>::read(des);
+      if (auto out = find(outgoing, id)) out->credit(credit);
+      return;
+    }
+    auto in = find(incoming, id);
+    if (!in) return;
+    if (op == StreamChunk) {
+      in->chunk(des);
+      return;
+    }
+    bool failed = serializer<bool>::read(des);
+    boost::exception_ptr error;
+    if (failed) error = boost::copy_exception(std::runtime_error(serializer<std::string>::read(des)));
+    {
+      std::lock_guard<std::mutex> l(m);
+      incoming.erase(id);
+    }
+    in->end(error);
+  }
+
+  // Fails every stream being received, and stops sending.
+  void disconnect() {
+    std::unordered_map<size_t, std::shared_ptr<Receiver>> in;
+    {
+      std::lock_guard<std::mutex> l(m);
+      in.swap(incoming);
+      outgoing.clear();
+    }
+    for (auto& entry : in) {
+      entry.second->end(boost::copy_exception(std::runtime_error("Disconnected")));
+    }
+  }
+
+private:
+  struct Sender {
+    virtual ~Sender() = default;
+    virtual void credit(size_t count) = 0;
+    virtual void cancel() = 0;
+  };
+  struct Receiver {
+    virtual ~Receiver() = default;
+    virtual void chunk(Deserializer& des) = 0;
+    virtual void end(boost::exception_ptr error) = 0;
+  };
+
+  // Reads the next chunk from the source whenever there is credit for it, and sends it on.
+  template <typename T>
+  struct Outgoing : Sender, std::enable_shared_from_this<Outgoing<T>> {
+    Outgoing(std::weak_ptr<StreamTable> table_, size_t id_, stream<T> source_)
+    : table(std::move(table_))
+    , id(id_)
+    , source(std::move(source_))
+    {}
+    void credit(size_t count) override {
+      {
+        std::lock_guard<std::mutex> l(m);
+        credits += count;
+        if (reading || credits == 0) return;
+        reading = true;
+        --credits;
+      }
+      auto self = this->shared_from_this();
+      source.next().then(boost::launch::sync, [self](boost::future<std::vector<T>> f){
+        self->forward(f);
+      });
+    }
+    void forward(boost::future<std::vector<T>>& f) {
+      auto owner = table.lock();
+      if (!owner) return;
+      std::vector<T> chunk;
+      boost::exception_ptr error;
+      try {
+        chunk = f.get();
+      } catch (...) {
+        error = boost::current_exception();
+      }
+      Serializer s(owner->framePool().acquire(), 0);
+      serializer<size_t>::write(s, controlChannel);
+      if (chunk.empty()) {
+        serializer<size_t>::write(s, StreamEnd);
+        serializer<size_t>::write(s, id);
+        serializer<bool>::write(s, bool(error));
+        if (error) serializer<std::string>::write(s, detail::messageOf(error));
+        owner->sendFrame(std::move(s));
+        owner->finished(id);
+        return;
+      }
+      serializer<size_t>::write(s, StreamChunk);
+      serializer<size_t>::write(s, id);
+      serializer<std::vector<T>>::write(s, chunk);
+      owner->sendFrame(std::move(s));
+      {
+        std::lock_guard<std::mutex> l(m);
+        reading = false;
+      }
+      credit(0);
+    }
+    void cancel() override {
+      if (auto owner = table.lock()) owner->finished(id);
+    }
+    std::weak_ptr<StreamTable> table;
+    const size_t id;
+    stream<T> source;
+    std::mutex m;
+    size_t credits = 0;
+    bool reading = false;
+  };
+
+  template <typename T>
+  struct Incoming : Receiver {
+    explicit Incoming(stream<T> sink_)
+    : sink(std::move(sink_))
+    {}
+    void chunk(Deserializer& des) override {
+      sink.write(serializer<std::vector<T>>::read(des));
+    }
+    void end(boost::exception_ptr error) override {
+      if (error) {
+        sink.fail(error);
+      } else {
+        sink.close();
+      }
+    }
+    stream<T> sink;
+  };
+
+  static std::vector<std::shared_ptr<Sender>>& pending() {
+    static thread_local std::vector<std::shared_ptr<Sender>> streams;
+    return streams;
+  }
+  template <typename Map>
+  typename Map::mapped_type find(Map& map, size_t id) {
+    std::lock_guard<std::mutex> l(m);
+    auto it = map.find(id);
+    return it == map.end() ? nullptr : it->second;
+  }
+  void finished(size_t id) {
+    std::lock_guard<std::mutex> l(m);
+    outgoing.erase(id);
+  }
+  void sendCredit(size_t id, size_t count) {
+    Serializer s(framePool().acquire(), 0);
+    serializer<size_t>::write(s, controlChannel);
+    serializer<size_t>::write(s, StreamCredit);
+    serializer<size_t>::write(s, id);
+    serializer<size_t>::write(s, count);
+    sendFrame(std::move(s));
+  }
+  FramePool& framePool() {
+    auto conn = conn_.lock();
+    return conn ? conn->framePool() : spare;
+  }
+  void sendFrame(Serializer&& s) {
+    if (auto conn = conn_.lock()) conn->write(s.release());
+  }
+
+  std::weak_ptr<Connection> conn_;
+  FramePool spare;
+  std::mutex m;
+  size_t nextId = 0;
+  std::unordered_map<size_t, std::shared_ptr<Sender>> outgoing;
+  std::unordered_map<size_t, std::shared_ptr<Receiver>> incoming;
+};
+
+namespace detail {
+
+// A stream travels as its id; the chunks follow once the frame carrying it has been written.
+template <typename T>
+struct Argument<stream<T>> {
+  typedef stream<T> stored_type;
+  static size_t size(const stream<T>&) { return maxVarintSize; }
+  static void write(Serializer& s, const OutgoingCall& call, const stream<T>& value) {
+    serializer<size_t>::write(s, call.origin.streams(call.lane)->send(value));
+  }
+  static size_t lane(const stream<T>&, const CallOrigin&) { return CallOrigin::noLane; }
+  static stream<T> read(Deserializer& s, RpcHandle& handle) {
+    return handle.streams->receive<T>(serializer<size_t>::read(s));
+  }
+  static bool ready(const stream<T>&) { return true; }
+  template <typename F>
+  static void whenReady(stream<T>&, std::atomic<size_t>&, const F&) {}
+  static stream<T> take(stream<T>& value) { return value; }
+};
+
+}
+}
+
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Rapscallion {
+
+// A connected byte stream that a Connection reads from and writes to. Completion handlers are run on
+// the strand they are given, which is the connection's.
+struct Transport {
+  typedef boost::asio::strand<boost::asio::any_io_executor> Strand;
+  typedef std::function<void(const boost::system::error_code&, size_t)> Handler;
+  virtual ~Transport() = default;
+  virtual boost::asio::any_io_executor executor() = 0;
+  // Reads at least one byte into buffer.
+  virtual void readSome(boost::asio::mutable_buffer buffer, Strand& strand, Handler handler) = 0;
+  // Writes all of buffers, which stay valid until the handler is called.
+  virtual void write(const std::vector<boost::asio::const_buffer>& buffers, Strand& strand, Handler handler) = 0;
+  virtual void close() = 0;
+  // Names the listening endpoint this transport is connected to, as localName() does for the endpoint
+  // of a listener, so a client can find a host in its own process. Empty if it cannot be named.
+  virtual std::string peerName() {
+    return std::string();
+  }
+};
+
+// TCP endpoints are only named when they are on this machine for certain, as loopback traffic cannot
+// leave it. The name holds the address as well as the port, since other sockets, of this process or
+// another, can listen on the same port at other loopback addresses; a wildcard address is named "*".
+// A connection to a loopback address that no listener is bound to goes to a wildcard listener on
+// the port, so LocalHosts::find() falls back to that name.
+inline std::string localName(const boost::asio::ip::tcp::endpoint& endpoint) {
+  const boost::asio::ip::address address = endpoint.address();
+  if (!address.is_loopback() && !address.is_unspecified()) return std::string();
+  const std::string host = address.is_unspecified() ? "*" : address.to_string();
+  return std::string(address.is_v4() ? "tcp4:" : "tcp6:") + host + ":" + std::to_string(endpoint.port());
+}
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+inline std::string localName(const boost::asio::local::stream_protocol::endpoint& endpoint) {
+  const std::string path = endpoint.path();
+  return path.empty() ? path : "unix:" + path;
+}
+#endif
+
+// A Transport over any Boost.Asio stream socket, such as TCP or a Unix domain socket.
+template <typename Socket>
+class SocketTransport : public Transport {
+public:
+  explicit SocketTransport(Socket socket)
+  : socket_(std::move(socket))
+  {}
+  boost::asio::any_io_executor executor() override {
+    return socket_.get_executor();
+  }
+  void readSome(boost::asio::mutable_buffer buffer, Strand& strand, Handler handler) override {
+    socket_.async_read_some(buffer, boost::asio::bind_executor(strand, std::move(handler)));
+  }
+  void write(const std::vector<boost::asio::const_buffer>& buffers, Strand& strand, Handler handler) override {
+    boost::asio::async_write(socket_, buffers, boost::asio::bind_executor(strand, std::move(handler)));
+  }
+  void close() override {
+    boost::system::error_code error;
+    socket_.close(error);
+  }
+  std::string peerName() override {
+    boost::system::error_code error;
+    auto endpoint = socket_.remote_endpoint(error);
+    return error ? std::string() : localName(endpoint);
+  }
+  Socket& socket() {
+    return socket_;
+  }
+private:
+  Socket socket_;
+};
+
+template <typename Socket>
+std::unique_ptr<Transport> makeTransport(Socket socket) {
+  return std::unique_ptr<Transport>(new SocketTransport<Socket>(std::move(socket)));
+}
+
+// Opens count connections to the same endpoint, for an RpcClient to spread its calls over.
+template <typename Endpoint>
+std::vector<std::unique_ptr<Transport>> connectAll(boost::asio::io_service& io_service, const Endpoint& endpoint, size_t count) {
+  std::vector<std::unique_ptr<Transport>> transports;
+  for (size_t n = 0; n < count; ++n) {
+    typename Endpoint::protocol_type::socket socket(io_service);
+    socket.connect(endpoint);
+    transports.push_back(makeTransport(std::move(socket)));
+  }
+  return transports;
+}
+
+}
+
@@ -14,9 +14,143 @@
 #endif
 
 #include <boost/thread/future.hpp>
+#include <boost/thread/executors/basic_thread_pool.hpp>
+#include <boost/thread/executors/executor.hpp>
+#include <boost/thread/executors/executor_adaptor.hpp>
+#include <boost/thread/executors/inline_executor.hpp>
+#include <cstddef>
+#include <utility>
 
+namespace Rapscallion {
+
+class StreamTable;
+
+// Handlers and continuations can be run on any Boost.Thread executor that is wrapped as an Executor.
+typedef boost::executors::executor Executor;
+typedef boost::executors::executor_adaptor<boost::executors::basic_thread_pool> ThreadPoolExecutor;
+typedef boost::executors::executor_adaptor<boost::executors::inline_executor> InlineExecutor;
+
+// The outstanding remote call a future was returned for, so that the future can be passed on as an
+// argument to a later call on the same connection (promise pipelining). Implemented by ProxyBase.
+struct CallOrigin {
+  static constexpr size_t noLane = size_t(-1);
+  virtual ~CallOrigin() = default;
+  // The client the call was made through.
+  virtual const void* channel() const = 0;
+  // Which of the client's connections the call was sent on, or noLane once it has completed.
+  virtual size_t lane(size_t requestId) const = 0;
+  // The host's id for the called interface, or size_t(-1) while it is not known yet.
+  virtual size_t remoteInterfaceId() const = 0;
+  // Someone is about to use the result, so the call must not be held back any longer.
+  virtual void demand() = 0;
+  // The future was destroyed unused, so a call that has not been sent yet need not be sent at all.
+  virtual void abandon(size_t requestId) = 0;
+  // The call's deadline has passed: fails it if it is still outstanding, and returns whether it was.
+  virtual bool expire(size_t requestId) = 0;
+  // Counts the call's request bytes against the client's CallLimits until it completes.
+  virtual void charge(size_t requestId, size_t bytes) = 0;
+  // Where continuations run when they are attached without a launch policy or executor; may be null.
+  virtual Executor* executor() const = 0;
+  // The streams of one of the client's connections, for stream<T> arguments.
+  virtual StreamTable* streams(size_t lane) const = 0;
+};
+
+// A call whose arguments are being written: who makes it, and on which connection of its client.
+struct OutgoingCall {
+  const CallOrigin& origin;
+  size_t lane;
+};
+
+}
+
+// A boost::future that also remembers which remote call, if any, it is the result of. Waiting for it or
+// attaching a continuation makes sure that call is sent; dropping it unused lets a client in lazy mode
+// discard the call if it is still queued.
 template <typename T>
-using future = boost::future<T>;
+class future : public boost::future<T> {
+public:
+  future() = default;
+  future(boost::future<T>&& f)
+  : boost::future<T>(std::move(f))
+  {}
+  future(boost::future<T>&& f, Rapscallion::CallOrigin* origin, size_t requestId)
+  : boost::future<T>(std::move(f))
+  , origin_(origin)
+  , requestId_(requestId)
+  {}
+  future(future&& rhs)
+  : boost::future<T>(std::move(rhs))
+  , origin_(rhs.origin_)
+  , requestId_(rhs.requestId_)
+  , used_(rhs.used_)
+  {}
+  future& operator=(future&& rhs) {
+    release();
+    boost::future<T>::operator=(std::move(rhs));
+    origin_ = rhs.origin_;
+    requestId_ = rhs.requestId_;
+    used_ = rhs.used_;
+    return *this;
+  }
+  ~future() {
+    release();
+  }
+  Rapscallion::CallOrigin* origin() const { return origin_; }
+  size_t requestId() const { return requestId_; }
+
+  // Marks the result as used without asking for the call to be sent, e.g. when the future is passed
+  // on as a pipelined argument.
+  void keep() { used_ = true; }
+  void demand() {
+    used_ = true;
+    if (origin_) origin_->demand();
+  }
+
+  auto get() -> decltype(std::declval<boost::future<T>&>().get()) {
+    demand();
+    return boost::future<T>::get();
+  }
+  void wait() const {
+    const_cast<future*>(this)->demand();
+    boost::future<T>::wait();
+  }
+  template <typename Duration>
+  boost::future_status wait_for(const Duration& d) const {
+    const_cast<future*>(this)->demand();
+    return boost::future<T>::wait_for(d);
+  }
+  template <typename TimePoint>
+  boost::future_status wait_until(const TimePoint& t) const {
+    const_cast<future*>(this)->demand();
+    return boost::future<T>::wait_until(t);
+  }
+  // Without a launch policy or executor, the continuation runs on the executor of the proxy the call
+  // was made on, if it has one.
+  template <typename F>
+  auto then(F&& f) -> decltype(std::declval<boost::future<T>&>().then(std::forward<F>(f))) {
+    demand();
+    Rapscallion::Executor* ex = origin_ ? origin_->executor() : nullptr;
+    if (ex) return boost::future<T>::then(*ex, std::forward<F>(f));
+    return boost::future<T>::then(std::forward<F>(f));
+  }
+  template <typename... Args>
+  auto then(Args&&... args) -> decltype(std::declval<boost::future<T>&>().then(std::forward<Args>(args)...)) {
+    demand();
+    return boost::future<T>::then(std::forward<Args>(args)...);
+  }
+  boost::shared_future<T> share() {
+    demand();
+    return boost::future<T>::share();
+  }
+private:
+  // A moved-from future is no longer valid, so only the last owner of the result can abandon the call.
+  void release() {
+    if (origin_ && !used_ && this->valid()) origin_->abandon(requestId_);
+  }
+  Rapscallion::CallOrigin* origin_ = nullptr;
+  size_t requestId_ = 0;
+  bool used_ = false;
+};
 
 template <typename T>
 using promise = boost::promise<T>;
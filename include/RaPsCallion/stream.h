@@ -0,0 +1,175 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "future.h"
+
+// A sequence of chunks of T, handed from a producer to a consumer while it is being produced. Copies
+// share the same sequence: the producer writes chunks and closes it, the consumer reads them with
+// next() or for_each(). As a parameter or result of a remote call, the chunks follow the call or reply
+// in frames of their own, and the sender holds back once the receiver has a few chunks it has not
+// read yet, so memory use stays bounded on both ends.
+template <typename T>
+class stream {
+public:
+  // The number of unread chunks after which write() reports the stream as full.
+  static constexpr size_t defaultCapacity = 8;
+  explicit stream(size_t capacity = defaultCapacity)
+  : state_(std::make_shared<State>(capacity))
+  {}
+
+  // Appends a non-empty chunk. The chunk is always queued; the returned future is ready once the
+  // stream is below its capacity again, and a producer that waits for it never runs ahead further.
+  future<void> write(std::vector<T> chunk) {
+    if (chunk.empty()) return boost::make_ready_future();
+    std::shared_ptr<promise<std::vector<T>>> reader;
+    future<void> space;
+    {
+      std::lock_guard<std::mutex> l(state_->m);
+      if (state_->ended) return boost::make_exceptional_future<void>(std::runtime_error("Stream already ended"));
+      if (state_->reader) {
+        reader = std::move(state_->reader);
+      } else {
+        state_->chunks.push_back(std::move(chunk));
+      }
+      if (state_->chunks.size() < state_->capacity) {
+        space = boost::make_ready_future();
+      } else {
+        state_->writers.emplace_back();
+        space = state_->writers.back().get_future();
+      }
+    }
+    if (reader) {
+      reader->set_value(std::move(chunk));
+      consumed();
+    }
+    return space;
+  }
+  // Ends the stream after the chunks written so far.
+  void close() {
+    end(boost::exception_ptr());
+  }
+  // Ends the stream after the chunks written so far; the reader then gets error.
+  void fail(boost::exception_ptr error) {
+    end(error);
+  }
+
+  // The next chunk, or an empty vector once the stream has ended. Only one read may be outstanding.
+  future<std::vector<T>> next() {
+    std::vector<promise<void>> writers;
+    future<std::vector<T>> result;
+    {
+      std::lock_guard<std::mutex> l(state_->m);
+      if (state_->reader) {
+        return boost::make_exceptional_future<std::vector<T>>(std::runtime_error("Stream is already being read"));
+      }
+      if (state_->chunks.empty()) {
+        if (state_->error) return boost::make_exceptional_future<std::vector<T>>(state_->error);
+        if (state_->ended) return boost::make_ready_future(std::vector<T>());
+        state_->reader = std::make_shared<promise<std::vector<T>>>();
+        return state_->reader->get_future();
+      }
+      result = boost::make_ready_future(std::move(state_->chunks.front()));
+      state_->chunks.pop_front();
+      if (state_->chunks.size() < state_->capacity) writers.swap(state_->writers);
+    }
+    for (auto& writer : writers) writer.set_value();
+    consumed();
+    return result;
+  }
+  // Calls onChunk with each chunk, in order, on the thread that delivers it. The result is ready once
+  // the stream has ended, and holds the stream's error or the first exception onChunk throws.
+  template <typename F>
+  future<void> for_each(F onChunk) {
+    auto done = std::make_shared<promise<void>>();
+    future<void> result = done->get_future();
+    forEach(*this, std::move(onChunk), done);
+    return result;
+  }
+
+  // Called after every chunk the reader takes; used to hand out credit to a remote producer.
+  void onConsumed(std::function<void()> f) {
+    std::lock_guard<std::mutex> l(state_->m);
+    state_->consumed = std::move(f);
+  }
+
+private:
+  struct State {
+    explicit State(size_t capacity_) : capacity(capacity_) {}
+    std::mutex m;
+    const size_t capacity;
+    std::deque<std::vector<T>> chunks;
+    std::shared_ptr<promise<std::vector<T>>> reader;
+    std::vector<promise<void>> writers;
+    std::function<void()> consumed;
+    bool ended = false;
+    boost::exception_ptr error;
+  };
+
+  void end(boost::exception_ptr error) {
+    std::shared_ptr<promise<std::vector<T>>> reader;
+    std::vector<promise<void>> writers;
+    {
+      std::lock_guard<std::mutex> l(state_->m);
+      if (state_->ended) return;
+      state_->ended = true;
+      state_->error = error;
+      reader = std::move(state_->reader);
+      writers.swap(state_->writers);
+    }
+    for (auto& writer : writers) writer.set_value();
+    if (!reader) return;
+    if (error) {
+      reader->set_exception(error);
+    } else {
+      reader->set_value(std::vector<T>());
+    }
+  }
+
+  void consumed() {
+    std::function<void()> f;
+    {
+      std::lock_guard<std::mutex> l(state_->m);
+      f = state_->consumed;
+    }
+    if (f) f();
+  }
+
+  // Handles every chunk that is already there in a loop, and only waits for one that is not.
+  template <typename F>
+  static void forEach(stream s, F onChunk, std::shared_ptr<promise<void>> done) {
+    for (;;) {
+      future<std::vector<T>> chunk = s.next();
+      if (!chunk.is_ready()) {
+        chunk.then(boost::launch::sync, [s, onChunk, done](boost::future<std::vector<T>> f) mutable {
+          if (deliver(f, onChunk, *done)) forEach(s, std::move(onChunk), done);
+        });
+        return;
+      }
+      if (!deliver(chunk, onChunk, *done)) return;
+    }
+  }
+  // Returns false once the stream has ended.
+  template <typename Future, typename F>
+  static bool deliver(Future& chunk, F& onChunk, promise<void>& done) {
+    try {
+      std::vector<T> items = chunk.get();
+      if (items.empty()) {
+        done.set_value();
+        return false;
+      }
+      onChunk(items);
+      return true;
+    } catch (...) {
+      done.set_exception(std::current_exception());
+      return false;
+    }
+  }
+
+  std::shared_ptr<State> state_;
+};
+
@@ -0,0 +1,127 @@
+#include "Compression.h"
+#include "Protocol.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace Rapscallion {
+
+void readCompressed(Deserializer& des, Deserializer& inner, size_t maxFrameSize) {
+  size_t codec = serializer<std::uint_least64_t>::read(des);
+  size_t size = serializer<std::uint_least64_t>::read(des);
+  if (codec != LzCodec) throw std::runtime_error("Unknown compression codec");
+  if (size > maxFrameSize) throw FrameError("Compressed frames too large");
+  inner.setMaxFrameSize(maxFrameSize);
+  size_t compressedSize = des.size - des.offs;
+  if (size > lz::maxExpansion(compressedSize)) throw std::runtime_error("Corrupt compressed data");
+  const uint8_t* data = des.getByteRange(compressedSize);
+  lz::decompress(data, compressedSize, inner.prepare(size), size);
+  inner.commit(size);
+}
+
+namespace lz {
+
+namespace {
+  constexpr unsigned hashBits = 14;
+  // Matches may not start in the last bytes, so the match finder can always read 4 bytes ahead.
+  constexpr size_t tailLiterals = 5;
+
+  uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - hashBits);
+  }
+
+  void writeLength(std::vector<uint8_t>& out, size_t length) {
+    while (length >= 255) {
+      out.push_back(255);
+      length -= 255;
+    }
+    out.push_back(uint8_t(length));
+  }
+
+  void writeSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength ? matchLength - minMatch : 0;
+    out.push_back(uint8_t((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15) writeLength(out, literalCount - 15);
+    out.insert(out.end(), literals, literals + literalCount);
+    if (!matchLength) return;
+    out.push_back(uint8_t(offset));
+    out.push_back(uint8_t(offset >> 8));
+    if (matchCode >= 15) writeLength(out, matchCode - 15);
+  }
+
+  size_t readLength(const uint8_t*& in, const uint8_t* end, size_t length) {
+    if (length != 15) return length;
+    uint8_t more;
+    do {
+      if (in == end) throw std::runtime_error("Truncated compressed data");
+      more = *in++;
+      length += more;
+    } while (more == 255);
+    return length;
+  }
+}
+
+void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+  out.reserve(out.size() + size + size / 255 + 16);
+  uint32_t table[1 << hashBits] = {};
+  size_t anchor = 0;
+  size_t pos = 1;
+  // Skip ahead faster the longer no match has been found, as the input is then likely incompressible.
+  size_t misses = 0;
+  while (size > tailLiterals + minMatch && pos < size - tailLiterals - minMatch) {
+    uint32_t sequence = read32(data + pos);
+    uint32_t& slot = table[hash(sequence)];
+    size_t candidate = slot;
+    slot = uint32_t(pos);
+    if (candidate == 0 || pos - candidate > maxOffset || read32(data + candidate) != sequence) {
+      pos += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+    size_t length = minMatch;
+    while (pos + length < size - tailLiterals && data[candidate + length] == data[pos + length]) ++length;
+    writeSequence(out, data + anchor, pos - anchor, pos - candidate, length);
+    pos += length;
+    anchor = pos;
+  }
+  writeSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+void decompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize) {
+  const uint8_t* in = data;
+  const uint8_t* end = data + size;
+  size_t written = 0;
+  while (in < end) {
+    uint8_t token = *in++;
+    size_t literals = readLength(in, end, token >> 4);
+    if (size_t(end - in) < literals || outSize - written < literals) throw std::runtime_error("Corrupt compressed data");
+    memcpy(out + written, in, literals);
+    in += literals;
+    written += literals;
+    if (in == end) break;
+    if (end - in < 2) throw std::runtime_error("Truncated compressed data");
+    size_t offset = in[0] | (size_t(in[1]) << 8);
+    in += 2;
+    size_t length = readLength(in, end, token & 15) + minMatch;
+    if (offset == 0 || offset > written || outSize - written < length) throw std::runtime_error("Corrupt compressed data");
+    // A match that overlaps the bytes it produces repeats them; each copy doubles the repeated run.
+    size_t distance = offset;
+    while (length > 0) {
+      size_t step = std::min(distance, length);
+      memcpy(out + written, out + written - distance, step);
+      written += step;
+      length -= step;
+      distance += step;
+    }
+  }
+  if (written != outSize) throw std::runtime_error("Compressed data has the wrong size");
+}
+
+}
+}
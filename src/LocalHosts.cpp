@@ -0,0 +1,44 @@
+#include "LocalHosts.h"
+#include "RpcHost.h"
+#include <map>
+#include <mutex>
+
+namespace Rapscallion {
+
+namespace {
+  std::mutex& mutex() {
+    static std::mutex m;
+    return m;
+  }
+  std::map<std::string, RpcHost*>& hosts() {
+    static std::map<std::string, RpcHost*> byName;
+    return byName;
+  }
+}
+
+void LocalHosts::add(const std::string& name, RpcHost* host) {
+  if (name.empty()) return;
+  std::lock_guard<std::mutex> l(mutex());
+  hosts()[name] = host;
+}
+
+void LocalHosts::remove(RpcHost* host) {
+  std::lock_guard<std::mutex> l(mutex());
+  for (auto it = hosts().begin(); it != hosts().end();) {
+    it = it->second == host ? hosts().erase(it) : std::next(it);
+  }
+}
+
+void* LocalHosts::find(const std::string& name, const std::type_info& type) {
+  if (name.empty()) return nullptr;
+  std::lock_guard<std::mutex> l(mutex());
+  auto it = hosts().find(name);
+  if (it == hosts().end() && name.compare(0, 3, "tcp") == 0) {
+    // A TCP name is "tcp4:<address>:<port>"; no listener on the address itself means a wildcard one.
+    const size_t first = name.find(':'), last = name.rfind(':');
+    it = hosts().find(name.substr(0, first + 1) + "*" + name.substr(last));
+  }
+  return it == hosts().end() ? nullptr : it->second->local(type);
+}
+
+}
@@ -0,0 +1,162 @@
+#include "Metrics.h"
+#include "MetricsService.h"
+#include "RpcHost.h"
+#include <cmath>
+
+namespace Rapscallion {
+
+size_t LatencyHistogram::bucketOf(uint64_t ns) {
+  if (ns < (uint64_t(2) << subBucketBits)) return ns;
+  unsigned magnitude = 63 - __builtin_clzll(ns);
+  if (magnitude >= maxMagnitude) return bucketCount - 1;
+  unsigned shift = magnitude - subBucketBits;
+  return ((shift + 1) << subBucketBits) + (ns >> shift) - (uint64_t(1) << subBucketBits);
+}
+
+uint64_t LatencyHistogram::lowerBound(size_t bucket) {
+  if (bucket < (size_t(2) << subBucketBits)) return bucket;
+  unsigned shift = (bucket >> subBucketBits) - 1;
+  return ((bucket & ((1 << subBucketBits) - 1)) + (uint64_t(1) << subBucketBits)) << shift;
+}
+
+uint64_t LatencyHistogram::upperBound(size_t bucket) {
+  if (bucket < (size_t(2) << subBucketBits)) return bucket;
+  unsigned shift = (bucket >> subBucketBits) - 1;
+  return lowerBound(bucket) + (uint64_t(1) << shift) - 1;
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t total = 0;
+  for (uint64_t c : counts) total += c;
+  return total;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+  uint64_t total = count();
+  if (total == 0) return 0;
+  uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(fraction * total)));
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+    seen += counts[bucket];
+    if (seen >= rank) return upperBound(bucket);
+  }
+  return upperBound(counts.size() - 1);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (size_t bucket = 0; bucket < counts.size() && bucket < other.counts.size(); ++bucket) {
+    counts[bucket] += other.counts[bucket];
+  }
+}
+
+void MethodMetrics::merge(const MethodMetrics& other) {
+  calls += other.calls;
+  inFlight += other.inFlight;
+  failures += other.failures;
+  requestBytes += other.requestBytes;
+  replyBytes += other.replyBytes;
+  latency.merge(other.latency);
+}
+
+void addTo(MetricsSnapshot& snapshot, const MethodMetrics& m) {
+  for (auto& entry : snapshot) {
+    if (entry.interfaceName == m.interfaceName && entry.methodName == m.methodName) {
+      entry.merge(m);
+      return;
+    }
+  }
+  snapshot.push_back(m);
+}
+
+// The shards are read one after the other while calls go on, so a call may be seen to finish without
+// being seen to start; the in-flight count is clamped at zero.
+MethodMetrics MethodStats::snapshot(const std::string& interfaceName) const {
+  MethodMetrics m;
+  m.interfaceName = interfaceName;
+  m.methodName = name_;
+  uint64_t replies = 0;
+  for (auto& entry : shards) {
+    const Shard* shard = entry.load(std::memory_order_acquire);
+    if (!shard) continue;
+    m.calls += shard->calls.load(std::memory_order_relaxed);
+    replies += shard->replies.load(std::memory_order_relaxed);
+    m.failures += shard->failures.load(std::memory_order_relaxed);
+    m.requestBytes += shard->requestBytes.load(std::memory_order_relaxed);
+    m.replyBytes += shard->replyBytes.load(std::memory_order_relaxed);
+    for (size_t bucket = 0; bucket < LatencyHistogram::bucketCount; ++bucket) {
+      m.latency.counts[bucket] += shard->latency[bucket].load(std::memory_order_relaxed);
+    }
+  }
+  m.inFlight = m.calls > replies + m.failures ? m.calls - replies - m.failures : 0;
+  return m;
+}
+
+// Only the buckets that counted something are sent, as bucket index and count.
+void serializer<LatencyHistogram>::write(Serializer& s, const LatencyHistogram& value) {
+  size_t used = 0;
+  for (uint64_t c : value.counts) used += (c != 0);
+  serializer<std::uint_least64_t>::write(s, used);
+  for (size_t bucket = 0; bucket < value.counts.size(); ++bucket) {
+    if (value.counts[bucket] == 0) continue;
+    serializer<std::uint_least64_t>::write(s, bucket);
+    serializer<std::uint_least64_t>::write(s, value.counts[bucket]);
+  }
+}
+
+LatencyHistogram serializer<LatencyHistogram>::read(Deserializer& s) {
+  LatencyHistogram value;
+  size_t used = serializer<std::uint_least64_t>::read(s);
+  for (size_t n = 0; n < used; ++n) {
+    size_t bucket = serializer<std::uint_least64_t>::read(s);
+    uint64_t c = serializer<std::uint_least64_t>::read(s);
+    if (bucket >= value.counts.size()) throw std::runtime_error("Invalid latency bucket");
+    value.counts[bucket] = c;
+  }
+  return value;
+}
+
+void serializer<MethodMetrics>::write(Serializer& s, const MethodMetrics& value) {
+  serializer<std::string>::write(s, value.interfaceName);
+  serializer<std::string>::write(s, value.methodName);
+  serializer<std::uint_least64_t>::write(s, value.calls);
+  serializer<std::uint_least64_t>::write(s, value.inFlight);
+  serializer<std::uint_least64_t>::write(s, value.failures);
+  serializer<std::uint_least64_t>::write(s, value.requestBytes);
+  serializer<std::uint_least64_t>::write(s, value.replyBytes);
+  serializer<LatencyHistogram>::write(s, value.latency);
+}
+
+MethodMetrics serializer<MethodMetrics>::read(Deserializer& s) {
+  MethodMetrics value;
+  value.interfaceName = serializer<std::string>::read(s);
+  value.methodName = serializer<std::string>::read(s);
+  value.calls = serializer<std::uint_least64_t>::read(s);
+  value.inFlight = serializer<std::uint_least64_t>::read(s);
+  value.failures = serializer<std::uint_least64_t>::read(s);
+  value.requestBytes = serializer<std::uint_least64_t>::read(s);
+  value.replyBytes = serializer<std::uint_least64_t>::read(s);
+  value.latency = serializer<LatencyHistogram>::read(s);
+  return value;
+}
+
+namespace {
+
+struct HostMetrics : RpcMetrics {
+  explicit HostMetrics(RpcHost& host_)
+  : host(host_)
+  {}
+  future<MetricsSnapshot> snapshot() override {
+    return boost::make_ready_future(host.metrics());
+  }
+  RpcHost& host;
+};
+
+}
+
+void RpcHost::serveMetrics() {
+  if (metricsService) return;
+  metricsService.reset(new HostMetrics(*this));
+  Register(metricsService.get());
+}
+
+}
@@ -1,32 +1,88 @@
 #include "RpcHandle.h"
 #include "RpcHost.h"
 #include "Connection.h"
+#include "Protocol.h"
+#include "StreamTable.h"
 
 namespace Rapscallion {
 
-RpcHandle::RpcHandle(RpcHost& host, boost::asio::ip::tcp::socket sock)
-: conn(std::make_shared<Connection>(std::move(sock), [&host, this](const char* data, size_t size){
-  des.AddBytes(reinterpret_cast<const uint8_t*>(data), size);
+RpcHandle::RpcHandle(RpcHost& host, std::unique_ptr<Transport> transport)
+: conn(std::make_shared<Connection>(std::move(transport), des, [&host, this]{
   while (des.HasFullPacket()) {
     host.Handle(des, *this);
     des.RemovePacket();
   }
 }))
+, streams(std::make_shared<StreamTable>(conn))
 {
+  retained.resize(host.pipelineWindow);
+}
+
+void RpcHandle::start() {
   conn->start();
 }
 
-void RpcHandle::SendInterface(std::unique_ptr<InterfaceDispatcher>& iface) {
-  Serializer s;
-  serializer<std::string>::write(s, "");
-  serializer<std::string>::write(s, iface->getInterfaceName());
-  Send(s);
+void RpcHandle::SendInterface(InterfaceDispatcher& iface) {
+  Serializer s(framePool().acquire(), 0);
+  serializer<size_t>::write(s, controlChannel);
+  serializer<size_t>::write(s, AnnounceInterface);
+  serializer<std::string>::write(s, iface.getInterfaceName());
+  serializer<size_t>::write(s, iface.interfaceId);
+  const auto& methods = iface.getMethodNames();
+  serializer<size_t>::write(s, methods.size());
+  for (const auto& method : methods) {
+    serializer<std::string>::write(s, method);
+  }
+  Send(std::move(s));
+  announced = iface.interfaceId + 1;
 }
 
-void RpcHandle::Send(Serializer& s) {
-  conn->write(reinterpret_cast<const char*>(s.data()), s.size());
+void RpcHandle::Send(Serializer&& s) {
+  conn->write(s.release());
 }
 
+void RpcHandle::SendFailure(size_t interfaceId, size_t requestId, const std::string& message) {
+  Serializer s(framePool().acquire(), 3 * detail::maxVarintSize + serialized_size<std::string>::of(message));
+  serializer<size_t>::write(s, controlChannel);
+  serializer<size_t>::write(s, CallFailed);
+  serializer<size_t>::write(s, interfaceId);
+  serializer<size_t>::write(s, requestId);
+  serializer<std::string>::write(s, message);
+  Send(std::move(s));
 }
 
+void RpcHandle::SendFailure(const std::string& interfaceName, size_t requestId, const std::string& message) {
+  Serializer s(framePool().acquire(), 0);
+  serializer<size_t>::write(s, controlChannel);
+  serializer<size_t>::write(s, CallByNameFailed);
+  serializer<std::string>::write(s, interfaceName);
+  serializer<size_t>::write(s, requestId);
+  serializer<std::string>::write(s, message);
+  Send(std::move(s));
+}
 
+FramePool& RpcHandle::framePool() {
+  return conn->framePool();
+}
+
+void RpcHandle::Waiting(size_t interfaceId, size_t requestId) {
+  std::lock_guard<std::mutex> l(waitingMutex);
+  waiting[std::make_pair(interfaceId, requestId)] = false;
+}
+
+bool RpcHandle::Start(size_t interfaceId, size_t requestId) {
+  std::lock_guard<std::mutex> l(waitingMutex);
+  auto it = waiting.find(std::make_pair(interfaceId, requestId));
+  if (it == waiting.end()) return true;
+  bool cancelled = it->second;
+  waiting.erase(it);
+  return !cancelled;
+}
+
+void RpcHandle::Cancel(size_t interfaceId, size_t requestId) {
+  std::lock_guard<std::mutex> l(waitingMutex);
+  auto it = waiting.find(std::make_pair(interfaceId, requestId));
+  if (it != waiting.end()) it->second = true;
+}
+
+}
@@ -1,5 +1,6 @@
 #include "Serializer.h"
 #include <cmath>
+#include <cstring>
 #include <cstdint>
 #include <cstdlib>
 #include <limits>
@@ -13,21 +14,26 @@ void serializer<std::uint_least64_t>::write(Serializer& s, std::uint_least64_t v
   }
   s.addByte((uint8_t)value);
 }
+// Sign and magnitude, with the sign in the lowest bit. The magnitude of LONG_MIN does not fit next
+// to the sign; it wraps to zero, so LONG_MIN is sent as minus zero.
 void serializer<long>::write(Serializer& s, const long v) {
-  std::uint_least64_t val = (std::abs(v) << 1) | (v < 0 ? 1 : 0);
-  serializer<std::uint_least64_t>::write(s, val);
+  serializer<std::uint_least64_t>::write(s, (magnitudeOf(v) << 1) | (v < 0 ? 1 : 0));
 }
 void serializer<int>::write(Serializer& s, const int v) {
   serializer<long>::write(s, v);
 }
 void serializer<std::string>::write(Serializer& s, const std::string& value) {
   serializer<std::uint_least64_t>::write(s, value.size());
-  for (auto& c : value) s.addByte(c);
+  s.addBytes(value.data(), value.size());
 }
 void serializer<bool>::write(Serializer& s, const bool b) {
   serializer<std::uint_least64_t>::write(s, b ? 1 : 0);
 }
 
+// Finite non-zero numbers are sent as their binary exponent e and a 64 bit fraction f with the top bit
+// set, such that the number is f * 2^(e - 64). The exponent carries the sign in its lowest bit and is
+// offset to make room for the flags of zero, infinity and NaN; the fraction is bit reversed so that its
+// trailing zeroes do not take up space. Both are taken straight from the IEEE-754 bit pattern.
 namespace {
   enum Type {
     NaN,
@@ -35,15 +41,11 @@ namespace {
     Zero,
     Normal
   };
-  struct float_repr {
-    // Can fit an exponent of 32-2=20 bits, can support octuple-precision IEEE754 floats
-    std::int_least32_t exponent;
-    // Can support double precision IEEE754 floats (quadruple requires 112 bits, octuple 236 bits)
-    std::uint_least64_t fraction;
-    static constexpr unsigned fraction_bits = 64;
-    bool is_negative;
-    Type type;
-  };
+  static_assert(Zero     != 0, "Cannot encode the sign of zero in the sign bit of zero on 2's complement systems");
+  static_assert(Infinity != 0, "Cannot encode the sign of infinity in the sign bit of zero on 2's complement systems");
+  constexpr int fraction_bits = 64;
+  constexpr std::uint_least64_t top_bit = 1ULL << 63;
+
   auto bitreverse(std::uint_least64_t b) -> decltype(b)
   {
     b = ((b & 0xFFFFFFFF00000000ULL) >> 32) | ((b & 0x00000000FFFFFFFFULL) << 32);
@@ -54,93 +56,103 @@ namespace {
     b = ((b & 0xAAAAAAAAAAAAAAAAULL) >>  1) | ((b & 0x5555555555555555ULL) <<  1);
     return b;
   }
-}
 
-template <>
-struct serializer<float_repr> {
-  static void write(Serializer& s, float_repr const &b) {
-    // Using multiplication to avoid bit shifting a signed integer
-    switch(b.type) {
-      default:
-        {
-          static_assert(Type::Zero     != 0, "Cannot encode the sign of zero in the sign bit of zero on 2's complement systems");
-          static_assert(Type::Infinity != 0, "Cannot encode the sign of infinity in the sign bit of zero on 2's complement systems");
-          serializer<decltype(+b.exponent)>::write(s, b.is_negative ? -b.type : b.type);
+  void writeSpecial(Serializer& s, bool is_negative, Type type) {
+    serializer<long>::write(s, is_negative ? -type : type);
+  }
+
+  void writeNormal(Serializer& s, bool is_negative, long exponent, std::uint_least64_t fraction) {
+    // Subnormal inputs arrive with the fraction not yet normalized.
+    while (!(fraction & top_bit)) {
+      fraction <<= 1;
+      --exponent;
+    }
+    exponent = exponent * 2 + (exponent < 0 ? -is_negative : is_negative);
+    serializer<long>::write(s, exponent < 0 ? exponent - 2 : exponent + 3);
+    serializer<std::uint_least64_t>::write(s, bitreverse(fraction));
+  }
+
+  // IEEE-754 binary formats with a sign bit, exponentBits biased exponent bits and mantissaBits
+  // explicitly stored mantissa bits.
+  template <typename Float, typename Bits, int exponentBits, int mantissaBits>
+  struct ieee754 {
+    static constexpr int bias = (1 << (exponentBits - 1)) - 1;
+    static constexpr Bits mantissaMask = (Bits(1) << mantissaBits) - 1;
+    static constexpr Bits maxExponent = (Bits(1) << exponentBits) - 1;
+    // The fraction bits below the mantissa, which are always zero.
+    static constexpr int unusedBits = fraction_bits - 1 - mantissaBits;
+
+    static void write(Serializer& s, Float value) {
+      Bits bits;
+      memcpy(&bits, &value, sizeof(bits));
+      const bool is_negative = (bits >> (exponentBits + mantissaBits)) != 0;
+      const Bits exponent = (bits >> mantissaBits) & maxExponent;
+      const std::uint_least64_t mantissa = bits & mantissaMask;
+      if (exponent == maxExponent) {
+        if (mantissa) {
+          writeSpecial(s, false, NaN);
+        } else {
+          writeSpecial(s, is_negative, Infinity);
         }
-        break;
-      case Normal:
-        {
-          const decltype(b.exponent) exponent
-            = b.exponent * 2 + (b.exponent < 0 ? -b.is_negative : b.is_negative);
-          const decltype(b.fraction) reversed_fraction
-            = bitreverse(b.fraction);
-          serializer<decltype(+exponent)>::write(s, exponent < 0 ? exponent - 2 : exponent + 3);
-          serializer<decltype(+b.fraction)>::write(s, reversed_fraction);
+      } else if (exponent == 0) {
+        if (mantissa) {
+          writeNormal(s, is_negative, 2 - bias, mantissa << unusedBits);
+        } else {
+          writeSpecial(s, is_negative, Zero);
         }
-        break;
-    };
-  }
-  static float_repr read(Deserializer& s) {
-    float_repr result;
-    auto exponent = serializer<decltype(result.exponent)>::read(s);
-    if (exponent < 3 && exponent >= -2) {
-      result.is_negative   = (exponent < 0);
-      result.type          = (Type)std::abs(exponent);
-    } else {
+      } else {
+        writeNormal(s, is_negative, long(exponent) - bias + 1, top_bit | (mantissa << unusedBits));
+      }
+    }
+
+    static Float read(Deserializer& s) {
+      long exponent = serializer<long>::read(s);
+      if (exponent < 3 && exponent >= -2) {
+        const bool is_negative = exponent < 0;
+        switch (std::abs(exponent)) {
+          case Zero:
+            return is_negative ? -Float(0) : Float(0);
+          case Infinity:
+            return is_negative ? -std::numeric_limits<Float>::infinity() : std::numeric_limits<Float>::infinity();
+          default:
+            return std::numeric_limits<Float>::quiet_NaN();
+        }
+      }
       exponent = (exponent < 0) ? exponent + 2 : exponent - 3;
-      result.is_negative   = !!((exponent/ 1) % 2);
-      result.type = Normal;
-      result.exponent      = exponent / 2;
-      const auto reversed_fraction = serializer<decltype(result.fraction)>::read(s);
-      result.fraction      = bitreverse(reversed_fraction);
+      const bool is_negative = (exponent % 2) != 0;
+      exponent /= 2;
+      const std::uint_least64_t fraction = bitreverse(serializer<std::uint_least64_t>::read(s));
+      const long biased = exponent + bias - 1;
+      if ((fraction & top_bit) && (fraction << (1 + mantissaBits)) == 0 && biased > 0 && Bits(biased) < maxExponent) {
+        const Bits bits = (Bits(is_negative) << (exponentBits + mantissaBits))
+          | (Bits(biased) << mantissaBits)
+          | (Bits(fraction >> unusedBits) & mantissaMask);
+        Float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+      }
+      // Results that are subnormal, out of range or more precise than Float are rounded by the FPU.
+      return static_cast<Float>((is_negative ? -1.0 : 1.0) * std::ldexp(static_cast<double>(fraction), int(exponent - fraction_bits)));
     }
-    return result;
-  }
-};
+  };
 
-void serializer<double>::write(Serializer& s, double const b) {
-  switch (std::fpclassify(b)) {
-    case FP_ZERO:
-      serializer<float_repr>::write(s, { 0, 0, !!std::signbit(b), Zero });
-      break;
-    case FP_INFINITE:
-      serializer<float_repr>::write(s, { 0, 0, !!std::signbit(b), Infinity });
-      break;
-    case FP_NAN:
-      // The bit reversal is to ensure the most efficient encoding can be used
-      serializer<float_repr>::write(s, { 0, 0, false, NaN });
-      break;
-    case FP_NORMAL:
-    case FP_SUBNORMAL:
-      float_repr repr;
-      repr.type = Normal;
-      repr.is_negative = !!std::signbit(b);
-      // Make the fraction a positive integer
-      repr.fraction = std::ldexp(std::abs(std::frexp(b, &repr.exponent)), repr.fraction_bits);
-      serializer<decltype(repr)>::write(s, repr);
-      break;
-  }
+  typedef ieee754<double, std::uint64_t, 11, 52> binary64;
+  typedef ieee754<float, std::uint32_t, 8, 23> binary32;
+  static_assert(sizeof(double) == sizeof(std::uint64_t) && std::numeric_limits<double>::is_iec559, "double must be IEEE-754 binary64");
+  static_assert(sizeof(float) == sizeof(std::uint32_t) && std::numeric_limits<float>::is_iec559, "float must be IEEE-754 binary32");
 }
 
+void serializer<double>::write(Serializer& s, double const b) {
+  binary64::write(s, b);
+}
 double serializer<double>::read(Deserializer& s) {
-  const auto repr = serializer<float_repr>::read(s);
-  switch(repr.type) {
-    case Zero:
-      return (repr.is_negative ? -0.0 : 0.0);
-    case Infinity:
-      return repr.is_negative ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
-    case NaN:
-      return std::numeric_limits<double>::quiet_NaN();
-    default:
-      return (repr.is_negative ? -1.0 : 1.0) * std::ldexp(static_cast<double>(repr.fraction), repr.exponent - repr.fraction_bits);
-  }
+  return binary64::read(s);
 }
-
 void serializer<float>::write(Serializer& s, float const b) {
-  serializer<double>::write(s, b);
+  binary32::write(s, b);
 }
 float serializer<float>::read(Deserializer& s) {
-  return serializer<double>::read(s);
+  return binary32::read(s);
 }
 
 std::uint_least64_t serializer<std::uint_least64_t>::read(Deserializer& s) {
@@ -150,6 +162,7 @@ std::uint_least64_t serializer<std::uint_least64_t>::read(Deserializer& s) {
   while (b & 0x80) {
     val |= (b & 0x7F) << offs;
     offs += 7;
+    if (offs >= 64) throw std::runtime_error("Varint too long");
     b = s.getByte();
   }
   val |= b << offs;
@@ -157,6 +170,7 @@ std::uint_least64_t serializer<std::uint_least64_t>::read(Deserializer& s) {
 }
 long serializer<long>::read(Deserializer& s) {
   const auto val = serializer<std::uint_least64_t>::read(s);
+  if (val == 1) return std::numeric_limits<long>::min();
   auto value = static_cast<long>(val >> 1);
   if (val & 1) value = -value;
   return value;
@@ -0,0 +1,495 @@
+#include "SharedMemory.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace Rapscallion {
+
+namespace {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared memory rings need lock-free atomics");
+
+constexpr uint32_t regionMagic = 0x52505331;
+constexpr size_t minRingBytes = 4096;
+// Sent with the handshake: an eventfd for data and one for space in each ring, then the memory.
+constexpr size_t handshakeFds = 5;
+
+// Positions only ever grow; a ring holds tail - head bytes, at position & (size - 1). The peer can
+// write anything to the region, so every position read from it is checked against the ring size
+// agreed at the handshake before it is used.
+struct Ring {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> readerWaiting;
+  std::atomic<uint32_t> writerWaiting;
+};
+
+// The start of the shared memory, followed by the data of both rings. Ring 0 carries what the
+// connecting side (side 0) writes, ring 1 what the accepting side writes.
+struct Region {
+  uint32_t magic;
+  uint64_t ringBytes;
+  std::atomic<uint32_t> closed[2];
+  Ring rings[2];
+};
+
+void check(bool ok, const char* what) {
+  if (!ok) throw std::system_error(errno, std::system_category(), what);
+}
+
+void signal(int fd) {
+  uint64_t one = 1;
+  if (::write(fd, &one, sizeof(one)) < 0) {}
+}
+
+void drain(int fd) {
+  uint64_t count;
+  if (::read(fd, &count, sizeof(count)) < 0) {}
+}
+
+struct Fd {
+  explicit Fd(int fd_ = -1) : fd(fd_) {}
+  ~Fd() { if (fd >= 0) ::close(fd); }
+  Fd(const Fd&) = delete;
+  Fd& operator=(const Fd&) = delete;
+  int release() { int result = fd; fd = -1; return result; }
+  int fd;
+};
+
+std::shared_ptr<void> map(int fd, size_t size) {
+  void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  check(base != MAP_FAILED, "mmap");
+  return std::shared_ptr<void>(base, [size](void* p){ ::munmap(p, size); });
+}
+
+// One side of a connection. Pending waits hold on to it, so it lives until they have completed.
+class Endpoint : public std::enable_shared_from_this<Endpoint> {
+public:
+  typedef Transport::Strand Strand;
+  typedef Transport::Handler Handler;
+
+  // fds are the four eventfds in handshake order; the endpoint owns them from here on. ringBytes is
+  // the ring size checked against the mapping, which the region's own copy may no longer match.
+  Endpoint(boost::asio::local::stream_protocol::socket socket, std::shared_ptr<void> memory, size_t ringBytes, int side, const int (&fds)[4], const SharedMemoryOptions& options)
+  : socket_(std::move(socket))
+  , memory_(std::move(memory))
+  , region_(static_cast<Region*>(memory_.get()))
+  , ringBytes_(ringBytes)
+  , side_(side)
+  , dataReady_(socket_.get_executor(), fds[1 - side])
+  , spaceReady_(socket_.get_executor(), fds[2 + side])
+  , peerData_(fds[side])
+  , peerSpace_(fds[2 + (1 - side)])
+  , poll_(options.poll)
+  {
+    uint8_t* data = reinterpret_cast<uint8_t*>(region_ + 1);
+    inData_ = data + (1 - side) * ringBytes_;
+    outData_ = data + side * ringBytes_;
+  }
+  ~Endpoint() {
+    ::close(peerData_);
+    ::close(peerSpace_);
+  }
+
+  // The peer never writes to the socket after the handshake, so it only becomes readable once the
+  // peer has closed it, possibly by exiting.
+  void watchPeer() {
+    auto self = shared_from_this();
+    socket_.async_wait(boost::asio::socket_base::wait_read, [self](const boost::system::error_code& error){
+      if (error == boost::asio::error::operation_aborted) return;
+      self->region_->closed[1 - self->side_].store(1, std::memory_order_release);
+      // Wakes our own waits; the lock keeps close() from closing the descriptors meanwhile.
+      std::lock_guard<std::mutex> l(self->closeMutex_);
+      if (self->closed_) return;
+      signal(self->dataReady_.native_handle());
+      signal(self->spaceReady_.native_handle());
+    });
+  }
+
+  boost::asio::any_io_executor executor() {
+    return socket_.get_executor();
+  }
+  // The path the connection was set up on, which names the SharedMemoryServer.
+  std::string peerName() {
+    boost::system::error_code error;
+    auto endpoint = socket_.remote_endpoint(error);
+    return error ? std::string() : localName(endpoint);
+  }
+
+  void readSome(boost::asio::mutable_buffer buffer, Strand strand, Handler handler) {
+    if (closed_) return complete(strand, handler, boost::asio::error::operation_aborted, 0);
+    const bool ended = peerClosed();
+    const size_t n = read(buffer);
+    if (corrupt_) return fail(strand, handler);
+    if (n > 0 || ended) {
+      polling_ = false;
+      if (n > 0) return complete(strand, handler, boost::system::error_code(), n);
+      return complete(strand, handler, boost::asio::error::eof, 0);
+    }
+    // Polling looks again from the back of the strand's queue, so the IO thread keeps running other
+    // handlers in between; they may well be the ones that produce what we are waiting for.
+    if (poll_.count() > 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (!polling_) {
+        polling_ = true;
+        pollDeadline_ = now + poll_;
+      }
+      if (now < pollDeadline_) {
+        auto self = shared_from_this();
+        boost::asio::post(strand, [self, buffer, strand, handler]{ self->readSome(buffer, strand, handler); });
+        return;
+      }
+      polling_ = false;
+    }
+
+    // Announce that we are going to sleep before looking once more, so a write that lands in between
+    // either is seen here or signals us.
+    Ring& ring = in();
+    ring.readerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.tail.load(std::memory_order_acquire) != ring.head.load(std::memory_order_relaxed) || peerClosed()) {
+      ring.readerWaiting.store(0, std::memory_order_relaxed);
+      return readSome(buffer, strand, std::move(handler));
+    }
+    auto self = shared_from_this();
+    dataReady_.async_wait(boost::asio::posix::descriptor_base::wait_read, boost::asio::bind_executor(strand,
+      [self, buffer, strand, handler](const boost::system::error_code& error) {
+        self->in().readerWaiting.store(0, std::memory_order_relaxed);
+        if (error) return handler(error, 0);
+        drain(self->dataReady_.native_handle());
+        self->readSome(buffer, strand, handler);
+      }
+    ));
+  }
+
+  void write(const std::vector<boost::asio::const_buffer>& buffers, Strand strand, Handler handler) {
+    if (closed_) return complete(strand, handler, boost::asio::error::operation_aborted, 0);
+    pending_ = buffers;
+    next_ = 0;
+    offset_ = 0;
+    written_ = 0;
+    writeHandler_ = std::move(handler);
+    continueWrite(strand);
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> l(closeMutex_);
+    if (closed_.exchange(true)) return;
+    region_->closed[side_].store(1, std::memory_order_release);
+    signal(peerData_);
+    signal(peerSpace_);
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    dataReady_.close(ignored);
+    spaceReady_.close(ignored);
+  }
+
+private:
+  Ring& in() { return region_->rings[1 - side_]; }
+  Ring& out() { return region_->rings[side_]; }
+  bool peerClosed() const { return region_->closed[1 - side_].load(std::memory_order_acquire) != 0; }
+
+  static void complete(Strand& strand, const Handler& handler, boost::system::error_code error, size_t transferred) {
+    boost::asio::post(strand, [handler, error, transferred]{ handler(error, transferred); });
+  }
+
+  // Closes the connection after the peer broke the ring's invariants.
+  void fail(Strand& strand, const Handler& handler) {
+    close();
+    complete(strand, handler, boost::system::errc::make_error_code(boost::system::errc::protocol_error), 0);
+  }
+
+  size_t read(boost::asio::mutable_buffer buffer) {
+    Ring& ring = in();
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    const uint64_t used = ring.tail.load(std::memory_order_acquire) - head;
+    if (used > ringBytes_) {
+      corrupt_ = true;
+      return 0;
+    }
+    const size_t n = std::min<uint64_t>(buffer.size(), used);
+    if (n == 0) return 0;
+    const size_t size = ringBytes_, at = head & (size - 1), first = std::min(n, size - at);
+    uint8_t* dest = static_cast<uint8_t*>(buffer.data());
+    memcpy(dest, inData_ + at, first);
+    memcpy(dest + first, inData_, n - first);
+    ring.head.store(head + n, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.writerWaiting.load(std::memory_order_relaxed)) signal(peerSpace_);
+    return n;
+  }
+
+  size_t write(const uint8_t* data, size_t length) {
+    Ring& ring = out();
+    const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    const size_t size = ringBytes_;
+    const uint64_t used = tail - ring.head.load(std::memory_order_acquire);
+    if (used > size) {
+      corrupt_ = true;
+      return 0;
+    }
+    const size_t n = std::min<uint64_t>(length, size - used);
+    if (n == 0) return 0;
+    const size_t at = tail & (size - 1), first = std::min(n, size - at);
+    memcpy(outData_ + at, data, first);
+    memcpy(outData_, data + first, n - first);
+    ring.tail.store(tail + n, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.readerWaiting.load(std::memory_order_relaxed)) signal(peerData_);
+    return n;
+  }
+
+  // Copies as much of the pending buffers as fits, and sleeps until there is room for the rest.
+  void continueWrite(Strand strand) {
+    for (;;) {
+      while (next_ < pending_.size()) {
+        const boost::asio::const_buffer& buffer = pending_[next_];
+        if (offset_ == buffer.size()) {
+          ++next_;
+          offset_ = 0;
+          continue;
+        }
+        if (peerClosed()) return finishWrite(strand, boost::asio::error::broken_pipe);
+        size_t n = write(static_cast<const uint8_t*>(buffer.data()) + offset_, buffer.size() - offset_);
+        if (corrupt_) {
+          close();
+          return finishWrite(strand, boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+        }
+        if (n == 0) break;
+        offset_ += n;
+        written_ += n;
+      }
+      if (next_ == pending_.size()) return finishWrite(strand, boost::system::error_code());
+
+      Ring& ring = out();
+      ring.writerWaiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ring.tail.load(std::memory_order_relaxed) - ring.head.load(std::memory_order_acquire) != ringBytes_ || peerClosed()) {
+        ring.writerWaiting.store(0, std::memory_order_relaxed);
+        continue;
+      }
+      auto self = shared_from_this();
+      spaceReady_.async_wait(boost::asio::posix::descriptor_base::wait_read, boost::asio::bind_executor(strand,
+        [self, strand](const boost::system::error_code& error) {
+          self->out().writerWaiting.store(0, std::memory_order_relaxed);
+          if (error) return self->finishWrite(strand, error);
+          drain(self->spaceReady_.native_handle());
+          self->continueWrite(strand);
+        }
+      ));
+      return;
+    }
+  }
+
+  void finishWrite(Strand strand, boost::system::error_code error) {
+    Handler handler;
+    handler.swap(writeHandler_);
+    pending_.clear();
+    complete(strand, handler, error, written_);
+  }
+
+  boost::asio::local::stream_protocol::socket socket_;
+  std::shared_ptr<void> memory_;
+  Region* region_;
+  const size_t ringBytes_;
+  const int side_;
+  uint8_t* inData_;
+  uint8_t* outData_;
+  boost::asio::posix::stream_descriptor dataReady_;
+  boost::asio::posix::stream_descriptor spaceReady_;
+  const int peerData_;
+  const int peerSpace_;
+  const std::chrono::microseconds poll_;
+  bool polling_ = false;
+  std::chrono::steady_clock::time_point pollDeadline_;
+  std::mutex closeMutex_;
+  std::atomic<bool> closed_{false};
+  // Set on the strand once the peer has left a ring in an impossible state.
+  bool corrupt_ = false;
+  std::vector<boost::asio::const_buffer> pending_;
+  size_t next_ = 0;
+  size_t offset_ = 0;
+  size_t written_ = 0;
+  Handler writeHandler_;
+};
+
+class SharedMemoryTransport : public Transport {
+public:
+  explicit SharedMemoryTransport(std::shared_ptr<Endpoint> endpoint)
+  : endpoint_(std::move(endpoint))
+  {
+    endpoint_->watchPeer();
+  }
+  ~SharedMemoryTransport() {
+    endpoint_->close();
+  }
+  boost::asio::any_io_executor executor() override {
+    return endpoint_->executor();
+  }
+  void readSome(boost::asio::mutable_buffer buffer, Strand& strand, Handler handler) override {
+    endpoint_->readSome(buffer, strand, std::move(handler));
+  }
+  void write(const std::vector<boost::asio::const_buffer>& buffers, Strand& strand, Handler handler) override {
+    endpoint_->write(buffers, strand, std::move(handler));
+  }
+  void close() override {
+    endpoint_->close();
+  }
+  std::string peerName() override {
+    return endpoint_->peerName();
+  }
+private:
+  std::shared_ptr<Endpoint> endpoint_;
+};
+
+size_t roundUpToPowerOfTwo(size_t size) {
+  size_t result = minRingBytes;
+  while (result < size) result *= 2;
+  return result;
+}
+
+// Reads the descriptors the connecting side sent; the socket is readable, so this does not block.
+std::unique_ptr<Transport> acceptShared(boost::asio::local::stream_protocol::socket socket, const SharedMemoryOptions& options) {
+  char byte;
+  iovec data = { &byte, 1 };
+  union {
+    cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int) * handshakeFds)];
+  } control;
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  check(::recvmsg(socket.native_handle(), &message, MSG_CMSG_CLOEXEC) >= 0, "recvmsg");
+  cmsghdr* header = CMSG_FIRSTHDR(&message);
+  if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+    throw std::runtime_error("Shared memory handshake carried no descriptors");
+  }
+  const size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  int fds[handshakeFds];
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * std::min(received, handshakeFds));
+  std::vector<std::unique_ptr<Fd>> owned;
+  for (size_t n = 0; n < std::min(received, handshakeFds); ++n) owned.emplace_back(new Fd(fds[n]));
+  if (received != handshakeFds || (message.msg_flags & MSG_CTRUNC)) {
+    throw std::runtime_error("Shared memory handshake carried the wrong descriptors");
+  }
+
+  // Without the seals, the peer could shrink the memory under our mapping.
+  const int seals = ::fcntl(fds[4], F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+    throw std::runtime_error("Shared memory region is not sealed");
+  }
+  struct stat info;
+  check(::fstat(fds[4], &info) == 0, "fstat");
+  const size_t mapped = size_t(info.st_size);
+  if (mapped < sizeof(Region)) throw std::runtime_error("Shared memory region is too small");
+  std::shared_ptr<void> memory = map(fds[4], mapped);
+  const Region* region = static_cast<const Region*>(memory.get());
+  const uint64_t ringBytes = region->ringBytes;
+  if (region->magic != regionMagic || ringBytes < minRingBytes || (ringBytes & (ringBytes - 1)) != 0 || (mapped - sizeof(Region)) / 2 < ringBytes) {
+    throw std::runtime_error("Shared memory region is malformed");
+  }
+  int events[4];
+  for (size_t n = 0; n < 4; ++n) events[n] = owned[n]->release();
+  auto endpoint = std::make_shared<Endpoint>(std::move(socket), std::move(memory), ringBytes, 1, events, options);
+  return std::unique_ptr<Transport>(new SharedMemoryTransport(std::move(endpoint)));
+}
+
+}
+
+std::unique_ptr<Transport> connectShared(boost::asio::io_service& io_service, const std::string& path, const SharedMemoryOptions& options) {
+  boost::asio::local::stream_protocol::socket socket(io_service);
+  socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+
+  const size_t ringBytes = roundUpToPowerOfTwo(options.ringBytes);
+  const size_t size = sizeof(Region) + 2 * ringBytes;
+  Fd memory(::memfd_create("rapscallion", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  check(memory.fd >= 0, "memfd_create");
+  check(::ftruncate(memory.fd, size) == 0, "ftruncate");
+  check(::fcntl(memory.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0, "fcntl");
+  std::shared_ptr<void> mapping = map(memory.fd, size);
+  Region* region = new (mapping.get()) Region;
+  region->magic = regionMagic;
+  region->ringBytes = ringBytes;
+
+  Fd events[4];
+  for (auto& event : events) {
+    event.fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    check(event.fd >= 0, "eventfd");
+  }
+  int fds[handshakeFds] = { events[0].fd, events[1].fd, events[2].fd, events[3].fd, memory.fd };
+  char byte = 0;
+  iovec data = { &byte, 1 };
+  union {
+    cmsghdr header;
+    char space[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+  check(::sendmsg(socket.native_handle(), &message, MSG_NOSIGNAL) == 1, "sendmsg");
+
+  int owned[4];
+  for (size_t n = 0; n < 4; ++n) owned[n] = events[n].release();
+  auto endpoint = std::make_shared<Endpoint>(std::move(socket), std::move(mapping), ringBytes, 0, owned, options);
+  return std::unique_ptr<Transport>(new SharedMemoryTransport(std::move(endpoint)));
+}
+
+SharedMemoryServer::SharedMemoryServer(boost::asio::io_service& io_service, const std::string& path, const SharedMemoryOptions& options, std::function<void(std::unique_ptr<Transport>)> onConnect)
+: acceptor_(io_service, boost::asio::local::stream_protocol::endpoint(path))
+, options_(options)
+, onConnect_(std::move(onConnect))
+{
+  accept_one();
+}
+
+void SharedMemoryServer::accept_one() {
+  auto socket = std::make_shared<boost::asio::local::stream_protocol::socket>(acceptor_.get_executor());
+  acceptor_.async_accept(*socket, [this, socket](const boost::system::error_code& ec) {
+    if (!ec) {
+      handshake(socket);
+      accept_one();
+    }
+  });
+}
+
+void SharedMemoryServer::handshake(std::shared_ptr<boost::asio::local::stream_protocol::socket> socket) {
+  socket->async_wait(boost::asio::socket_base::wait_read, [this, socket](const boost::system::error_code& ec) {
+    if (ec) return;
+    std::unique_ptr<Transport> transport;
+    try {
+      transport = acceptShared(std::move(*socket), options_);
+    } catch (const std::exception&) {
+      // A peer that does not follow the handshake is dropped.
+      return;
+    }
+    onConnect_(std::move(transport));
+  });
+}
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Serializer.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+
+namespace Rapscallion {
+namespace reference {
+
+// The floating point encoding as it was written before serializer<double> and serializer<float> read
+// the IEEE-754 bits directly: classified with fpclassify, split with frexp and rebuilt with ldexp,
+// with float widened to double. The tests check that the wire format and the decoded values have not
+// changed; the benchmark compares the speed of both.
+enum Type {
+  NaN,
+  Infinity,
+  Zero,
+  Normal
+};
+
+inline std::uint_least64_t bitreverse(std::uint_least64_t b) {
+  b = ((b & 0xFFFFFFFF00000000ULL) >> 32) | ((b & 0x00000000FFFFFFFFULL) << 32);
+  b = ((b & 0xFFFF0000FFFF0000ULL) >> 16) | ((b & 0x0000FFFF0000FFFFULL) << 16);
+  b = ((b & 0xFF00FF00FF00FF00ULL) >>  8) | ((b & 0x00FF00FF00FF00FFULL) <<  8);
+  b = ((b & 0xF0F0F0F0F0F0F0F0ULL) >>  4) | ((b & 0x0F0F0F0F0F0F0F0FULL) <<  4);
+  b = ((b & 0xCCCCCCCCCCCCCCCCULL) >>  2) | ((b & 0x3333333333333333ULL) <<  2);
+  b = ((b & 0xAAAAAAAAAAAAAAAAULL) >>  1) | ((b & 0x5555555555555555ULL) <<  1);
+  return b;
+}
+
+inline void writeDouble(Serializer& s, double b) {
+  const bool is_negative = !!std::signbit(b);
+  switch (std::fpclassify(b)) {
+    case FP_ZERO:
+      serializer<long>::write(s, is_negative ? -Zero : Zero);
+      break;
+    case FP_INFINITE:
+      serializer<long>::write(s, is_negative ? -Infinity : Infinity);
+      break;
+    case FP_NAN:
+      serializer<long>::write(s, NaN);
+      break;
+    default: {
+      int exponent;
+      const std::uint_least64_t fraction = std::ldexp(std::abs(std::frexp(b, &exponent)), 64);
+      exponent = exponent * 2 + (exponent < 0 ? -is_negative : is_negative);
+      serializer<long>::write(s, exponent < 0 ? exponent - 2 : exponent + 3);
+      serializer<std::uint_least64_t>::write(s, bitreverse(fraction));
+      break;
+    }
+  }
+}
+
+inline double readDouble(Deserializer& s) {
+  long exponent = serializer<long>::read(s);
+  if (exponent < 3 && exponent >= -2) {
+    const bool is_negative = exponent < 0;
+    switch (std::abs(exponent)) {
+      case Zero:
+        return is_negative ? -0.0 : 0.0;
+      case Infinity:
+        return is_negative ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+      default:
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+  }
+  exponent = (exponent < 0) ? exponent + 2 : exponent - 3;
+  const bool is_negative = (exponent % 2) != 0;
+  exponent /= 2;
+  const std::uint_least64_t fraction = bitreverse(serializer<std::uint_least64_t>::read(s));
+  return (is_negative ? -1.0 : 1.0) * std::ldexp(static_cast<double>(fraction), int(exponent - 64));
+}
+
+inline void writeFloat(Serializer& s, float b) {
+  writeDouble(s, b);
+}
+
+inline float readFloat(Deserializer& s) {
+  return static_cast<float>(readDouble(s));
+}
+
+}
+}
@@ -0,0 +1,63 @@
+#include <catch/catch.hpp>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <Compression.h>
+
+namespace Rapscallion {
+namespace test {
+
+std::vector<uint8_t> squeeze(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> packed;
+  lz::compress(data.data(), data.size(), packed);
+  return packed;
+}
+
+std::vector<uint8_t> unsqueeze(const std::vector<uint8_t>& packed, size_t size) {
+  std::vector<uint8_t> data(size);
+  lz::decompress(packed.data(), packed.size(), data.data(), size);
+  return data;
+}
+
+}
+}
+
+SCENARIO("Compressing with the built-in LZ codec", "[compression]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+
+  GIVEN("inputs of every size up to a few hundred bytes") {
+    std::mt19937 random(7);
+    THEN("repetitive and random data both come back unchanged") {
+      for (size_t size = 0; size < 300; ++size) {
+        std::vector<uint8_t> repetitive(size), noise(size);
+        for (size_t n = 0; n < size; ++n) {
+          repetitive[n] = static_cast<uint8_t>("abcabcabd"[n % 9]);
+          noise[n] = static_cast<uint8_t>(random());
+        }
+        INFO(size);
+        CHECK(unsqueeze(squeeze(repetitive), size) == repetitive);
+        CHECK(unsqueeze(squeeze(noise), size) == noise);
+      }
+    }
+  }
+  GIVEN("a large text made of a few repeated words") {
+    const char* words[] = { "alpha ", "beta ", "gamma ", "delta ", "epsilon " };
+    std::mt19937 random(11);
+    std::string text;
+    while (text.size() < 1024 * 1024) text += words[random() % 5];
+    std::vector<uint8_t> data(text.begin(), text.end());
+    std::vector<uint8_t> packed = squeeze(data);
+    THEN("it compresses well and comes back unchanged") {
+      CHECK(packed.size() < data.size() / 2);
+      CHECK(unsqueeze(packed, data.size()) == data);
+    }
+    THEN("damaged input is rejected instead of read out of bounds") {
+      CHECK_THROWS(unsqueeze(std::vector<uint8_t>(packed.begin(), packed.begin() + packed.size() / 2), data.size()));
+      CHECK_THROWS(unsqueeze(packed, data.size() - 1));
+      // A match that reaches back before the start of the output.
+      CHECK_THROWS(unsqueeze({ 0x10, 'a', 0x02, 0x00 }, 5));
+    }
+  }
+}
@@ -0,0 +1,141 @@
+#include <catch/catch.hpp>
+#include <string>
+#include <vector>
+#include <Borrowed.h>
+#include <Serializer.h>
+
+namespace Rapscallion {
+namespace test {
+
+std::vector<uint8_t> frameOf(const std::string& text) {
+  Serializer s;
+  serializer<std::string>::write(s, text);
+  return std::vector<uint8_t>(s.data(), s.data() + s.size());
+}
+
+std::vector<std::string> drain(Deserializer& d) {
+  std::vector<std::string> frames;
+  while (d.HasFullPacket()) {
+    frames.push_back(serializer<std::string>::read(d));
+    d.RemovePacket();
+  }
+  return frames;
+}
+
+}
+}
+
+SCENARIO("Splitting received bytes into frames", "[deserializer]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+
+  GIVEN("a stream of frames of varying sizes") {
+    std::vector<std::string> texts;
+    std::vector<uint8_t> stream;
+    for (size_t n = 0; n < 200; ++n) {
+      texts.push_back(std::string(n * n, static_cast<char>('a' + n % 26)));
+      const auto frame = frameOf(texts.back());
+      stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+
+    WHEN("it arrives in a single read") {
+      Deserializer d;
+      d.AddBytes(stream.data(), stream.size());
+      THEN("every frame is found in order") {
+        CHECK(drain(d) == texts);
+      }
+    }
+    WHEN("it arrives in reads that split frames and length prefixes") {
+      Deserializer d;
+      std::vector<std::string> received;
+      for (size_t offset = 0, step = 1; offset < stream.size(); offset += step, step = step * 3 % 4099) {
+        const size_t length = std::min(step, stream.size() - offset);
+        uint8_t* space = d.prepare();
+        REQUIRE(d.capacity() >= length);
+        std::copy(stream.begin() + offset, stream.begin() + offset + length, space);
+        d.commit(length);
+        const auto frames = drain(d);
+        received.insert(received.end(), frames.begin(), frames.end());
+      }
+      THEN("every frame is found in order") {
+        CHECK(received == texts);
+      }
+    }
+  }
+}
+
+SCENARIO("A pinned frame outlives later reads", "[deserializer]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+
+  GIVEN("a view borrowed from a pinned frame") {
+    const std::string text(1000, 'p');
+    Deserializer d;
+    const auto first = frameOf(text);
+    d.AddBytes(first.data(), first.size());
+    REQUIRE(d.HasFullPacket());
+    boost::string_view view = serializer<boost::string_view>::read(d);
+    std::shared_ptr<const void> pin = d.pin();
+    d.RemovePacket();
+
+    WHEN("many more frames are received and removed") {
+      std::vector<std::string> texts;
+      for (size_t n = 0; n < 100; ++n) {
+        texts.push_back(std::string(n * 50, static_cast<char>('a' + n % 26)));
+        const auto frame = frameOf(texts.back());
+        d.AddBytes(frame.data(), frame.size());
+      }
+      THEN("they are read correctly and the view still shows its frame") {
+        CHECK(drain(d) == texts);
+        CHECK(view == text);
+      }
+    }
+  }
+}
+
+SCENARIO("Received bytes that cannot be a frame are rejected", "[deserializer]") {
+  using namespace Rapscallion;
+
+  GIVEN("a deserializer with a frame size limit") {
+    Deserializer d;
+    d.setMaxFrameSize(1024);
+
+    WHEN("a length prefix announces a larger payload") {
+      // 5 << 21 bytes, most significant group first.
+      const std::vector<uint8_t> prefix = { 0x85, 0x80, 0x80, 0x00 };
+      d.AddBytes(prefix.data(), prefix.size());
+      THEN("no room is made for it") {
+        CHECK_THROWS_AS(d.HasFullPacket(), FrameError);
+        d.prepare();
+        CHECK(d.capacity() < (size_t(5) << 21));
+      }
+    }
+    WHEN("a length prefix is longer than any a serializer writes") {
+      const std::vector<uint8_t> prefix(Deserializer::maxPrefixSize + 1, 0x80);
+      d.AddBytes(prefix.data(), prefix.size());
+      THEN("it is rejected instead of being read further") {
+        CHECK_THROWS_AS(d.HasFullPacket(), FrameError);
+      }
+    }
+    WHEN("a borrowed value announces a length that wraps around the read position") {
+      THEN("it is rejected") {
+        for (uint64_t k = 0; k < 32; ++k) {
+          Serializer s;
+          serializer<std::uint_least64_t>::write(s, UINT64_MAX - k);
+          s.addBytes("payload", 7);
+          Deserializer text(s), bytes(s);
+          CHECK_THROWS_AS(serializer<boost::string_view>::read(text), std::runtime_error);
+          CHECK_THROWS_AS(serializer<byte_span>::read(bytes), std::runtime_error);
+        }
+      }
+    }
+    WHEN("a frame fits the limit") {
+      Serializer s;
+      s.addBytes(std::string(1024, 'x').data(), 1024);
+      d.AddBytes(s.data(), s.size());
+      THEN("it is received") {
+        CHECK(d.HasFullPacket());
+      }
+    }
+  }
+}
@@ -0,0 +1,1343 @@
+#include <catch/catch.hpp>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <Proxy.h>
+#include <Dispatcher.h>
+#include <MetricsService.h>
+#include <RpcHost.h>
+#include <RpcClient.h>
+#include <Borrowed.h>
+#include <SharedMemory.h>
+
+namespace Rapscallion {
+namespace test {
+
+struct EchoDispatcher;
+struct EchoProxy;
+
+struct Echo {
+  typedef EchoDispatcher Dispatcher;
+  typedef EchoProxy Proxy;
+  virtual future<std::string> echo(std::string text) = 0;
+};
+
+struct EchoDispatcher : public DispatcherBase<Echo> {
+  EchoDispatcher(Echo* inst)
+  : DispatcherBase<Echo>(inst)
+  {
+    DISPATCH_FUNC1(echo, std::string, std::string);
+  }
+};
+
+struct EchoProxy : public ProxyBase<Echo> {
+  EchoProxy(RpcClient& conn)
+  : ProxyBase<Echo>(conn)
+  {}
+  PROXY_FUNC1(echo, std::string, std::string)
+  // Calls a method that the host's Echo does not have.
+  future<std::string> missing(std::string text) {
+    return call(PROXY_METHOD_REF(missing), &Interface::echo, text);
+  }
+};
+
+struct MissingProxy;
+
+// An interface no host registers.
+struct Missing {
+  typedef MissingProxy Proxy;
+  virtual future<int> nothing() = 0;
+};
+
+struct MissingProxy : public ProxyBase<Missing> {
+  MissingProxy(RpcClient& conn)
+  : ProxyBase<Missing>(conn)
+  {}
+  PROXY_FUNC0(nothing, int)
+};
+
+// Fails for the texts "throw" and "fail", by throwing and by returning the error respectively.
+struct EchoImpl : Echo {
+  future<std::string> echo(std::string text) override {
+    if (text == "throw") throw std::invalid_argument("Cannot echo that");
+    if (text == "fail") return boost::make_exceptional_future<std::string>(std::runtime_error("Echo failed"));
+    return boost::make_ready_future<std::string>(text);
+  }
+};
+
+struct WideDispatcher;
+struct WideProxy;
+
+struct Wide {
+  typedef WideDispatcher Dispatcher;
+  typedef WideProxy Proxy;
+  virtual future<std::string> join(const std::string& a, std::string b, int c, long d, bool e, double f, std::vector<std::string> g, const std::string& h, int i) = 0;
+  virtual future<void> touch() = 0;
+};
+
+struct WideDispatcher : public DispatcherBase<Wide> {
+  WideDispatcher(Wide* inst)
+  : DispatcherBase<Wide>(inst)
+  {
+    DISPATCH_FUNC(join);
+    DISPATCH_FUNC(touch);
+  }
+};
+
+struct WideProxy : public ProxyBase<Wide> {
+  WideProxy(RpcClient& conn)
+  : ProxyBase<Wide>(conn)
+  {}
+  future<std::string> join(const std::string& a, std::string b, int c, long d, bool e, double f, std::vector<std::string> g, const std::string& h, int i) override {
+    return call(PROXY_METHOD(join), a, b, c, d, e, f, g, h, i);
+  }
+  future<void> touch() override {
+    return call(PROXY_METHOD(touch));
+  }
+};
+
+struct WideImpl : Wide {
+  future<std::string> join(const std::string& a, std::string b, int c, long d, bool e, double f, std::vector<std::string> g, const std::string& h, int i) override {
+    std::string joined = a + b + std::to_string(c) + std::to_string(d) + (e ? "y" : "n") + std::to_string(f);
+    for (auto& s : g) joined += s;
+    joined += h + std::to_string(i);
+    return boost::make_ready_future<std::string>(joined);
+  }
+  future<void> touch() override {
+    toucher = std::this_thread::get_id();
+    ++touched;
+    return boost::make_ready_future();
+  }
+  std::atomic<int> touched{0};
+  std::thread::id toucher;
+};
+
+struct LookupDispatcher;
+struct LookupProxy;
+
+struct Lookup {
+  typedef LookupDispatcher Dispatcher;
+  typedef LookupProxy Proxy;
+  virtual future<int> idOf(std::string name) = 0;
+  virtual future<std::string> nameOf(future<int> id) = 0;
+};
+
+struct LookupDispatcher : public DispatcherBase<Lookup> {
+  LookupDispatcher(Lookup* inst)
+  : DispatcherBase<Lookup>(inst)
+  {
+    DISPATCH_FUNC(idOf);
+    DISPATCH_FUNC(nameOf);
+  }
+};
+
+struct LookupProxy : public ProxyBase<Lookup> {
+  LookupProxy(RpcClient& conn)
+  : ProxyBase<Lookup>(conn)
+  {}
+  future<int> idOf(std::string name) override {
+    return call(PROXY_METHOD(idOf), name);
+  }
+  future<std::string> nameOf(future<int> id) override {
+    return call(PROXY_METHOD(nameOf), id);
+  }
+};
+
+// idOf only completes once the test calls release().
+struct LookupImpl : Lookup {
+  future<int> idOf(std::string) override {
+    return id.get_future();
+  }
+  future<std::string> nameOf(future<int> value) override {
+    ++named;
+    std::string name;
+    try {
+      name = "name" + std::to_string(value.get());
+    } catch (std::exception& e) {
+      name = e.what();
+    }
+    return boost::make_ready_future<std::string>(name);
+  }
+  void release(int value) { id.set_value(value); }
+  promise<int> id;
+  std::atomic<int> named{0};
+};
+
+struct NumbersDispatcher;
+struct NumbersProxy;
+
+struct Numbers {
+  typedef NumbersDispatcher Dispatcher;
+  typedef NumbersProxy Proxy;
+  virtual future<stream<int>> range(int count, int chunkSize) = 0;
+  virtual future<long> sum(stream<int> values) = 0;
+  virtual future<stream<int>> broken() = 0;
+};
+
+struct NumbersDispatcher : public DispatcherBase<Numbers> {
+  NumbersDispatcher(Numbers* inst)
+  : DispatcherBase<Numbers>(inst)
+  {
+    DISPATCH_FUNC(range);
+    DISPATCH_FUNC(sum);
+    DISPATCH_FUNC(broken);
+  }
+};
+
+struct NumbersProxy : public ProxyBase<Numbers> {
+  NumbersProxy(RpcClient& conn)
+  : ProxyBase<Numbers>(conn)
+  {}
+  future<stream<int>> range(int count, int chunkSize) override {
+    return call(PROXY_METHOD(range), count, chunkSize);
+  }
+  future<long> sum(stream<int> values) override {
+    return call(PROXY_METHOD(sum), values);
+  }
+  future<stream<int>> broken() override {
+    return call(PROXY_METHOD(broken));
+  }
+};
+
+// range() writes its chunks whenever its stream has room, and counts how many it has written.
+struct NumbersImpl : Numbers {
+  future<stream<int>> range(int count, int chunkSize) override {
+    stream<int> values(2);
+    produce(values, 0, count, chunkSize);
+    return boost::make_ready_future(values);
+  }
+  future<long> sum(stream<int> values) override {
+    auto total = std::make_shared<long>(0);
+    return values.for_each([total](const std::vector<int>& chunk){
+      for (int value : chunk) *total += value;
+    }).then(boost::launch::sync, [total](boost::future<void> done){
+      done.get();
+      return *total;
+    });
+  }
+  future<stream<int>> broken() override {
+    stream<int> values;
+    values.write({ 1, 2, 3 });
+    values.fail(boost::copy_exception(std::runtime_error("Out of numbers")));
+    return boost::make_ready_future(values);
+  }
+  void produce(stream<int> values, int first, int count, int chunkSize) {
+    while (first < count) {
+      std::vector<int> chunk;
+      for (int n = first; n < count && n < first + chunkSize; ++n) chunk.push_back(n);
+      first += chunkSize;
+      ++produced;
+      future<void> space = values.write(std::move(chunk));
+      if (!space.is_ready()) {
+        space.then(boost::launch::sync, [this, values, first, count, chunkSize](boost::future<void>){
+          produce(values, first, count, chunkSize);
+        });
+        return;
+      }
+    }
+    values.close();
+  }
+  std::atomic<int> produced{0};
+};
+
+struct KeysDispatcher;
+struct KeysProxy;
+
+struct Keys {
+  typedef KeysDispatcher Dispatcher;
+  typedef KeysProxy Proxy;
+  virtual future<uint64_t> digest(boost::string_view key, byte_span salt) = 0;
+};
+
+struct KeysDispatcher : public DispatcherBase<Keys> {
+  KeysDispatcher(Keys* inst)
+  : DispatcherBase<Keys>(inst)
+  {
+    DISPATCH_FUNC(digest);
+  }
+};
+
+struct KeysProxy : public ProxyBase<Keys> {
+  KeysProxy(RpcClient& conn)
+  : ProxyBase<Keys>(conn)
+  {}
+  future<uint64_t> digest(boost::string_view key, byte_span salt) override {
+    return call(PROXY_METHOD(digest), key, salt);
+  }
+};
+
+// FNV-1a over the key and then the salt.
+uint64_t digestOf(boost::string_view key, byte_span salt) {
+  uint64_t hash = 14695981039346656037u;
+  for (char c : key) hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211u;
+  for (uint8_t b : salt) hash = (hash ^ b) * 1099511628211u;
+  return hash;
+}
+
+struct KeysImpl : Keys {
+  future<uint64_t> digest(boost::string_view key, byte_span salt) override {
+    return boost::make_ready_future<uint64_t>(digestOf(key, salt));
+  }
+};
+
+// Runs an RpcHost on an ephemeral loopback port, with a connected RpcClient.
+struct Loopback {
+  Loopback(Executor* executor = nullptr)
+    : host(io_service, 0)
+    , thread([this]{ io_service.run(); })
+    , client(connect())
+  {
+    host.Register(&impl, executor);
+    host.Register(&wide, executor);
+    host.Register(&lookup, executor);
+    host.Register(&numbers, executor);
+    host.Register(&keys, executor);
+  }
+  ~Loopback() {
+    io_service.stop();
+    thread.join();
+  }
+  boost::asio::ip::tcp::socket connect() {
+    boost::asio::ip::tcp::socket socket(io_service);
+    socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), host.port()));
+    return socket;
+  }
+  boost::asio::io_service io_service;
+  EchoImpl impl;
+  WideImpl wide;
+  LookupImpl lookup;
+  NumbersImpl numbers;
+  KeysImpl keys;
+  RpcHost host;
+  std::thread thread;
+  RpcClient client;
+};
+
+}
+}
+
+SCENARIO("Calls round-trip over a loopback connection", "[loopback]") {
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Echo") {
+    Loopback loopback;
+    Echo* echo = loopback.client.Get<Echo>();
+
+    WHEN("we make a small call") {
+      THEN("the reply carries the argument back") {
+        CHECK(echo->echo("hello").get() == "hello");
+      }
+    }
+    WHEN("the argument and reply are much larger than a read buffer") {
+      std::string large(1024 * 1024, 'x');
+      for (size_t n = 0; n < large.size(); n += 7) large[n] = static_cast<char>('a' + n % 26);
+      THEN("the reply carries the argument back") {
+        CHECK(echo->echo(large).get() == large);
+      }
+    }
+    WHEN("many calls are in flight at once") {
+      std::vector<future<std::string>> replies;
+      for (int n = 0; n < 1000; ++n) {
+        replies.push_back(echo->echo(std::to_string(n)));
+      }
+      THEN("every reply matches its own request") {
+        for (int n = 0; n < 1000; ++n) {
+          CHECK(replies[n].get() == std::to_string(n));
+        }
+      }
+      THEN("the buffers of written calls are kept for reuse") {
+        replies.back().wait();
+        CHECK(loopback.client.framePool().acquire().capacity() > 0);
+      }
+    }
+    WHEN("we call methods with many arguments or without a result") {
+      Wide* wide = loopback.client.Get<Wide>();
+      THEN("all arguments arrive in order") {
+        CHECK(wide->join("a", "b", 1, -2, true, 0.5, {"x", "y"}, "h", 9).get() == "ab1-2y0.500000xyh9");
+      }
+      THEN("a void call completes once the handler has run") {
+        wide->touch().get();
+        CHECK(loopback.wide.touched == 1);
+      }
+    }
+    WHEN("several threads make calls on the same proxy") {
+      std::atomic<int> mismatches(0);
+      std::vector<std::thread> callers;
+      for (int t = 0; t < 8; ++t) {
+        callers.emplace_back([echo, t, &mismatches]{
+          for (int n = 0; n < 200; ++n) {
+            const std::string text = std::to_string(t) + ":" + std::to_string(n);
+            if (echo->echo(text).get() != text) ++mismatches;
+          }
+        });
+      }
+      for (auto& caller : callers) caller.join();
+      THEN("every reply matches its own request") {
+        CHECK(mismatches == 0);
+      }
+    }
+    WHEN("the host runs on several threads and serves several clients") {
+      loopback.host.run(3);
+      std::atomic<int> mismatches(0);
+      std::vector<std::thread> callers;
+      for (int t = 0; t < 4; ++t) {
+        callers.emplace_back([&loopback, t, &mismatches]{
+          Rapscallion::RpcClient client(loopback.connect());
+          Echo* own = client.Get<Echo>();
+          std::vector<future<std::string>> replies;
+          for (int n = 0; n < 200; ++n) {
+            replies.push_back(own->echo(std::to_string(t) + ":" + std::to_string(n)));
+          }
+          for (int n = 0; n < 200; ++n) {
+            if (replies[n].get() != std::to_string(t) + ":" + std::to_string(n)) ++mismatches;
+          }
+        });
+      }
+      for (auto& caller : callers) caller.join();
+      THEN("every reply matches its own request") {
+        CHECK(mismatches == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("A call can take the future of an earlier call as its argument", "[loopback]") {
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Lookup") {
+    Loopback loopback;
+    Lookup* lookup = loopback.client.Get<Lookup>();
+    lookup->nameOf(boost::make_ready_future(0)).get();
+
+    WHEN("the earlier call has not completed yet") {
+      future<std::string> name = lookup->nameOf(lookup->idOf("x"));
+      THEN("the call is sent without waiting and runs once the earlier result is there") {
+        CHECK(!name.is_ready());
+        loopback.lookup.release(42);
+        CHECK(name.get() == "name42");
+      }
+    }
+    WHEN("the argument is a local future") {
+      promise<int> local;
+      local.set_exception(std::runtime_error("no such id"));
+      THEN("its value or error is sent along") {
+        CHECK(lookup->nameOf(boost::make_ready_future(7)).get() == "name7");
+        CHECK(lookup->nameOf(local.get_future()).get() == "no such id");
+      }
+    }
+    WHEN("a continuation on the IO thread passes a local future that is not ready") {
+      promise<int> local;
+      future<std::string> name;
+      future<void> chained = lookup->idOf("x").then(boost::launch::sync, [&](boost::future<int>) {
+        name = lookup->nameOf(local.get_future());
+      });
+      THEN("the argument is sent as failed instead of being waited for") {
+        loopback.lookup.release(1);
+        chained.get();
+        CHECK(name.get() == "Future argument not ready on an IO thread");
+      }
+    }
+  }
+}
+
+SCENARIO("A call that misses its deadline fails and is cancelled on the host", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Lookup") {
+    Loopback loopback;
+    Lookup* lookup = loopback.client.Get<Lookup>();
+    lookup->nameOf(boost::make_ready_future(0)).get();
+
+    WHEN("a call waiting for an earlier result passes its deadline") {
+      future<std::string> name;
+      {
+        RpcClient::Deadline deadline(loopback.client, std::chrono::milliseconds(20));
+        name = lookup->nameOf(lookup->idOf("x"));
+      }
+      THEN("it fails, and never runs") {
+        CHECK_THROWS_WITH(name.get(), "Deadline exceeded");
+        // This call follows the cancels on the same connection.
+        CHECK(lookup->nameOf(boost::make_ready_future(1)).get() == "name1");
+        const int named = loopback.lookup.named;
+        loopback.lookup.release(42);
+        CHECK(lookup->nameOf(boost::make_ready_future(2)).get() == "name2");
+        CHECK(loopback.lookup.named == named + 1);
+      }
+    }
+    WHEN("the client has a timeout, and a call answers in time") {
+      loopback.client.setTimeout(std::chrono::seconds(10));
+      THEN("it succeeds") {
+        CHECK(lookup->nameOf(boost::make_ready_future(3)).get() == "name3");
+      }
+    }
+    WHEN("the client has a short timeout") {
+      loopback.client.setTimeout(std::chrono::milliseconds(20));
+      THEN("calls without a deadline of their own fail once it has passed") {
+        CHECK_THROWS_WITH(lookup->idOf("x").get(), "Deadline exceeded");
+        loopback.lookup.release(0);
+      }
+    }
+    WHEN("a client is destroyed while its timers are armed") {
+      {
+        RpcClient other(loopback.connect());
+        LazyOptions options;
+        options.maxDelay = std::chrono::milliseconds(10);
+        other.setLazy(true, options);
+        other.setTimeout(std::chrono::milliseconds(10));
+        other.Get<Echo>()->echo("a");
+      }
+      THEN("the timers do not fire into it") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        CHECK(lookup->nameOf(boost::make_ready_future(4)).get() == "name4");
+      }
+    }
+  }
+}
+
+SCENARIO("A client can limit the calls it has in flight", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client allowed one call in flight") {
+    Loopback loopback;
+    Lookup* lookup = loopback.client.Get<Lookup>();
+    Echo* echo = loopback.client.Get<Echo>();
+    CallLimits limits;
+    limits.maxCalls = 1;
+
+    WHEN("that call is waiting for its result, and further calls fail fast") {
+      limits.overflow = CallLimits::FailFast;
+      loopback.client.setLimits(limits);
+      future<int> id = lookup->idOf("x");
+      THEN("a new call fails without being sent") {
+        CHECK_THROWS_WITH(echo->echo("a").get(), "Too many calls in flight");
+        loopback.lookup.release(1);
+        CHECK(id.get() == 1);
+        CHECK(echo->echo("b").get() == "b");
+      }
+    }
+    WHEN("that call is waiting for its result, and a call with a stream argument fails fast") {
+      limits.overflow = CallLimits::FailFast;
+      loopback.client.setLimits(limits);
+      Numbers* numbers = loopback.client.Get<Numbers>();
+      future<int> id = lookup->idOf("x");
+      stream<int> rejected;
+      future<long> total = numbers->sum(rejected);
+      THEN("its stream is not left to be sent with a later call") {
+        CHECK_THROWS_WITH(total.get(), "Too many calls in flight");
+        CHECK(!StreamTable::hasPending());
+        loopback.lookup.release(1);
+        CHECK(id.get() == 1);
+        stream<int> values;
+        future<long> sum = numbers->sum(values);
+        values.write(std::vector<int>({ 1, 2, 3 })).wait();
+        values.close();
+        CHECK(sum.get() == 6);
+      }
+    }
+    WHEN("that call is waiting for its result, and further calls are deferred") {
+      limits.overflow = CallLimits::Defer;
+      loopback.client.setLimits(limits);
+      future<int> id = lookup->idOf("x");
+      future<std::string> first = echo->echo("a");
+      future<std::string> second = echo->echo("b");
+      THEN("they are sent in order once the first call completes") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        CHECK(!first.is_ready());
+        CHECK(loopback.client.limiter()->outstanding() == 1);
+        loopback.lookup.release(1);
+        CHECK(id.get() == 1);
+        CHECK(first.get() == "a");
+        CHECK(second.get() == "b");
+        CHECK(loopback.client.limiter()->outstanding() == 0);
+      }
+    }
+    WHEN("that call is waiting for its result, and a deferred call's future is dropped") {
+      limits.overflow = CallLimits::Defer;
+      loopback.client.setLimits(limits);
+      future<int> id = lookup->idOf("x");
+      const int named = loopback.lookup.named;
+      lookup->nameOf(boost::make_ready_future(1));
+      THEN("the call is still sent once there is room") {
+        loopback.lookup.release(1);
+        CHECK(id.get() == 1);
+        CHECK(lookup->nameOf(boost::make_ready_future(2)).get() == "name2");
+        CHECK(loopback.lookup.named == named + 2);
+      }
+    }
+    WHEN("that call is waiting for its result, and further calls wait") {
+      loopback.client.setLimits(limits);
+      future<int> id = lookup->idOf("x");
+      std::atomic<bool> sent{false};
+      std::string reply;
+      std::thread caller([&]{
+        future<std::string> f = echo->echo("a");
+        sent = true;
+        reply = f.get();
+      });
+      THEN("the caller blocks until the first call completes") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        CHECK(!sent);
+        loopback.lookup.release(1);
+        caller.join();
+        CHECK(sent);
+        CHECK(reply == "a");
+      }
+    }
+  }
+}
+
+SCENARIO("A proxy keeps a bounded number of calls outstanding", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a lazy client whose proxies hold at most 128 calls") {
+    Loopback loopback;
+    LazyOptions options;
+    options.maxDelay = std::chrono::hours(1);
+    options.maxQueuedBytes = 1024 * 1024;
+    loopback.client.setLazy(true, options);
+    loopback.client.setRequestCapacity(100);
+    Echo* echo = loopback.client.Get<Echo>();
+
+    WHEN("the interface is asked for again") {
+      THEN("the same proxy is returned") {
+        CHECK(loopback.client.Get<Echo>() == echo);
+      }
+    }
+    WHEN("as many calls as it holds are queued") {
+      std::vector<future<std::string>> replies;
+      for (size_t n = 0; n < 128; ++n) {
+        replies.push_back(echo->echo(std::to_string(n)));
+      }
+      THEN("one more is refused, and the others complete") {
+        CHECK_THROWS_WITH(echo->echo("x"), "Too many outstanding requests");
+        loopback.client.Flush();
+        for (size_t n = 0; n < replies.size(); ++n) {
+          CHECK(replies[n].get() == std::to_string(n));
+        }
+        CHECK(echo->echo("y").get() == "y");
+      }
+    }
+  }
+}
+
+SCENARIO("Handlers can borrow their arguments from the received frame", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  const std::vector<uint8_t> salt = { 1, 2, 3 };
+  GIVEN("a host that runs handlers inline") {
+    Loopback loopback;
+    Keys* keys = loopback.client.Get<Keys>();
+    THEN("a large key arrives intact") {
+      std::string key(8192, 'k');
+      for (size_t n = 0; n < key.size(); n += 13) key[n] = static_cast<char>('a' + n % 26);
+      CHECK(keys->digest(key, salt).get() == digestOf(key, salt));
+    }
+  }
+  GIVEN("a host that runs handlers on a thread pool, after later frames have been received") {
+    ThreadPoolExecutor pool(2);
+    Loopback loopback(&pool);
+    Keys* keys = loopback.client.Get<Keys>();
+    THEN("the frames of the held calls stay intact") {
+      std::vector<std::string> keyList;
+      std::vector<future<uint64_t>> digests;
+      for (int n = 0; n < 64; ++n) {
+        keyList.push_back(std::string(4096, static_cast<char>('a' + n % 26)) + std::to_string(n));
+        digests.push_back(keys->digest(keyList.back(), salt));
+      }
+      for (int n = 0; n < 64; ++n) CHECK(digests[n].get() == digestOf(keyList[n], salt));
+    }
+  }
+}
+
+SCENARIO("Calls made inside a batch are written together", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Echo") {
+    Loopback loopback;
+    Echo* echo = loopback.client.Get<Echo>();
+
+    WHEN("we make many calls inside a batch") {
+      std::vector<future<std::string>> replies;
+      RpcClient::Batch batch(loopback.client);
+      for (int n = 0; n < 50; ++n) {
+        replies.push_back(echo->echo(std::to_string(n)));
+      }
+      THEN("they are counted and sent once their results are needed") {
+        CHECK(batch.calls() == 50);
+        CHECK(batch.bytes() > 50 * 3);
+        for (int n = 0; n < 50; ++n) {
+          CHECK(replies[n].get() == std::to_string(n));
+        }
+      }
+    }
+    WHEN("another thread needs a result while the batch is still open") {
+      std::string reply;
+      {
+        RpcClient::Batch batch(loopback.client);
+        future<std::string> f = echo->echo("a");
+        std::thread waiter([&]{ reply = f.get(); });
+        waiter.join();
+      }
+      THEN("the batch is flushed for it") {
+        CHECK(reply == "a");
+      }
+    }
+  }
+}
+
+SCENARIO("A call whose handler fails is answered with the error", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a host that runs handlers inline") {
+    Loopback loopback;
+    Echo* echo = loopback.client.Get<Echo>();
+    THEN("the caller gets the message of what the handler threw or returned") {
+      CHECK_THROWS_WITH(echo->echo("throw").get(), "Cannot echo that");
+      CHECK_THROWS_WITH(echo->echo("fail").get(), "Echo failed");
+      CHECK(echo->echo("ok").get() == "ok");
+    }
+  }
+  GIVEN("a host that runs handlers on a thread pool") {
+    ThreadPoolExecutor pool(2);
+    Loopback loopback(&pool);
+    Echo* echo = loopback.client.Get<Echo>();
+    THEN("the caller gets the message of what the handler threw or returned") {
+      CHECK_THROWS_WITH(echo->echo("throw").get(), "Cannot echo that");
+      CHECK_THROWS_WITH(echo->echo("fail").get(), "Echo failed");
+      CHECK(echo->echo("ok").get() == "ok");
+    }
+  }
+}
+
+SCENARIO("Handlers and continuations run on the configured executor", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a host without an executor") {
+    Loopback loopback;
+    Wide* wide = loopback.client.Get<Wide>();
+    THEN("handlers run on the IO thread") {
+      wide->touch().get();
+      CHECK(loopback.wide.toucher == loopback.thread.get_id());
+    }
+  }
+  GIVEN("a host that runs its handlers on a thread pool") {
+    ThreadPoolExecutor pool(2);
+    Loopback loopback(&pool);
+    Wide* wide = loopback.client.Get<Wide>();
+    Lookup* lookup = loopback.client.Get<Lookup>();
+    THEN("handlers run on the pool") {
+      wide->touch().get();
+      CHECK(loopback.wide.toucher != loopback.thread.get_id());
+      CHECK(loopback.wide.toucher != std::this_thread::get_id());
+    }
+    THEN("pipelined calls still see the results they depend on") {
+      loopback.lookup.release(3);
+      CHECK(lookup->nameOf(lookup->idOf("x")).get() == "name3");
+    }
+  }
+  GIVEN("a client with an executor") {
+    ThreadPoolExecutor pool(1);
+    Loopback loopback;
+    loopback.client.setExecutor(&pool);
+    Echo* echo = loopback.client.Get<Echo>();
+    THEN("continuations run on it") {
+      std::thread::id poolThread;
+      pool.submit([&poolThread]{ poolThread = std::this_thread::get_id(); });
+      auto ran = echo->echo("x").then([](boost::future<std::string> f){
+        f.get();
+        return std::this_thread::get_id();
+      });
+      CHECK(ran.get() == poolThread);
+    }
+  }
+}
+
+SCENARIO("A lazy client holds calls back until their results are needed", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a lazy client that only sends on demand") {
+    Loopback loopback;
+    LazyOptions options;
+    options.maxDelay = std::chrono::hours(1);
+    loopback.client.setLazy(true, options);
+    Wide* wide = loopback.client.Get<Wide>();
+    Lookup* lookup = loopback.client.Get<Lookup>();
+
+    WHEN("the future of a call is dropped unused") {
+      wide->touch();
+      wide->touch().get();
+      THEN("that call is never sent") {
+        CHECK(loopback.wide.touched == 1);
+      }
+    }
+    WHEN("a call takes the future of an earlier queued call") {
+      loopback.lookup.release(5);
+      future<std::string> name = lookup->nameOf(lookup->idOf("x"));
+      THEN("both are sent, in order, once the result is needed") {
+        CHECK(name.get() == "name5");
+      }
+    }
+  }
+  GIVEN("a lazy client with a short delay") {
+    Loopback loopback;
+    LazyOptions options;
+    options.maxDelay = std::chrono::milliseconds(1);
+    loopback.client.setLazy(true, options);
+    Wide* wide = loopback.client.Get<Wide>();
+
+    WHEN("nobody waits for a call") {
+      future<void> touched = wide->touch();
+      THEN("it is sent once the delay has passed") {
+        for (int n = 0; n < 5000 && !touched.is_ready(); ++n) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        CHECK(touched.is_ready());
+      }
+    }
+  }
+}
+
+namespace {
+
+const Rapscallion::MethodMetrics* find(const Rapscallion::MetricsSnapshot& snapshot, const std::string& method) {
+  for (auto& m : snapshot) {
+    if (m.methodName == method) return &m;
+  }
+  return nullptr;
+}
+
+}
+
+SCENARIO("Proxies and dispatchers record per-method metrics", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("latency buckets") {
+    THEN("every value falls within the bounds of its bucket") {
+      for (uint64_t value : { 0ull, 1ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, 1ull << 39 }) {
+        size_t bucket = LatencyHistogram::bucketOf(value);
+        INFO(value);
+        CHECK(LatencyHistogram::lowerBound(bucket) <= value);
+        CHECK(value <= LatencyHistogram::upperBound(bucket));
+        CHECK(LatencyHistogram::upperBound(bucket) - LatencyHistogram::lowerBound(bucket) <= value / 8);
+      }
+      CHECK(LatencyHistogram::bucketOf(uint64_t(-1)) == LatencyHistogram::bucketCount - 1);
+    }
+  }
+  GIVEN("a client that has made some calls") {
+    Loopback loopback;
+    Echo* echo = loopback.client.Get<Echo>();
+    for (int n = 0; n < 100; ++n) {
+      CHECK(echo->echo("hello").get() == "hello");
+    }
+    WHEN("we take a snapshot of the client") {
+      MetricsSnapshot snapshot = loopback.client.metrics();
+      const MethodMetrics* m = find(snapshot, "echo");
+      THEN("it counts the calls, their bytes and latencies") {
+        REQUIRE(m);
+        CHECK(m->calls == 100);
+        CHECK(m->inFlight == 0);
+        CHECK(m->failures == 0);
+        CHECK(m->requestBytes >= 100 * 6);
+        CHECK(m->replyBytes >= 100 * 6);
+        CHECK(m->latency.count() == 100);
+        CHECK(m->latency.percentile(0.5) <= m->latency.percentile(0.99));
+        CHECK(m->latency.percentile(0.5) > 0);
+      }
+    }
+    WHEN("we ask the host for its metrics over RPC") {
+      loopback.host.serveMetrics();
+      MetricsSnapshot snapshot = loopback.client.Get<RpcMetrics>()->snapshot().get();
+      const MethodMetrics* m = find(snapshot, "echo");
+      THEN("they match the host's own snapshot") {
+        REQUIRE(m);
+        CHECK(m->calls == 100);
+        CHECK(m->inFlight == 0);
+        CHECK(m->latency.count() == 100);
+        MetricsSnapshot own = loopback.host.metrics();
+        const MethodMetrics* local = find(own, "echo");
+        REQUIRE(local);
+        CHECK(local->requestBytes == m->requestBytes);
+        CHECK(local->latency.counts == m->latency.counts);
+      }
+    }
+  }
+}
+
+SCENARIO("Streams are sent in chunks as they are read", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Numbers") {
+    Loopback loopback;
+    Numbers* numbers = loopback.client.Get<Numbers>();
+
+    WHEN("a call returns a stream") {
+      stream<int> values = numbers->range(100000, 1000).get();
+      THEN("the chunks arrive in order") {
+        std::vector<int> all;
+        size_t chunks = 0;
+        values.for_each([&](const std::vector<int>& chunk){
+          all.insert(all.end(), chunk.begin(), chunk.end());
+          ++chunks;
+        }).get();
+        CHECK(chunks == 100);
+        REQUIRE(all.size() == 100000);
+        for (int n = 0; n < 100000; ++n) {
+          if (all[n] != n) FAIL("value " << n << " is " << all[n]);
+        }
+      }
+    }
+    WHEN("the client does not read the stream") {
+      stream<int> values = numbers->range(100000, 10).get();
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      THEN("the host stops producing after a few chunks") {
+        CHECK(loopback.numbers.produced <= int(StreamTable::window + 4));
+        long total = 0;
+        values.for_each([&](const std::vector<int>& chunk){
+          for (int value : chunk) total += value;
+        }).get();
+        CHECK(total == 100000L * 99999 / 2);
+        CHECK(loopback.numbers.produced == 10000);
+      }
+    }
+    WHEN("a call takes a stream as its argument") {
+      stream<int> values;
+      future<long> total = numbers->sum(values);
+      for (int n = 0; n < 1000; ++n) {
+        values.write(std::vector<int>(100, n)).wait();
+      }
+      values.close();
+      THEN("the host reads it as it is written") {
+        CHECK(total.get() == 100L * 999 * 1000 / 2);
+      }
+    }
+    WHEN("the stream fails") {
+      stream<int> values = numbers->broken().get();
+      THEN("the reader gets the chunks before the error") {
+        CHECK(values.next().get() == std::vector<int>({ 1, 2, 3 }));
+        CHECK_THROWS_WITH(values.next().get(), "Out of numbers");
+      }
+    }
+  }
+}
+
+SCENARIO("Large writes are compressed once both sides agree", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client and host that both compress writes of 1 KiB or more") {
+    Loopback loopback;
+    CompressionOptions options;
+    options.enabled = true;
+    options.threshold = 1024;
+    loopback.host.setCompression(options);
+    loopback.client.setCompression(options);
+    Echo* echo = loopback.client.Get<Echo>();
+    // The first round trip makes sure each side has seen the other accept compression.
+    CHECK(echo->echo("hello").get() == "hello");
+
+    WHEN("we send a large repetitive argument") {
+      std::string text;
+      for (int n = 0; text.size() < 256 * 1024; ++n) text += "record " + std::to_string(n % 100) + ";";
+      THEN("it arrives intact and both directions were compressed") {
+        CHECK(echo->echo(text).get() == text);
+        CHECK(loopback.client.connection().compressedWrites() == 1);
+        CHECK(loopback.host.handles.front()->conn->compressedWrites() == 1);
+      }
+    }
+    WHEN("we send small calls") {
+      for (int n = 0; n < 10; ++n) CHECK(echo->echo(std::to_string(n)).get() == std::to_string(n));
+      THEN("nothing is compressed") {
+        CHECK(loopback.client.connection().compressedWrites() == 0);
+      }
+    }
+    WHEN("we batch many small calls") {
+      std::vector<future<std::string>> replies;
+      {
+        RpcClient::Batch batch(loopback.client);
+        for (int n = 0; n < 200; ++n) replies.push_back(echo->echo("item " + std::to_string(n)));
+      }
+      THEN("the batch is compressed as a whole and every call is answered") {
+        for (int n = 0; n < 200; ++n) CHECK(replies[n].get() == "item " + std::to_string(n));
+        CHECK(loopback.client.connection().compressedWrites() == 1);
+      }
+    }
+  }
+}
+
+namespace {
+
+// A Compressed control frame holding the given frames.
+Rapscallion::Serializer compressedFrame(const Rapscallion::Serializer& frames) {
+  using namespace Rapscallion;
+  std::vector<uint8_t> packed;
+  lz::compress(frames.data(), frames.size(), packed);
+  Serializer s;
+  serializer<size_t>::write(s, controlChannel);
+  serializer<size_t>::write(s, Compressed);
+  serializer<size_t>::write(s, LzCodec);
+  serializer<size_t>::write(s, frames.size());
+  s.addBytes(packed.data(), packed.size());
+  return s;
+}
+
+// Reads until the peer closes the socket, for at most five seconds. Returns whether it did.
+bool closedByPeer(boost::asio::ip::tcp::socket& socket) {
+  socket.non_blocking(true);
+  uint8_t buffer[4096];
+  for (int n = 0; n < 5000; ++n) {
+    boost::system::error_code error;
+    socket.read_some(boost::asio::buffer(buffer), error);
+    if (error == boost::asio::error::would_block) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } else if (error) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads frames for at most five seconds, until a CallFailed one. Returns its request id and message,
+// or an empty message if none arrived.
+std::pair<size_t, std::string> callFailure(boost::asio::ip::tcp::socket& socket) {
+  using namespace Rapscallion;
+  socket.non_blocking(true);
+  Deserializer d;
+  for (int n = 0; n < 5000; ++n) {
+    while (d.HasFullPacket()) {
+      if (serializer<size_t>::read(d) == controlChannel && serializer<size_t>::read(d) == CallFailed) {
+        serializer<size_t>::read(d);
+        size_t requestId = serializer<size_t>::read(d);
+        return std::make_pair(requestId, serializer<std::string>::read(d));
+      }
+      d.RemovePacket();
+    }
+    boost::system::error_code error;
+    uint8_t* space = d.prepare();
+    size_t read = socket.read_some(boost::asio::buffer(space, d.capacity()), error);
+    if (error == boost::asio::error::would_block) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } else if (error) {
+      break;
+    } else {
+      d.commit(read);
+    }
+  }
+  return std::make_pair(size_t(0), std::string());
+}
+
+}
+
+SCENARIO("A peer that sends undecodable bytes is disconnected", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a host with a connected client, and another raw connection") {
+    Loopback loopback;
+    loopback.host.setMaxFrameSize(64 * 1024);
+    Echo* echo = loopback.client.Get<Echo>();
+    boost::asio::ip::tcp::socket raw = loopback.connect();
+
+    WHEN("the raw connection sends a corrupt compressed frame") {
+      Serializer s;
+      serializer<size_t>::write(s, controlChannel);
+      serializer<size_t>::write(s, Compressed);
+      serializer<size_t>::write(s, LzCodec);
+      serializer<size_t>::write(s, 100);
+      const std::vector<uint8_t> garbage(20, 0xFF);
+      s.addBytes(garbage.data(), garbage.size());
+      boost::asio::write(raw, boost::asio::buffer(s.data(), s.size()));
+      THEN("the host closes that connection and keeps serving the client") {
+        CHECK(closedByPeer(raw));
+        CHECK(echo->echo("still here").get() == "still here");
+      }
+    }
+    WHEN("the raw connection sends a compressed frame inside another") {
+      Serializer accept;
+      serializer<size_t>::write(accept, controlChannel);
+      serializer<size_t>::write(accept, AcceptCompression);
+      serializer<size_t>::write(accept, LzCodec);
+      Serializer s = compressedFrame(compressedFrame(accept));
+      boost::asio::write(raw, boost::asio::buffer(s.data(), s.size()));
+      THEN("the host closes that connection and keeps serving the client") {
+        CHECK(closedByPeer(raw));
+        CHECK(echo->echo("still here").get() == "still here");
+      }
+    }
+    WHEN("the raw connection sends a compressed frame that expands past the limit") {
+      Serializer s;
+      serializer<size_t>::write(s, controlChannel);
+      serializer<size_t>::write(s, Compressed);
+      serializer<size_t>::write(s, LzCodec);
+      serializer<size_t>::write(s, 1 << 20);
+      const std::vector<uint8_t> garbage(8192, 0xFF);
+      s.addBytes(garbage.data(), garbage.size());
+      boost::asio::write(raw, boost::asio::buffer(s.data(), s.size()));
+      THEN("the host closes that connection and keeps serving the client") {
+        CHECK(closedByPeer(raw));
+        CHECK(echo->echo("still here").get() == "still here");
+      }
+    }
+    WHEN("the raw connection announces a frame over the limit") {
+      // 1 << 21 bytes, most significant group first.
+      const std::vector<uint8_t> prefix = { 0x81, 0x80, 0x80, 0x00 };
+      boost::asio::write(raw, boost::asio::buffer(prefix));
+      THEN("the host closes that connection and keeps serving the client") {
+        CHECK(closedByPeer(raw));
+        CHECK(echo->echo("still here").get() == "still here");
+      }
+    }
+  }
+}
+
+SCENARIO("Calls the host cannot dispatch fail", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a host providing Echo") {
+    Loopback loopback;
+    Echo* echo = loopback.client.Get<Echo>();
+    CHECK(echo->echo("a").get() == "a");
+
+    WHEN("a call names a method the host's interface does not have") {
+      THEN("it fails with \"No such method\"") {
+        CHECK_THROWS_WITH(static_cast<EchoProxy*>(echo)->missing("b").get(), "No such method");
+        CHECK(echo->echo("c").get() == "c");
+      }
+    }
+    WHEN("a call names an interface the host does not have") {
+      THEN("it fails with \"No such interface\"") {
+        CHECK_THROWS_WITH(loopback.client.Get<Missing>()->nothing().get(), "No such interface");
+        CHECK(echo->echo("c").get() == "c");
+      }
+    }
+  }
+  GIVEN("a raw connection to the host") {
+    Loopback loopback;
+    boost::asio::ip::tcp::socket raw = loopback.connect();
+
+    WHEN("it calls a method id the interface does not have") {
+      Serializer s;
+      serializer<size_t>::write(s, 1);
+      serializer<size_t>::write(s, 99);
+      serializer<size_t>::write(s, 7);
+      boost::asio::write(raw, boost::asio::buffer(s.data(), s.size()));
+      THEN("the call is answered with CallFailed") {
+        CHECK(callFailure(raw) == std::make_pair(size_t(7), std::string("No such method")));
+      }
+    }
+    WHEN("it calls an interface id the host does not have") {
+      Serializer s;
+      serializer<size_t>::write(s, 99);
+      serializer<size_t>::write(s, 0);
+      serializer<size_t>::write(s, 8);
+      boost::asio::write(raw, boost::asio::buffer(s.data(), s.size()));
+      THEN("the call is answered with CallFailed") {
+        CHECK(callFailure(raw) == std::make_pair(size_t(8), std::string("No such interface")));
+      }
+    }
+  }
+}
+
+SCENARIO("A client fails its calls when its connection closes", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client connected to a peer that never answers, with a call outstanding") {
+    Loopback loopback;
+    boost::asio::ip::tcp::acceptor acceptor(loopback.io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    boost::asio::ip::tcp::socket socket(loopback.io_service);
+    socket.connect(acceptor.local_endpoint());
+    boost::asio::ip::tcp::socket peer = acceptor.accept();
+    RpcClient client(std::move(socket));
+    Echo* echo = client.Get<Echo>();
+    future<std::string> outstanding = echo->echo("a");
+
+    WHEN("the peer closes the connection") {
+      peer.close();
+      THEN("the outstanding call and later ones fail") {
+        CHECK_THROWS_WITH(outstanding.get(), "Disconnected");
+        CHECK_THROWS_WITH(echo->echo("b").get(), "Disconnected");
+      }
+    }
+    WHEN("another call waits for room, and the peer closes the connection") {
+      CallLimits limits;
+      limits.maxCalls = 1;
+      client.setLimits(limits);
+      future<std::string> waiting;
+      std::thread caller([&]{ waiting = echo->echo("b"); });
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      peer.close();
+      caller.join();
+      THEN("the waiting call is let through, and fails too") {
+        CHECK_THROWS_WITH(outstanding.get(), "Disconnected");
+        CHECK_THROWS_WITH(waiting.get(), "Disconnected");
+      }
+    }
+  }
+}
+
+SCENARIO("A proxy outlives its client", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a proxy whose client has been destroyed") {
+    Loopback loopback;
+    Echo* echo;
+    {
+      RpcClient other(loopback.connect());
+      echo = other.Get<Echo>();
+      CHECK(echo->echo("a").get() == "a");
+    }
+    THEN("calls through it fail at once") {
+      CHECK_THROWS_WITH(echo->echo("b").get(), "Disconnected");
+    }
+  }
+}
+
+SCENARIO("A client can spread its calls over several connections", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client with four connections to the host") {
+    Loopback loopback;
+    RpcClient client(connectAll(loopback.io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), loopback.host.port()), 4));
+    Lookup* lookup = client.Get<Lookup>();
+    Echo* echo = client.Get<Echo>();
+    CHECK(client.lanes() == 4);
+    lookup->nameOf(boost::make_ready_future(0)).get();
+
+    WHEN("one connection has a call waiting for its result") {
+      future<int> id = lookup->idOf("x");
+      const size_t busy = id.origin()->lane(id.requestId());
+      future<std::string> name = lookup->nameOf(std::move(id));
+      THEN("a call that takes its future follows it there, and other calls avoid it") {
+        CHECK(name.origin()->lane(name.requestId()) == busy);
+        CHECK(!name.is_ready());
+        std::set<size_t> used;
+        std::vector<future<std::string>> replies;
+        {
+          // Batched calls stay outstanding until the batch is written, so their lanes can be read.
+          RpcClient::Batch batch(client);
+          for (int n = 0; n < 6; ++n) {
+            replies.push_back(echo->echo(std::to_string(n)));
+            used.insert(replies.back().origin()->lane(replies.back().requestId()));
+          }
+        }
+        for (int n = 0; n < 6; ++n) CHECK(replies[n].get() == std::to_string(n));
+        CHECK(used.size() == 3);
+        CHECK(used.count(busy) == 0);
+        loopback.lookup.release(42);
+        CHECK(name.get() == "name42");
+      }
+    }
+    WHEN("many calls are in flight at once") {
+      std::vector<future<std::string>> replies;
+      for (int n = 0; n < 400; ++n) replies.push_back(echo->echo(std::to_string(n)));
+      THEN("each gets its own reply") {
+        for (int n = 0; n < 400; ++n) CHECK(replies[n].get() == std::to_string(n));
+      }
+    }
+  }
+}
+
+SCENARIO("A client can call implementations in its own process directly", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a client of a host in the same process, with short-circuiting enabled") {
+    Loopback loopback;
+    loopback.client.setShortCircuit(true);
+    Echo* echo = loopback.client.Get<Echo>();
+    THEN("it gets the implementation itself, and no call goes over the connection") {
+      CHECK(echo == &loopback.impl);
+      CHECK(echo->echo("hello").get() == "hello");
+      CHECK(loopback.client.metrics().empty());
+    }
+  }
+  GIVEN("a client of a host that runs its handlers on a thread pool") {
+    ThreadPoolExecutor pool(2);
+    Loopback loopback(&pool);
+    loopback.client.setShortCircuit(true);
+    Echo* echo = loopback.client.Get<Echo>();
+    THEN("it still gets a proxy, so handlers keep running on the pool") {
+      CHECK(echo != &loopback.impl);
+      CHECK(echo->echo("hello").get() == "hello");
+    }
+  }
+  GIVEN("a host on one loopback address, and a client of another listener on the same port") {
+    Loopback loopback;
+    RpcHost local(loopback.io_service);
+    local.listen(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    local.Register(&loopback.impl);
+    // Stands in for a listener of another process.
+    boost::asio::ip::tcp::acceptor other(loopback.io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address_v4("127.0.0.2"), local.port()));
+    boost::asio::ip::tcp::socket socket(loopback.io_service);
+    socket.connect(other.local_endpoint());
+    RpcClient client(std::move(socket));
+    client.setShortCircuit(true);
+    THEN("it does not get the implementation of the host on the other address") {
+      CHECK(client.Get<Echo>() != &loopback.impl);
+    }
+  }
+  GIVEN("a client that leaves short-circuiting off") {
+    Loopback loopback;
+    THEN("it gets a proxy") {
+      CHECK(loopback.client.Get<Echo>() != &loopback.impl);
+    }
+  }
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+SCENARIO("Calls round-trip over a Unix domain socket", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a host that also listens on a socket path, and a client connected to it") {
+    Loopback loopback;
+    const std::string path = "/tmp/rapscallion-test-" + std::to_string(::getpid()) + ".sock";
+    ::unlink(path.c_str());
+    loopback.host.listen(boost::asio::local::stream_protocol::endpoint(path));
+    boost::asio::local::stream_protocol::socket socket(loopback.io_service);
+    socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+    RpcClient client(std::move(socket));
+    Echo* echo = client.Get<Echo>();
+
+    WHEN("we make calls, small and large") {
+      const std::string large(1 << 20, 'x');
+      THEN("the replies carry the arguments back") {
+        CHECK(echo->echo("hello").get() == "hello");
+        CHECK(echo->echo(large).get() == large);
+      }
+    }
+    ::unlink(path.c_str());
+  }
+}
+#endif
+
+#if defined(__linux__)
+SCENARIO("Calls round-trip over shared memory rings", "[loopback]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  GIVEN("a host that accepts shared memory connections") {
+    Loopback loopback;
+    const std::string path = "/tmp/rapscallion-shm-test-" + std::to_string(::getpid()) + ".sock";
+    ::unlink(path.c_str());
+    loopback.host.listenShared(path);
+    // Rings far smaller than the large argument, so it has to wrap around many times.
+    SharedMemoryOptions options;
+    options.ringBytes = 4096;
+    const std::string large(1 << 20, 'x');
+
+    WHEN("a client sleeps on an empty ring") {
+      RpcClient client(connectShared(loopback.io_service, path, options));
+      Echo* echo = client.Get<Echo>();
+      THEN("it is woken for every reply") {
+        for (int n = 0; n < 100; ++n) CHECK(echo->echo(std::to_string(n)).get() == std::to_string(n));
+        CHECK(echo->echo(large).get() == large);
+      }
+    }
+    WHEN("a client polls its ring") {
+      options.poll = std::chrono::microseconds(50);
+      RpcClient client(connectShared(loopback.io_service, path, options));
+      Echo* echo = client.Get<Echo>();
+      THEN("the replies arrive the same") {
+        for (int n = 0; n < 100; ++n) CHECK(echo->echo(std::to_string(n)).get() == std::to_string(n));
+        CHECK(echo->echo(large).get() == large);
+      }
+    }
+    ::unlink(path.c_str());
+  }
+}
+#endif
@@ -1,7 +1,13 @@
 #include <catch/catch.hpp>
 #include <cmath>
+#include <cstring>
+#include <iomanip>
 #include <limits>
+#include <random>
+#include <string>
+#include <vector>
 #include <Serializer.h>
+#include "FloatReference.h"
 
 namespace Rapscallion {
 namespace test {
@@ -11,8 +17,8 @@ struct byte_view
   constexpr byte_view() = default;
 
   byte_view(const Deserializer& d)
-    : first(reinterpret_cast<const char*>(d.buffer.data()))
-    , last (reinterpret_cast<const char*>(d.buffer.data() + d.buffer.size()))
+    : first(reinterpret_cast<const char*>(d.unread()))
+    , last (reinterpret_cast<const char*>(d.unread() + d.unreadSize()))
   {}
 
   template <size_t N>
@@ -44,7 +50,7 @@ std::ostream& operator<<(std::ostream& os, const byte_view& v) {
   }
   os << '"';
   os.setf(oldFlags);
-  os.fill(oldFlags);
+  os.fill(oldFill);
   return os;
 }
 
@@ -58,7 +64,7 @@ void test(const std::string& inStr, const double in, const std::ptrdiff_t expect
       THEN("the serialized output meets expectations") {
         const byte_view serialized(d);
         if (expected_size >= 0)
-          CHECK(serialized.size() == expected_size);
+          CHECK(static_cast<std::ptrdiff_t>(serialized.size()) == expected_size);
 
         // largest encoding of IEEE754 binary64 float:
         //  (11 exponent bits + exponent sign + NaN/inf flag) = 13 bits / 7 bit/byte = 2 byte
@@ -90,7 +96,104 @@ void test(const std::string& inStr, const double in, const byte_view& expected_s
   return test(inStr, in, expected_serialization.size(), expected_serialization);
 }
 
+struct Point {
+  int32_t x, y;
+  bool operator==(const Point& rhs) const { return x == rhs.x && y == rhs.y; }
+};
+
+}
+
+template <>
+struct packed_encoding<test::Point> : std::true_type {};
+
+namespace test {
+
+template <typename T>
+T roundTrip(const T& value, size_t& serializedSize) {
+  Serializer s;
+  serializer<T>::write(s, value);
+  serializedSize = s.size();
+  Deserializer d(s);
+  return serializer<T>::read(d);
+}
+
+// The size of the value without the frame's length prefix.
+template <typename T>
+size_t payloadSize(const T& value) {
+  Serializer s;
+  serializer<T>::write(s, value);
+  Deserializer d(s);
+  return d.size - d.offs;
+}
+
+}
+}
+
+SCENARIO("Serializing strings and arrays in bulk", "[serialization]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  size_t serializedSize = 0;
+
+  GIVEN("a large string") {
+    std::string text(1024 * 1024, 'x');
+    for (size_t n = 0; n < text.size(); n += 13) text[n] = static_cast<char>(n);
+    THEN("it round-trips with a three byte length in front") {
+      CHECK(roundTrip(text, serializedSize) == text);
+      CHECK(serializedSize == 3 + 3 + text.size());
+    }
+  }
+  GIVEN("a vector of bytes covering every value") {
+    std::vector<uint8_t> bytes;
+    for (int n = 0; n < 256; ++n) bytes.push_back(static_cast<uint8_t>(n));
+    THEN("it is sent as one byte per element") {
+      CHECK(roundTrip(bytes, serializedSize) == bytes);
+      CHECK(serializedSize == 2 + 2 + bytes.size());
+    }
+  }
+  GIVEN("a vector of a type that opted into a packed encoding") {
+    std::vector<Point> points{ {1, -2}, {3, 4}, {-5, 6} };
+    THEN("it is sent as the raw elements") {
+      CHECK(roundTrip(points, serializedSize) == points);
+      CHECK(serializedSize == 1 + 1 + points.size() * sizeof(Point));
+    }
+    AND_WHEN("its length claims more elements than the frame holds") {
+      Serializer s;
+      serializer<std::uint_least64_t>::write(s, std::uint_least64_t(1) << 62);
+      Deserializer d(s);
+      THEN("reading it fails") {
+        CHECK_THROWS(serializer<std::vector<Point>>::read(d));
+      }
+    }
+  }
 }
+
+SCENARIO("Precomputing serialized sizes", "[serialization]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+
+  THEN("integers and strings are sized exactly") {
+    for (long value : { 0L, 63L, 64L, -64L, -65L, 1L << 40, -(1L << 40), std::numeric_limits<long>::max(), std::numeric_limits<long>::min() }) {
+      CHECK(serialized_size<long>::of(value) == payloadSize(value));
+      size_t size;
+      CHECK(roundTrip(value, size) == value);
+    }
+    for (size_t length : { 0, 127, 128, 20000 }) {
+      std::string text(length, 'x');
+      CHECK(serialized_size<std::string>::of(text) == payloadSize(text));
+    }
+  }
+  THEN("other values are bounded from above") {
+    std::vector<double> numbers{ 0.0, M_PI, -std::numeric_limits<double>::max(), std::numeric_limits<double>::denorm_min() };
+    CHECK(serialized_size<std::vector<double>>::of(numbers) >= payloadSize(numbers));
+    std::vector<std::vector<bool>> nested{ { true, false }, {} };
+    CHECK(serialized_size<decltype(nested)>::of(nested) == payloadSize(nested));
+  }
+  THEN("the bound for floating point numbers is the largest encoding") {
+    CHECK(serialized_size<double>::of(0.0) == payloadSize(-std::numeric_limits<double>::max()));
+    CHECK(serialized_size<double>::of(0.0) == payloadSize(std::nextafter(std::numeric_limits<double>::min(), 0.0)));
+    CHECK(serialized_size<float>::of(0.0f) == payloadSize(-std::numeric_limits<float>::max()));
+    CHECK(serialized_size<float>::of(0.0f) == payloadSize(std::nextafter(std::numeric_limits<float>::min(), 0.0f)));
+  }
 }
 
 SCENARIO("Serializing floating point numbers", "[serialization]") {
@@ -134,3 +237,110 @@ SCENARIO("Serializing floating point numbers", "[serialization]") {
 #undef STRIFY
 #undef TEST
 }
+
+SCENARIO("Serializing single precision numbers", "[serialization]") {
+  using namespace Rapscallion;
+  const float values[] = {
+    0.0f, -0.0f, 1.0f, -2.0f, 0.1f, static_cast<float>(M_PI),
+    std::numeric_limits<float>::max(), std::numeric_limits<float>::min(),
+    std::numeric_limits<float>::denorm_min(), -std::numeric_limits<float>::denorm_min(),
+    std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+  };
+  GIVEN("numbers across the single precision range") {
+    for (float value : values) {
+      INFO("value: " << value);
+      Serializer asFloat, asDouble;
+      serializer<float>::write(asFloat, value);
+      serializer<double>::write(asDouble, value);
+      CHECK(std::vector<uint8_t>(asFloat.data(), asFloat.data() + asFloat.size()) == std::vector<uint8_t>(asDouble.data(), asDouble.data() + asDouble.size()));
+      Deserializer d(asFloat);
+      const float read = serializer<float>::read(d);
+      CHECK(std::memcmp(&read, &value, sizeof(value)) == 0);
+    }
+  }
+  GIVEN("a double that is not exactly representable in single precision") {
+    Serializer s;
+    serializer<double>::write(s, M_PI);
+    Deserializer d(s);
+    THEN("it is read as the nearest float") {
+      CHECK(serializer<float>::read(d) == static_cast<float>(M_PI));
+    }
+  }
+}
+
+namespace Rapscallion {
+namespace test {
+
+// Random bit patterns, with the exponent field cleared or filled in half of them so that zeroes,
+// subnormals, infinities and NaNs come up as well.
+template <typename Bits, int exponentBits, int mantissaBits>
+Bits randomFloatBits(std::mt19937_64& rng) {
+  const Bits exponentMask = ((Bits(1) << exponentBits) - 1) << mantissaBits;
+  Bits bits = Bits(rng());
+  switch (rng() % 8) {
+    case 0: bits &= ~exponentMask; break;
+    case 1: bits |= exponentMask; break;
+    case 2: bits &= ~exponentMask & ~((Bits(1) << (rng() % (mantissaBits + 1))) - 1); break;
+    case 3: bits |= exponentMask; bits &= ~((Bits(1) << mantissaBits) - 1); break;
+  }
+  return bits;
+}
+
+template <typename Float>
+bool sameValue(Float lhs, Float rhs) {
+  return (std::isnan(lhs) && std::isnan(rhs)) || std::memcmp(&lhs, &rhs, sizeof(Float)) == 0;
+}
+
+std::vector<uint8_t> bytesOf(const Serializer& s) {
+  return std::vector<uint8_t>(s.data(), s.data() + s.size());
+}
+
+}
+}
+
+SCENARIO("Floating point numbers are encoded as by the frexp/ldexp reference", "[serialization]") {
+  using namespace Rapscallion;
+  using namespace Rapscallion::test;
+  std::mt19937_64 rng(14);
+  GIVEN("random double precision bit patterns") {
+    for (int n = 0; n < (1 << 18); ++n) {
+      const std::uint64_t bits = randomFloatBits<std::uint64_t, 11, 52>(rng);
+      double value;
+      std::memcpy(&value, &bits, sizeof(value));
+      Serializer actual, expected;
+      serializer<double>::write(actual, value);
+      reference::writeDouble(expected, value);
+      if (bytesOf(actual) != bytesOf(expected)) {
+        INFO("bits: " << std::hex << bits);
+        REQUIRE(bytesOf(actual) == bytesOf(expected));
+      }
+      Deserializer asDouble(actual), asFloat(actual);
+      const double readDouble = serializer<double>::read(asDouble);
+      const float readFloat = serializer<float>::read(asFloat);
+      Deserializer refDouble(expected), refFloat(expected);
+      if (!sameValue(readDouble, reference::readDouble(refDouble)) || !sameValue(readFloat, reference::readFloat(refFloat))) {
+        INFO("bits: " << std::hex << bits);
+        FAIL("decoded differently from the reference");
+      }
+    }
+  }
+  GIVEN("random single precision bit patterns") {
+    for (int n = 0; n < (1 << 18); ++n) {
+      const std::uint32_t bits = randomFloatBits<std::uint32_t, 8, 23>(rng);
+      float value;
+      std::memcpy(&value, &bits, sizeof(value));
+      Serializer actual, expected;
+      serializer<float>::write(actual, value);
+      reference::writeFloat(expected, value);
+      if (bytesOf(actual) != bytesOf(expected)) {
+        INFO("bits: " << std::hex << bits);
+        REQUIRE(bytesOf(actual) == bytesOf(expected));
+      }
+      Deserializer d(actual), ref(expected);
+      if (!sameValue(serializer<float>::read(d), reference::readFloat(ref))) {
+        INFO("bits: " << std::hex << bits);
+        FAIL("decoded differently from the reference");
+      }
+    }
+  }
+}